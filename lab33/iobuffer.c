@@ -3,9 +3,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 void free_iobuf(IOBuffer* this) {
     this->size = 0;
+    this->start = 0;
     this->count = 0;
 
     free(this->buf);
@@ -14,6 +16,7 @@ void free_iobuf(IOBuffer* this) {
 
 void init_iobuf(IOBuffer* this, size_t size) {
     this->size = size;
+    this->start = 0;
     this->count = 0;
     this->buf = malloc(this->size);
 }
@@ -26,10 +29,36 @@ size_t iob_free_space(const IOBuffer* this) {
     return this->size - this->count;
 }
 
+char* iob_data(const IOBuffer* this) {
+    return &this->buf[this->start];
+}
+
+static char* iob_tail(const IOBuffer* this) {
+    return &this->buf[this->start + this->count];
+}
+
+static size_t iob_tail_space(const IOBuffer* this) {
+    return this->size - this->start - this->count;
+}
+
+/* Moves the data to the front only when fewer than count bytes fit behind
+ * them, so every byte is moved at most once per pass through the buffer. */
+static void iob_make_room(IOBuffer* this, size_t count) {
+    if (this->start == 0 || iob_tail_space(this) >= count) return;
+
+    memmove(this->buf, iob_data(this), this->count);
+    this->start = 0;
+}
+
+/* A read into a sliver behind the data would only need another one right
+ * after, so the data are moved once less than half of the free space is
+ * left behind them. */
 ssize_t iob_recv(IOBuffer* this, int fd) {
-    const ssize_t free_space = iob_free_space(this);
-    const ssize_t count = read(fd, &this->buf[this->count], free_space);
+    iob_make_room(this, iob_free_space(this) / 2 + 1);
+
+    const ssize_t count = read(fd, iob_tail(this), iob_tail_space(this));
     if (count == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
         perror("read");
         return count;
     }
@@ -43,21 +72,18 @@ ssize_t iob_recv(IOBuffer* this, int fd) {
 }
 
 void iob_shift(IOBuffer* this, size_t offset) {
-    if (offset == 0) return;
-
     if (offset > this->count) {
         offset = this->count;
     }
 
     this->count -= offset;
-    for (size_t i = 0; i < this->count; ++i) {
-        this->buf[i] = this->buf[offset + i];
-    }
+    this->start = this->count == 0 ? 0 : this->start + offset;
 }
 
 ssize_t iob_send(IOBuffer* this, int fd) {
-    const ssize_t count = write(fd, this->buf, this->count);
+    const ssize_t count = write(fd, iob_data(this), this->count);
     if (count == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
         perror("write");
         return count;
     }
@@ -68,7 +94,8 @@ ssize_t iob_send(IOBuffer* this, int fd) {
 
 size_t iob_puts(IOBuffer* this, const char* data, size_t count) {
     const size_t put_count = iob_free_space(this) > count ? count : iob_free_space(this);
-    memcpy(&this->buf[this->count], data, put_count);
+    iob_make_room(this, put_count);
+    memcpy(iob_tail(this), data, put_count);
     this->count += put_count;
 
     return put_count;
@@ -77,11 +104,14 @@ size_t iob_puts(IOBuffer* this, const char* data, size_t count) {
 bool iob_putc(IOBuffer* this, char c) {
     if (iob_full(this)) return false;
 
-    this->buf[this->count++] = c;
+    iob_make_room(this, 1);
+    *iob_tail(this) = c;
+    this->count++;
     return true;
 }
 
 void iob_clear(IOBuffer* this) {
+    this->start = 0;
     this->count = 0;
 }
 
@@ -91,11 +121,16 @@ bool iob_empty(const IOBuffer* this) {
 
 void resize(IOBuffer* this, size_t new_size) {
     this->buf = realloc(this->buf, new_size);
+    this->size = new_size;
 }
 
+/* Grows the buffer so that free_space more bytes fit behind the data. */
 void reserve(IOBuffer* this, size_t free_space) {
-    if (iob_free_space(this) >= free_space) return;
+    if (iob_free_space(this) >= free_space) {
+        iob_make_room(this, free_space);
+        return;
+    }
 
-    const size_t new_size = iob_free_space(this) - free_space + this->size; 
-    resize(this, new_size);    
+    resize(this, this->size + free_space - iob_free_space(this));
+    iob_make_room(this, free_space);
 }
@@ -5,9 +5,13 @@
 #include <unistd.h>
 #include <stdbool.h>
 
+/* The data are the count bytes from start. Consuming only moves start, the
+ * data go back to the front once the space behind them gets too small for
+ * the next put or read. */
 typedef struct {
     char* buf;
     size_t size;
+    size_t start;
     size_t count;
 } IOBuffer;
 
@@ -18,6 +22,8 @@ int iob_full(const IOBuffer* this);
 bool iob_empty(const IOBuffer* this);
 size_t iob_free_space(const IOBuffer* this);
 
+char* iob_data(const IOBuffer* this);
+
 ssize_t iob_recv(IOBuffer* this, int fd);
 void iob_shift(IOBuffer* this, size_t offset);
 ssize_t iob_send(IOBuffer* this, int fd);
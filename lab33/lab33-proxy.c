@@ -14,24 +14,54 @@
 #include <poll.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "iobuffer.h"
+#include "pipe_buffer.h"
 #include "server_management.h"
 #include "socket_utils.h"
 #include "utils.h"
 
+/* Bounds the reads and writes one direction gets per turn, a client that
+ * still has work after it waits in the pending queue for the next turn. */
+#define TRANSFER_LIMIT 16
+
+#define CONNECT_TIMEOUT 5000
+
+#define MAX_WORKERS 64
+#define NO_CPU (-1)
+
+/* Upstream connects still in progress, oldest first. They all get the same
+ * timeout, so the oldest one always expires next. */
+typedef struct {
+    bool connecting[MAX_CLIENTS];
+    long deadlines[MAX_CLIENTS];
+    int next[MAX_CLIENTS];
+    int prev[MAX_CLIENTS];
+    int head;
+    int tail;
+} ConnectList;
+
 typedef struct {
     Server server;
-    int id_table[MAX_CLIENTS];
-    size_t client_count;
-    size_t removed_count;
+    int pending[MAX_CLIENTS];
+    size_t pending_count;
+    bool queued[MAX_CLIENTS];
+
+    ConnectList connects;
+    int cpu;
 } ProxyServer;
 
-static ProxyServer proxy_server;
+static ProxyServer* proxy_servers;
+static size_t proxy_count;
 
 void interrupt(int unused) {
     write(STDERR_FILENO, "\nInterrupted. Exiting...\n", sizeof("Interrupted. Exiting...\n"));
-    safe_cleanup(&proxy_server.server);
+    for (size_t i = 0; i < proxy_count; ++i) {
+        safe_cleanup(&proxy_servers[i].server);
+    }
     _exit(EXIT_SUCCESS);
 }
 
@@ -47,129 +77,343 @@ int has_errors(struct pollfd* pollfd) {
     return pollfd->revents & POLLERR;
 }
 
-int is_ioable(struct pollfd* pollfd) {
-    return can_read_from(pollfd) || can_write_to(pollfd) || has_errors(pollfd);
-}
+typedef enum {
+    TRANSFER_FAILED,
+    TRANSFER_DONE,
+    TRANSFER_AGAIN
+} TransferResult;
+
+/* Moves data until both sides would block or the limit is reached. A read or
+ * write that would block takes the readiness back, the next edge returns it. */
+TransferResult try_transfer(struct pollfd* sender, IOBuffer* buffer, struct pollfd* receiver) {
+    for (size_t i = 0; i < TRANSFER_LIMIT; ++i) {
+        bool progress = false;
 
-bool try_transfer(struct pollfd* sender, IOBuffer* buffer, struct pollfd* receiver) {
-    if (!iob_full(buffer) && can_read_from(sender)) {
-        const ssize_t count = iob_recv(buffer, sender->fd);
-        if (count == -1) {
-            return false;
+        if (!iob_full(buffer) && can_read_from(sender)) {
+            const ssize_t count = iob_recv(buffer, sender->fd);
+            if (count == -1) return TRANSFER_FAILED;
+
+            if (count == 0) {
+                sender->revents &= ~POLLIN;
+            }
+            progress |= count > 0;
         }
-    }
 
-    if (!iob_empty(buffer) && can_write_to(receiver)) {
-        const ssize_t count = iob_send(buffer, receiver->fd);
-        if (count == -1) {
-            return false;
+        if (!iob_empty(buffer) && can_write_to(receiver)) {
+            const ssize_t count = iob_send(buffer, receiver->fd);
+            if (count == -1) return TRANSFER_FAILED;
+
+            if (count == 0) {
+                receiver->revents &= ~POLLOUT;
+            }
+            progress |= count > 0;
         }
+
+        if (!progress) return TRANSFER_DONE;
     }
 
-    return true;
+    return TRANSFER_AGAIN;
 }
 
-void commit_remove(ProxyServer* proxy) {
-    size_t removed = 0;
-    size_t j = proxy->client_count - 1;
+/* The same loop over a pipe. A splice into a pipe that still holds data may
+ * fail for want of pipe slots, so only one into an empty pipe takes the
+ * readiness back. */
+TransferResult try_splice(struct pollfd* sender, PipeBuffer* pipe, struct pollfd* receiver) {
+    for (size_t i = 0; i < TRANSFER_LIMIT; ++i) {
+        bool progress = false;
+
+        if (!pb_full(pipe) && can_read_from(sender)) {
+            const ssize_t count = pb_recv(pipe, sender->fd);
+            if (count == -1) return TRANSFER_FAILED;
 
-    for (size_t i = 0; i < j && removed < proxy->removed_count; ++i) {
-        if (proxy->id_table[i] == REMOVED_CLIENT) {
-            while (proxy->id_table[j] == REMOVED_CLIENT && j > i) {
-                j--;
-                removed++;
+            if (count == 0 && pb_empty(pipe)) {
+                sender->revents &= ~POLLIN;
             }
-            swap_int(&proxy->id_table[i], &proxy->id_table[j]);
-            j--;
-            removed++;
+            progress |= count > 0;
         }
+
+        if (!pb_empty(pipe) && can_write_to(receiver)) {
+            const ssize_t count = pb_send(pipe, receiver->fd);
+            if (count == -1) return TRANSFER_FAILED;
+
+            if (count == 0) {
+                receiver->revents &= ~POLLOUT;
+            }
+            progress |= count > 0;
+        }
+
+        if (!progress) return TRANSFER_DONE;
+    }
+
+    return TRANSFER_AGAIN;
+}
+
+long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void init_connects(ConnectList* this) {
+    memset(this, 0, sizeof(*this));
+    this->head = NO_ID;
+    this->tail = NO_ID;
+}
+
+void push_connect(ConnectList* this, int id, long deadline) {
+    this->connecting[id] = true;
+    this->deadlines[id] = deadline;
+    this->next[id] = NO_ID;
+    this->prev[id] = this->tail;
+
+    if (this->tail == NO_ID) {
+        this->head = id;
+    } else {
+        this->next[this->tail] = id;
+    }
+    this->tail = id;
+}
+
+void unlink_connect(ConnectList* this, int id) {
+    if (!this->connecting[id]) return;
+    this->connecting[id] = false;
+
+    if (this->prev[id] == NO_ID) {
+        this->head = this->next[id];
+    } else {
+        this->next[this->prev[id]] = this->next[id];
     }
 
-    proxy->client_count -= proxy->removed_count;
-    proxy->removed_count = 0;
+    if (this->next[id] == NO_ID) {
+        this->tail = this->prev[id];
+    } else {
+        this->prev[this->next[id]] = this->prev[id];
+    }
 }
 
-void pr_remove_client(ProxyServer* proxy, int i) {
-    if (proxy->id_table[i] == REMOVED_CLIENT) return;
+void pr_remove_client(ProxyServer* proxy, int id) {
+    unlink_connect(&proxy->connects, id);
+    remove_client(&proxy->server, id);
+}
 
-    remove_client(&proxy->server, proxy->id_table[i]);
-    proxy->id_table[i] = REMOVED_CLIENT;
-    proxy->removed_count++;
+/* Drops the clients whose upstream did not answer in time. */
+void expire_connects(ProxyServer* proxy) {
+    const long now = now_ms();
+
+    while (proxy->connects.head != NO_ID && proxy->connects.deadlines[proxy->connects.head] <= now) {
+        fprintf(stderr, "connect: timed out\n");
+        pr_remove_client(proxy, proxy->connects.head);
+    }
 }
 
-void try_read(ProxyServer* proxy, size_t ioable_count) {
-    size_t ioable_processed = 0;
+/* Waits no longer than until the oldest connect expires. */
+int wait_timeout(ProxyServer* proxy) {
+    if (proxy->pending_count > 0) return 0;
+    if (proxy->connects.head == NO_ID) return -1;
+
+    const long left = proxy->connects.deadlines[proxy->connects.head] - now_ms();
+    return left > 0 ? left : 0;
+}
 
+/* The upstream socket turns writable or fails once the connect finished. */
+bool try_finish_connect(ProxyServer* proxy, int id, struct pollfd* server) {
+    if (!(server->revents & (POLLOUT | POLLERR | POLLIN))) return false;
+
+    unlink_connect(&proxy->connects, id);
+    if (finish_connect(server->fd) == EXIT_FAILURE) {
+        remove_client(&proxy->server, id);
+        return false;
+    }
+
+    server->revents = POLLOUT | (server->revents & POLLIN);
+    return true;
+}
+
+void queue_client(ProxyServer* proxy, int id) {
+    if (proxy->queued[id]) return;
+
+    proxy->queued[id] = true;
+    proxy->pending[proxy->pending_count++] = id;
+}
+
+void pump(ProxyServer* proxy, int id) {
     Server* this = &proxy->server;
 
-    for (size_t i = 0; ioable_processed < ioable_count && i < proxy->client_count; ++i) {
-        const int id = proxy->id_table[i];
+    struct pollfd* client = get_client(this, id);
+    struct pollfd* server = get_server(this, id);
+    if (client == NULL || server == NULL) return;
+
+    /* Until the upstream answers, the client's bytes only go into the
+     * buffer towards it. */
+    const bool connecting = proxy->connects.connecting[id] && !try_finish_connect(proxy, id, server);
+    if (get_server(this, id) == NULL) return;
+
+    if (has_errors(client) || has_errors(server)) {
+        pr_remove_client(proxy, id);
+        return;
+    }
+
+    PipeBuffer* ctos_pipe = get_ctos_pipe(this, id);
+    PipeBuffer* stoc_pipe = get_stoc_pipe(this, id);
+    IOBuffer* ctos = get_ctos_buffer(this, id);
+    IOBuffer* stoc = get_stoc_buffer(this, id);
+
+    TransferResult to_server;
+    TransferResult to_client = TRANSFER_FAILED;
+    if (ctos_pipe != NULL) {
+        to_server = try_splice(client, ctos_pipe, server);
+        if (to_server != TRANSFER_FAILED) {
+            to_client = connecting ? TRANSFER_DONE : try_splice(server, stoc_pipe, client);
+        }
+    } else {
+        to_server = try_transfer(client, ctos, server);
+        if (to_server != TRANSFER_FAILED) {
+            to_client = connecting ? TRANSFER_DONE : try_transfer(server, stoc, client);
+        }
+    }
+
+    if (to_client == TRANSFER_FAILED) {
+        pr_remove_client(proxy, id);
+        return;
+    }
+
+    set_server_writeable(this, id, connecting || (ctos_pipe != NULL ? !pb_empty(ctos_pipe) : !iob_empty(ctos)));
+    set_client_writeable(this, id, stoc_pipe != NULL ? !pb_empty(stoc_pipe) : !iob_empty(stoc));
+
+    if (to_server == TRANSFER_AGAIN || to_client == TRANSFER_AGAIN) {
+        queue_client(proxy, id);
+    }
+}
+
+/* Only the clients queued before this turn are served, a client that queues
+ * itself again waits for the next one. */
+void pump_pending(ProxyServer* proxy) {
+    const size_t count = proxy->pending_count;
+    int pending[MAX_CLIENTS];
+    memcpy(pending, proxy->pending, count * sizeof(*pending));
+    proxy->pending_count = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        proxy->queued[pending[i]] = false;
+        pump(proxy, pending[i]);
+    }
+}
 
-        struct pollfd* client = get_client(this, id);
-        struct pollfd* server = get_server(this, id);
+void accept_clients(ProxyServer* proxy) {
+    Server* this = &proxy->server;
 
-        if (is_ioable(client)) ioable_processed++;
-        if (is_ioable(server)) ioable_processed++;
+    while (can_read_from(get_listener(this))) {
+        const int client_fd = accept4(get_listener(this)->fd, NULL, NULL, SOCK_NONBLOCK);
+        if (client_fd == ERR_SOCKET) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                get_listener(this)->revents &= ~POLLIN;
+            } else if (errno != EINTR && errno != ECONNABORTED) {
+                perror("accept4");
+                return;
+            }
+            continue;
+        }
 
-        if (has_errors(client) || has_errors(server)) {
-            pr_remove_client(proxy, i);
+        if (is_full(this)) {
+            close(client_fd);
             continue;
         }
 
-        if (!try_transfer(client, get_ctos_buffer(this, id), server)) {
-            pr_remove_client(proxy, i);
+        bool connected;
+        const int server_fd = start_connect(&this->server_addr, &connected);
+        if (server_fd == ERR_SOCKET) {
+            close(client_fd);
             continue;
         }
 
-        if (!try_transfer(server, get_stoc_buffer(this, id), client)) {
-            pr_remove_client(proxy, i);
+        const int id = add_client(this, client_fd, server_fd);
+        if (id == NO_ID) {
+            close(server_fd);
+            close(client_fd);
             continue;
         }
+
+        if (!connected) {
+            get_server(this, id)->revents = 0;
+            set_server_writeable(this, id, true);
+            push_connect(&proxy->connects, id, now_ms() + CONNECT_TIMEOUT);
+        }
+
+        queue_client(proxy, id);
     }
-    commit_remove(proxy);
 }
 
 int main_loop(ProxyServer* proxy) {
     Server* this = &proxy->server;
 
-    size_t fd_count;
-    while ((fd_count = poll(this->clients, get_poll_count(this), -1)) != -1) {
-        const int has_pending = get_listener(this)->revents & POLLIN;
-
-        if (has_pending) {
-            const int client_fd = accept(get_listener(this)->fd, NULL, NULL);
+    int event_count;
+    while ((event_count = wait_server(this, wait_timeout(proxy))) != -1) {
+        pump_pending(proxy);
 
-            if (client_fd == ERR_SOCKET) {
-                continue;
+        for (int i = 0; i < event_count; ++i) {
+            const int id = ready_id(this, i);
+            if (id != NO_ID) {
+                pump(proxy, id);
             }
+        }
 
-            const int server_fd = client_setup(&this->server_addr);
-            if (server_fd == ERR_SOCKET) {
-                close(client_fd);
-                continue;        
-            }
+        accept_clients(proxy);
+        expire_connects(proxy);
+    }
 
-            const int id = add_client(this, client_fd, server_fd);
-            if (id == NO_ID) {
-                close(server_fd);
-                close(client_fd);
-                continue;
-            }
+    perror("epoll_wait");
+    cleanup_server(this);
+    return EXIT_FAILURE;
+}
 
-            proxy->id_table[proxy->client_count++] = id;
+int parse_relay(ProxyParams* this, const char* relay) {
+    if (relay == NULL || strcmp(relay, "copy") == 0) {
+        this->splice = false;
+    } else if (strcmp(relay, "splice") == 0) {
+        this->splice = true;
+    } else {
+        fprintf(stderr, "RELAY must be either copy or splice\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int parse_workers(ProxyParams* this, const char* workers, const char* pin) {
+    this->workers = 1;
+    this->pin_workers = false;
+
+    if (pin != NULL) {
+        if (strcmp(pin, "pin") != 0) {
+            fprintf(stderr, "The last argument may only be pin\n");
+            return EXIT_FAILURE;
         }
+        this->pin_workers = true;
+    }
 
-        try_read(proxy, has_pending ? fd_count - 1 : fd_count);
+    if (workers == NULL) return EXIT_SUCCESS;
+
+    char* end;
+    const long count = strtol(workers, &end, 10);
+    if (*end != '\0' || count < 1 || count > MAX_WORKERS) {
+        fprintf(stderr, "WORKERS must be an integer from 1 to %d\n", MAX_WORKERS);
+        return EXIT_FAILURE;
     }
 
-    perror("poll");
-    cleanup_server(this);
-    return EXIT_FAILURE;
+    this->workers = count;
+    return EXIT_SUCCESS;
 }
 
 int parse_parameters(ProxyParams* this, int argc, char* argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s LISTENING_PORT IP_ADDR DESTINATION_PORT\n", argv[0]);
+    if (argc < 4 || argc > 7) {
+        fprintf(stderr, "Usage: %s LISTENING_PORT IP_ADDR DESTINATION_PORT [copy|splice] [WORKERS] [pin]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (parse_relay(this, argc >= 5 ? argv[4] : NULL) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    if (parse_workers(this, argc >= 6 ? argv[5] : NULL, argc == 7 ? argv[6] : NULL) == EXIT_FAILURE) {
         return EXIT_FAILURE;
     }
 
@@ -194,16 +438,94 @@ int parse_parameters(ProxyParams* this, int argc, char* argv[]) {
 
 int pr_init_server(ProxyServer* this, const ProxyParams* params) {
     memset(this, 0, sizeof(*this));
+    init_connects(&this->connects);
 
-    if (init_server(&this->server, params) == EXIT_FAILURE) return EXIT_FAILURE;
+    return init_server(&this->server, params);
+}
+
+void* pr_worker(void* arg) {
+    main_loop(arg);
+    return NULL;
+}
 
-    for (size_t i = 0; i < MAX_CLIENTS; ++i) {
-        this->id_table[i] = REMOVED_CLIENT;
+/* Returns the index-th CPU the process may run on, counting round. */
+int worker_cpu(size_t index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        perror("sched_getaffinity");
+        return NO_CPU;
     }
 
+    const int count = CPU_COUNT(&allowed);
+    int skip = index % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && skip-- == 0) return cpu;
+    }
+    return NO_CPU;
+}
+
+int start_worker(pthread_t* thread, ProxyServer* proxy) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    if (proxy->cpu != NO_CPU) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(proxy->cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+
+    const int err_code = pthread_create(thread, &attr, pr_worker, proxy);
+    pthread_attr_destroy(&attr);
+
+    if (err_code != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
 }
 
+/* Every worker thread gets its own listener, clients and event loop. The
+ * listeners share the port, so the kernel spreads new clients over the
+ * workers and nothing is shared after the accept. */
+int run_workers(const ProxyParams* params) {
+    proxy_servers = calloc(params->workers, sizeof(*proxy_servers));
+    pthread_t* threads = calloc(params->workers, sizeof(*threads));
+    if (proxy_servers == NULL || threads == NULL) {
+        perror("calloc");
+        free(proxy_servers);
+        free(threads);
+        return EXIT_FAILURE;
+    }
+
+    for (; proxy_count < params->workers; ++proxy_count) {
+        ProxyServer* proxy = &proxy_servers[proxy_count];
+        if (pr_init_server(proxy, params) != EXIT_SUCCESS) break;
+
+        proxy->cpu = params->pin_workers ? worker_cpu(proxy_count) : NO_CPU;
+    }
+
+    size_t started = 0;
+    for (; proxy_count == params->workers && started < proxy_count; ++started) {
+        if (start_worker(&threads[started], &proxy_servers[started]) == EXIT_FAILURE) break;
+    }
+
+    if (started < proxy_count) {
+        for (size_t i = started; i < proxy_count; ++i) {
+            cleanup_server(&proxy_servers[i].server);
+        }
+        proxy_count = started;
+    }
+
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    free(proxy_servers);
+    return EXIT_FAILURE;
+}
+
 int main(int argc, char* argv[]) {
     ProxyParams params;
     if (parse_parameters(&params, argc, argv) == EXIT_FAILURE) {
@@ -213,10 +535,7 @@ int main(int argc, char* argv[]) {
     struct sigaction act = {};
     act.sa_handler = interrupt;
     sigaction(SIGINT, &act, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
-    if (pr_init_server(&proxy_server, &params) != EXIT_SUCCESS) {
-        return EXIT_FAILURE;
-    }
-
-    return main_loop(&proxy_server);
+    return run_workers(&params);
 }
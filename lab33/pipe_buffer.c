@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+
+#include "pipe_buffer.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define SPLICE_FLAGS (SPLICE_F_MOVE | SPLICE_F_NONBLOCK)
+
+void init_pipebuf(PipeBuffer* this) {
+    this->read_fd = NO_PIPE;
+    this->write_fd = NO_PIPE;
+    this->size = 0;
+    this->count = 0;
+}
+
+bool pb_attached(const PipeBuffer* this) {
+    return this->read_fd != NO_PIPE;
+}
+
+bool pb_full(const PipeBuffer* this) {
+    return this->count == this->size;
+}
+
+bool pb_empty(const PipeBuffer* this) {
+    return this->count == 0;
+}
+
+/* Works like iob_recv. A pipe that still holds data may run out of slots
+ * before it runs out of bytes, so only an empty pipe proves the socket had
+ * nothing to give: otherwise the caller should retry once it sent some. */
+ssize_t pb_recv(PipeBuffer* this, int fd) {
+    const ssize_t count = splice(fd, NULL, this->write_fd, NULL, this->size - this->count, SPLICE_FLAGS);
+    if (count == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        perror("splice");
+        return count;
+    }
+
+    if (count == 0) {
+        return -1;
+    }
+
+    this->count += count;
+    return count;
+}
+
+ssize_t pb_send(PipeBuffer* this, int fd) {
+    const ssize_t count = splice(this->read_fd, NULL, fd, NULL, this->count, SPLICE_FLAGS);
+    if (count == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        perror("splice");
+        return count;
+    }
+
+    this->count -= count;
+    return count;
+}
+
+static bool open_pipe(PipeBuffer* this) {
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC)) {
+        perror("pipe2");
+        return false;
+    }
+
+    const int size = fcntl(fds[0], F_GETPIPE_SZ);
+    if (size <= 0) {
+        perror("fcntl");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    this->read_fd = fds[0];
+    this->write_fd = fds[1];
+    this->size = size;
+    this->count = 0;
+    return true;
+}
+
+static void close_pipe(PipeBuffer* this) {
+    if (!pb_attached(this)) return;
+
+    close(this->read_fd);
+    close(this->write_fd);
+    init_pipebuf(this);
+}
+
+int init_pipe_pool(PipePool* this, size_t count) {
+    this->count = 0;
+
+    if (count > PIPE_POOL_SIZE) {
+        count = PIPE_POOL_SIZE;
+    }
+
+    while (this->count < count) {
+        if (!open_pipe(&this->pipes[this->count])) {
+            free_pipe_pool(this);
+            return EXIT_FAILURE;
+        }
+        this->count++;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void free_pipe_pool(PipePool* this) {
+    while (this->count > 0) {
+        close_pipe(&this->pipes[--this->count]);
+    }
+}
+
+/* Takes a pipe from the pool or opens a new one once it is empty. */
+bool pp_get(PipePool* this, PipeBuffer* pipe) {
+    if (this->count > 0) {
+        *pipe = this->pipes[--this->count];
+        return true;
+    }
+
+    return open_pipe(pipe);
+}
+
+/* Bytes left in a pipe belong to a connection that is gone, so such a pipe
+ * is closed rather than handed to the next one. */
+void pp_put(PipePool* this, PipeBuffer* pipe) {
+    if (!pb_attached(pipe)) return;
+
+    if (pb_empty(pipe) && this->count < PIPE_POOL_SIZE) {
+        this->pipes[this->count++] = *pipe;
+        init_pipebuf(pipe);
+        return;
+    }
+
+    close_pipe(pipe);
+}
@@ -0,0 +1,40 @@
+#ifndef PIPE_BUFFER_H
+#define PIPE_BUFFER_H
+
+#include <stddef.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#define PIPE_POOL_SIZE 256
+#define NO_PIPE (-1)
+
+/* Holds the bytes of one direction in the kernel: they are spliced from the
+ * sending socket into the pipe and from the pipe into the receiving one. */
+typedef struct {
+    int read_fd;
+    int write_fd;
+    size_t size;
+    size_t count;
+} PipeBuffer;
+
+/* Empty pipes kept for reuse, so a new connection does not pay for
+ * pipe2() and fcntl() twice per direction. */
+typedef struct {
+    PipeBuffer pipes[PIPE_POOL_SIZE];
+    size_t count;
+} PipePool;
+
+void init_pipebuf(PipeBuffer* this);
+bool pb_attached(const PipeBuffer* this);
+bool pb_full(const PipeBuffer* this);
+bool pb_empty(const PipeBuffer* this);
+
+ssize_t pb_recv(PipeBuffer* this, int fd);
+ssize_t pb_send(PipeBuffer* this, int fd);
+
+int init_pipe_pool(PipePool* this, size_t count);
+void free_pipe_pool(PipePool* this);
+bool pp_get(PipePool* this, PipeBuffer* pipe);
+void pp_put(PipePool* this, PipeBuffer* pipe);
+
+#endif // !PIPE_BUFFER_H
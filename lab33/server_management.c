@@ -3,9 +3,12 @@
 #include "utils.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 #define BUFFER_SIZE 1024
+#define PIPE_POOL_PREFILL 64
 
 #define CLIENT_INDEX(I) ((I) * 2)
 #define SERVER_INDEX(I) ((I) * 2 + 1)
@@ -13,6 +16,12 @@
 #define POLL_CLIENT_INDEX(I) (CLIENT_INDEX(I) + POLL_CLIENT_OFFSET)
 #define POLL_SERVER_INDEX(I) (SERVER_INDEX(I) + POLL_CLIENT_OFFSET)
 
+/* Event tags name the listener or one side of a client by its id. */
+#define EVENT_LISTENER 0
+#define EVENT_CLIENT_OFFSET 1
+#define EVENT_CLIENT(ID) (EVENT_CLIENT_OFFSET + 2 * (ID))
+#define EVENT_SERVER(ID) (EVENT_CLIENT(ID) + 1)
+
 bool is_valid_id(Server* this, size_t id) {
     return id < MAX_CLIENTS && this->id_table[id] != REMOVED_CLIENT;
 }
@@ -41,20 +50,60 @@ IOBuffer* get_stoc_buffer(Server* this, size_t id) {
     return &this->stoc_buffers[id];
 }
 
+PipeBuffer* get_ctos_pipe(Server* this, size_t id) {
+    if (!is_valid_id(this, id) || !pb_attached(&this->ctos_pipes[id])) return NULL;
+    return &this->ctos_pipes[id];
+}
+
+PipeBuffer* get_stoc_pipe(Server* this, size_t id) {
+    if (!is_valid_id(this, id) || !pb_attached(&this->stoc_pipes[id])) return NULL;
+    return &this->stoc_pipes[id];
+}
+
 bool is_full(Server* this) {
     return this->client_count == MAX_CLIENTS;
 }
 
+int watch_fd(Server* this, int op, int fd, short events, uint32_t tag) {
+    struct epoll_event event = {.events = events | EPOLLRDHUP | EPOLLET, .data.u32 = tag};
+    if (epoll_ctl(this->epoll_fd, op, fd, &event)) {
+        perror("epoll_ctl");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
 int init_server(Server* this, const ProxyParams* params) {
     memset(this, 0, sizeof(*this));
 
-    const int listen_fd = server_setup(&params->listener_addr, MAX_CLIENTS);
+    const int listen_fd = server_setup(&params->listener_addr, MAX_CLIENTS, params->workers > 1);
     if (listen_fd == ERR_SOCKET) {
         return EXIT_FAILURE;
     }
 
+    this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->epoll_fd == -1) {
+        perror("epoll_create1");
+        close(listen_fd);
+        return EXIT_FAILURE;
+    }
+
+    if (set_nonblocking(listen_fd) == EXIT_FAILURE
+        || watch_fd(this, EPOLL_CTL_ADD, listen_fd, POLLIN, EVENT_LISTENER) == EXIT_FAILURE) {
+        close(this->epoll_fd);
+        close(listen_fd);
+        return EXIT_FAILURE;
+    }
+
     memcpy(&this->server_addr, &params->server_addr, sizeof(this->server_addr));
 
+    this->splice = params->splice;
+    if (this->splice && init_pipe_pool(&this->pipe_pool, PIPE_POOL_PREFILL) == EXIT_FAILURE) {
+        close(this->epoll_fd);
+        close(listen_fd);
+        return EXIT_FAILURE;
+    }
+
     for (size_t i = 0; i < MAX_CLIENTS; ++i) {
         this->clients[POLL_CLIENT_INDEX(i)].fd = REMOVED_CLIENT;
         this->clients[POLL_CLIENT_INDEX(i)].events = POLLIN | POLLOUT;
@@ -64,7 +113,13 @@ int init_server(Server* this, const ProxyParams* params) {
 
         this->id_table[i] = REMOVED_CLIENT;
         this->index_to_id[i] = NO_ID;
+
+        init_pipebuf(&this->stoc_pipes[i]);
+        init_pipebuf(&this->ctos_pipes[i]);
+
+        this->free_ids[i] = MAX_CLIENTS - 1 - i;
     }
+    this->free_count = MAX_CLIENTS;
 
     get_listener(this)->fd = listen_fd;
     get_listener(this)->events = POLLIN;
@@ -76,11 +131,45 @@ size_t get_client_count(Server* this) {
     return this->client_count;
 }
 
-size_t get_poll_count(Server* this) {
-    return 2 * get_client_count(this) + POLL_CLIENT_OFFSET;
+struct pollfd* get_tagged(Server* this, uint32_t tag) {
+    if (tag == EVENT_LISTENER) return get_listener(this);
+
+    const size_t id = (tag - EVENT_CLIENT_OFFSET) / 2;
+    return (tag - EVENT_CLIENT_OFFSET) % 2 == 0 ? get_client(this, id) : get_server(this, id);
+}
+
+/* Adds the reported edges to the revents of their pollfds and returns the
+ * number of events. A hangup reads as readable, the read then sees the end
+ * of the stream. */
+int wait_server(Server* this, int timeout) {
+    int count;
+    do {
+        count = epoll_wait(this->epoll_fd, this->events, SERVER_MAX_EVENTS, timeout);
+    } while (count == -1 && errno == EINTR);
+
+    for (int i = 0; i < count; ++i) {
+        struct pollfd* pollfd = get_tagged(this, this->events[i].data.u32);
+        if (pollfd == NULL || pollfd->fd == REMOVED_CLIENT) continue;
+
+        const uint32_t events = this->events[i].events;
+        pollfd->revents |= events & (POLLIN | POLLOUT | POLLERR);
+        if (events & (EPOLLRDHUP | EPOLLHUP)) {
+            pollfd->revents |= POLLIN;
+        }
+    }
+
+    return count;
+}
+
+/* Returns the client id an event is about or NO_ID for the listener. */
+int ready_id(Server* this, int index) {
+    const uint32_t tag = this->events[index].data.u32;
+    if (tag == EVENT_LISTENER) return NO_ID;
+    return (tag - EVENT_CLIENT_OFFSET) / 2;
 }
 
 void safe_cleanup(Server* this) {
+    close(this->epoll_fd);
     close(get_listener(this)->fd);
     
     for (size_t i = 0; i < get_client_count(this); ++i) {
@@ -93,9 +182,13 @@ void cleanup_server(Server* this) {
     safe_cleanup(this);
 
     for (size_t i = 0; i < get_client_count(this); ++i) {
-        free_iobuf(get_ctos_buffer(this, this->index_to_id[i]));
-        free_iobuf(get_stoc_buffer(this, this->index_to_id[i]));
+        const int id = this->index_to_id[i];
+        free_iobuf(get_ctos_buffer(this, id));
+        free_iobuf(get_stoc_buffer(this, id));
+        pp_put(&this->pipe_pool, &this->ctos_pipes[id]);
+        pp_put(&this->pipe_pool, &this->stoc_pipes[id]);
     }
+    free_pipe_pool(&this->pipe_pool);
 }
 
 void swap_poll(struct pollfd* lhs, struct pollfd* rhs) {
@@ -108,12 +201,19 @@ void disconnect_client(Server* this, size_t id) {
     if (!is_valid_id(this, id)) return;
     if (get_client(this, id)->fd == REMOVED_CLIENT) return;
 
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, get_client(this, id)->fd, NULL);
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, get_server(this, id)->fd, NULL);
     close(get_client(this, id)->fd);
     close(get_server(this, id)->fd);
     get_client(this, id)->fd = REMOVED_CLIENT;
     get_server(this, id)->fd = REMOVED_CLIENT;
 }
 
+static void release_id(Server* this, int id) {
+    this->id_table[id] = REMOVED_CLIENT;
+    this->free_ids[this->free_count++] = id;
+}
+
 void remove_client(Server* this, size_t id) {
     if (!is_valid_id(this, id)) return;
 
@@ -121,25 +221,26 @@ void remove_client(Server* this, size_t id) {
 
     free_iobuf(get_ctos_buffer(this, id));
     free_iobuf(get_stoc_buffer(this, id));
+    pp_put(&this->pipe_pool, &this->ctos_pipes[id]);
+    pp_put(&this->pipe_pool, &this->stoc_pipes[id]);
 
     this->client_count--;
     if (this->client_count != 0) {
         const int last_id = this->index_to_id[this->client_count];
         swap_poll(get_client(this, id), get_client(this, last_id));
+        swap_poll(get_server(this, id), get_server(this, last_id));
 
         this->index_to_id[this->id_table[id]] = last_id;
         this->id_table[last_id] = this->id_table[id];
     }
 
     this->index_to_id[this->client_count] = NO_ID;
-    this->id_table[id] = REMOVED_CLIENT;
+    release_id(this, id);
 }
 
 int next_id(Server* this) {
-    for (size_t i = 0; i < MAX_CLIENTS; ++i) {
-        if (this->id_table[i] == REMOVED_CLIENT) return i;
-    }
-    return NO_ID;
+    if (this->free_count == 0) return NO_ID;
+    return this->free_ids[--this->free_count];
 }
 
 int add_client(Server* this, int client_fd, int server_fd) {
@@ -151,11 +252,63 @@ int add_client(Server* this, int client_fd, int server_fd) {
     this->id_table[id] = this->client_count;
     this->index_to_id[this->client_count] = id;
 
-    get_client(this, id)->fd = client_fd;
-    get_server(this, id)->fd = server_fd;
+    /* Nothing is known about the sockets yet, so both count as writable
+     * until a write says otherwise. */
+    struct pollfd* client = get_client(this, id);
+    struct pollfd* server = get_server(this, id);
+    client->fd = client_fd;
+    client->events = POLLIN;
+    client->revents = POLLOUT;
+    server->fd = server_fd;
+    server->events = POLLIN;
+    server->revents = POLLOUT;
+
+    if (set_nonblocking(client_fd) == EXIT_FAILURE || set_nonblocking(server_fd) == EXIT_FAILURE
+        || watch_fd(this, EPOLL_CTL_ADD, client_fd, client->events, EVENT_CLIENT(id)) == EXIT_FAILURE) {
+        client->fd = REMOVED_CLIENT;
+        server->fd = REMOVED_CLIENT;
+        this->index_to_id[this->client_count] = NO_ID;
+        release_id(this, id);
+        return NO_ID;
+    }
+
+    if (watch_fd(this, EPOLL_CTL_ADD, server_fd, server->events, EVENT_SERVER(id)) == EXIT_FAILURE) {
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
+        client->fd = REMOVED_CLIENT;
+        server->fd = REMOVED_CLIENT;
+        this->index_to_id[this->client_count] = NO_ID;
+        release_id(this, id);
+        return NO_ID;
+    }
+
     init_iobuf(get_stoc_buffer(this, id), BUFFER_SIZE);
     init_iobuf(get_ctos_buffer(this, id), BUFFER_SIZE);
 
+    if (this->splice && (!pp_get(&this->pipe_pool, &this->ctos_pipes[id])
+                         || !pp_get(&this->pipe_pool, &this->stoc_pipes[id]))) {
+        pp_put(&this->pipe_pool, &this->ctos_pipes[id]);
+        pp_put(&this->pipe_pool, &this->stoc_pipes[id]);
+    }
+
     this->client_count++;
     return id;
 }
+
+/* Write interest is only asked for while there is something to write. */
+void set_pollable_on(Server* this, struct pollfd* pollfd, uint32_t tag, short flags, bool pollable) {
+    if (pollfd == NULL || pollfd->fd == REMOVED_CLIENT) return;
+
+    const short events = pollable ? (pollfd->events | flags) : (pollfd->events & ~flags);
+    if (events == pollfd->events) return;
+
+    pollfd->events = events;
+    watch_fd(this, EPOLL_CTL_MOD, pollfd->fd, pollfd->events, tag);
+}
+
+void set_client_writeable(Server* this, size_t id, bool writeable) {
+    set_pollable_on(this, get_client(this, id), EVENT_CLIENT(id), POLLOUT, writeable);
+}
+
+void set_server_writeable(Server* this, size_t id, bool writeable) {
+    set_pollable_on(this, get_server(this, id), EVENT_SERVER(id), POLLOUT, writeable);
+}
@@ -2,9 +2,11 @@
 #define SERVER_MANAGEMENT_H
 
 #include "iobuffer.h"
+#include "pipe_buffer.h"
 #include "socket_utils.h"
 
 #include <poll.h>
+#include <sys/epoll.h>
 #include <stddef.h>
 
 #define REMOVED_CLIENT (-1)
@@ -14,21 +16,43 @@
 #define POLL_LISTENER_INDEX 0
 #define POLL_CLIENT_OFFSET 1
 
+#define SERVER_MAX_EVENTS 256
+
+/* Sockets are watched edge-triggered. The revents of a pollfd keep what the
+ * last edges reported until a read or write hits EAGAIN and clears it, so
+ * they tell whether trying is worth a syscall. */
 typedef struct {
     SocketAddress server_addr;
 
+    int epoll_fd;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+
     struct pollfd clients[2 * MAX_CLIENTS + POLL_CLIENT_OFFSET];
     IOBuffer stoc_buffers[MAX_CLIENTS];
     IOBuffer ctos_buffers[MAX_CLIENTS];
     size_t client_count;
 
+    /* In splice mode a client relays through pipes while the pool can give
+     * it some and falls back to its IOBuffers otherwise. */
+    bool splice;
+    PipePool pipe_pool;
+    PipeBuffer stoc_pipes[MAX_CLIENTS];
+    PipeBuffer ctos_pipes[MAX_CLIENTS];
+
     int id_table[MAX_CLIENTS];
     int index_to_id[MAX_CLIENTS];
+
+    /* Ids of removed clients, the lowest on top. */
+    int free_ids[MAX_CLIENTS];
+    size_t free_count;
 } Server;
 
 typedef struct {
     SocketAddress listener_addr;
     SocketAddress server_addr;
+    bool splice;
+    size_t workers;
+    bool pin_workers;
 } ProxyParams;
 
 struct pollfd* get_client(Server* this, size_t id);
@@ -41,7 +65,9 @@ void cleanup_server(Server* this);
 
 bool is_full(Server* this);
 size_t get_client_count(Server* this);
-size_t get_poll_count(Server* this);
+
+int wait_server(Server* this, int timeout);
+int ready_id(Server* this, int index);
 
 int add_client(Server* this, int client_fd, int server_fd);
 void remove_client(Server* this, size_t id);
@@ -49,5 +75,10 @@ void disconnect_client(Server* this, size_t id);
 
 IOBuffer* get_ctos_buffer(Server* this, size_t id);
 IOBuffer* get_stoc_buffer(Server* this, size_t id);
+PipeBuffer* get_ctos_pipe(Server* this, size_t id);
+PipeBuffer* get_stoc_pipe(Server* this, size_t id);
+
+void set_client_writeable(Server* this, size_t id, bool writeable);
+void set_server_writeable(Server* this, size_t id, bool writeable);
 
 #endif // !SERVER_MANAGEMENT_H
\ No newline at end of file
@@ -6,14 +6,23 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <errno.h>
 
-int server_setup(const SocketAddress* address, int backlog) {
+int server_setup(const SocketAddress* address, int backlog, bool reuse_port) {
     const int sockfd = socket(address->address.sa_family, SOCK_STREAM, 0);
     if (sockfd == -1) {
         perror("socket");
         return ERR_SOCKET;
     }
 
+    const int enable = 1;
+    if (reuse_port && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable))) {
+        perror("setsockopt");
+        close(sockfd);
+        return ERR_SOCKET;
+    }
+
     if (bind(sockfd, &address->address, address->length)) {
         perror("bind");
         close(sockfd);
@@ -45,6 +54,49 @@ int client_setup(const SocketAddress* address) {
     return sockfd;
 }
 
+/* Starts a nonblocking connect. The socket is writable once it finished
+ * and finish_connect tells how. */
+int start_connect(const SocketAddress* address, bool* connected) {
+    const int sockfd = socket(address->address.sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sockfd == -1) {
+        perror("socket");
+        return ERR_SOCKET;
+    }
+
+    *connected = connect(sockfd, &address->address, address->length) == 0;
+    if (!*connected && errno != EINPROGRESS) {
+        perror("connect");
+        close(sockfd);
+        return ERR_SOCKET;
+    }
+
+    return sockfd;
+}
+
+int finish_connect(int fd) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length)) {
+        perror("getsockopt");
+        return EXIT_FAILURE;
+    }
+
+    if (error != 0) {
+        fprintf(stderr, "connect: %s\n", strerror(error));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int set_nonblocking(int fd) {
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
 void init_addr_in(struct sockaddr_in* addr_in, in_addr_t addr, in_port_t port, size_t family) {
     memset(addr_in, 0, sizeof(*addr_in));
     addr_in->sin_addr.s_addr = addr;
@@ -5,6 +5,7 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <stdbool.h>
 
 #define ERR_SOCKET (-1)
 
@@ -13,8 +14,11 @@ typedef struct {
     socklen_t length;
 } SocketAddress;
 
-int server_setup(const SocketAddress* address, int backlog);
+int server_setup(const SocketAddress* address, int backlog, bool reuse_port);
 int client_setup(const SocketAddress* address);
+int start_connect(const SocketAddress* address, bool* connected);
+int finish_connect(int fd);
+int set_nonblocking(int fd);
 
 void init_addr_in(struct sockaddr_in* addr_in, in_addr_t addr, in_port_t port, size_t family);
 int parse_address(SocketAddress* address, const char* addr_str, const char* port_str);
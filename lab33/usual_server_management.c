@@ -30,7 +30,7 @@ bool is_full(Server* this) {
 int init_server(Server* this, const ServerParams* params) {
     memset(this, 0, sizeof(*this));
 
-    const int listen_fd = server_setup(&params->listener_addr, MAX_CLIENTS);
+    const int listen_fd = server_setup(&params->listener_addr, MAX_CLIENTS, false);
     if (listen_fd == ERR_SOCKET) {
         return EXIT_FAILURE;
     }
@@ -0,0 +1,7 @@
+#!/bin/bash
+
+COMMON="socket_utils.c server_management.c iobuffer.c cyclic_buffer.c message_receiver.c protocol.c transport_protocol_buffer.c handshake.c scheduler.c lz.c id_queue.c shm_link.c"
+
+gcc -o sender -std=gnu99 -pthread lab34-sender.c stats.c io_ring.c $COMMON
+gcc -o terminator -std=gnu99 -pthread lab34-terminator.c $COMMON
+gcc -o codec-bench -std=gnu99 -O2 lab34-codec-bench.c message_buffer.c $COMMON io_ring.c
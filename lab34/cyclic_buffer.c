@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include "cyclic_buffer.h"
 
 #include "utils.h"
@@ -5,9 +7,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+static void cbp_put(CBPool* this, char* buf, size_t size, bool mirrored);
 
 void cb_free(CyclicBuffer* this) {
-    free(this->buf);
+    if (this->pool != NULL) {
+        cbp_put(this->pool, this->buf, this->size, this->mirrored);
+    } else if (this->mirrored) {
+        munmap(this->buf, 2 * this->size);
+    } else {
+        free(this->buf);
+    }
     memset(this, 0, sizeof(*this));
 }
 
@@ -17,8 +29,140 @@ void cb_init(CyclicBuffer* this, size_t size) {
     this->buf = malloc(this->size);
 }
 
+static char* map_mirrored(size_t size) {
+    const int fd = memfd_create("cyclic_buffer", MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("memfd_create");
+        return NULL;
+    }
+
+    if (ftruncate(fd, size)) {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+
+    char* buf = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < 2; ++i) {
+        if (mmap(&buf[i * size], size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            perror("mmap");
+            munmap(buf, 2 * size);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    close(fd);
+    return buf;
+}
+
+bool cb_init_mirrored(CyclicBuffer* this, size_t size) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t mirrored_size = (size + page_size - 1) / page_size * page_size;
+
+    char* buf = map_mirrored(mirrored_size);
+    if (buf == NULL) {
+        cb_init(this, size);
+        return false;
+    }
+
+    memset(this, 0, sizeof(*this));
+    this->size = mirrored_size;
+    this->buf = buf;
+    this->mirrored = true;
+    return true;
+}
+
+void cb_init_pooled(CyclicBuffer* this, CBPool* pool, size_t limit) {
+    memset(this, 0, sizeof(*this));
+    this->pool = pool;
+    this->limit = pool->chunk_size;
+    while (this->limit < limit) {
+        this->limit *= 2;
+    }
+}
+
+void cbp_init(CBPool* this) {
+    memset(this, 0, sizeof(*this));
+    this->chunk_size = sysconf(_SC_PAGESIZE);
+}
+
+void cbp_free(CBPool* this) {
+    for (size_t i = 0; i < CBP_CLASS_COUNT; ++i) {
+        for (size_t j = 0; j < this->kept_count[i]; ++j) {
+            munmap(this->kept[i][j], 2 * (this->chunk_size << i));
+        }
+    }
+    memset(this, 0, sizeof(*this));
+}
+
+/* Returns CBP_CLASS_COUNT for sizes the pool does not keep. */
+static size_t cbp_class(const CBPool* this, size_t size) {
+    size_t class = 0;
+    while (class < CBP_CLASS_COUNT && (this->chunk_size << class) != size) {
+        ++class;
+    }
+    return class;
+}
+
+static char* cbp_get(CBPool* this, size_t size, bool* mirrored) {
+    const size_t class = cbp_class(this, size);
+
+    char* buf;
+    if (class < CBP_CLASS_COUNT && this->kept_count[class] > 0) {
+        buf = this->kept[class][--this->kept_count[class]];
+        this->kept_bytes -= size;
+        *mirrored = true;
+    } else {
+        buf = map_mirrored(size);
+        *mirrored = buf != NULL;
+        if (buf == NULL) {
+            buf = malloc(size);
+        }
+    }
+
+    if (buf != NULL) {
+        this->used_bytes += size;
+    }
+    return buf;
+}
+
+static void cbp_put(CBPool* this, char* buf, size_t size, bool mirrored) {
+    if (buf == NULL) return;
+    this->used_bytes -= size;
+
+    if (!mirrored) {
+        free(buf);
+        return;
+    }
+
+    const size_t class = cbp_class(this, size);
+    if (class < CBP_CLASS_COUNT && this->kept_count[class] < CBP_MAX_KEPT && this->kept_bytes + size <= CBP_KEEP_BYTES) {
+        this->kept[class][this->kept_count[class]++] = buf;
+        this->kept_bytes += size;
+        return;
+    }
+
+    munmap(buf, 2 * size);
+}
+
+/* Pooled buffers are full at their limit, whatever storage they hold now. */
+static size_t cb_capacity(const CyclicBuffer* this) {
+    return this->pool != NULL ? this->limit : this->size;
+}
+
+static size_t cb_storage_space(const CyclicBuffer* this) {
+    return this->size - this->count;
+}
+
 int cb_full(const CyclicBuffer* this) {
-    return this->count == this->size;
+    return this->count == cb_capacity(this);
 }
 
 bool cb_empty(const CyclicBuffer* this) {
@@ -26,18 +170,20 @@ bool cb_empty(const CyclicBuffer* this) {
 }
 
 size_t cb_free_space(const CyclicBuffer* this) {
-    return this->size - this->count;
+    return cb_capacity(this) - this->count;
 }
 
 size_t cb_contiguous_space(const CyclicBuffer* this) {
+    if (this->mirrored) return this->count;
     return min_size_t(this->size - this->start, this->count);
 }
 
 size_t cb_free_contiguous_space(const CyclicBuffer* this) {
-    if (this->start + this->count <= this->size) {
+    if (this->mirrored) return cb_storage_space(this);
+    if (this->start + this->count < this->size) {
         return this->size - (this->start + this->count);
     }
-    return cb_free_space(this);
+    return cb_storage_space(this);
 }
 
 size_t cb_size(const CyclicBuffer* this) {
@@ -48,20 +194,75 @@ size_t cb_count(const CyclicBuffer* this) {
     return this->count;
 }
 
+/* Makes room for at least one more byte unless the buffer is full. A pooled
+ * buffer that outgrew its storage moves its data to the start of storage of
+ * the next class. */
+bool cb_reserve(CyclicBuffer* this) {
+    if (this->count < this->size) return true;
+    if (this->pinned || this->pool == NULL || this->size >= this->limit) return false;
+
+    const size_t size = this->size == 0 ? this->pool->chunk_size : 2 * this->size;
+    bool mirrored;
+    char* buf = cbp_get(this->pool, size, &mirrored);
+    if (buf == NULL) return false;
+
+    struct iovec iov[CB_MAX_SEGMENTS];
+    const size_t iov_count = cb_used_iov(this, iov, this->count);
+    size_t copied = 0;
+    for (size_t i = 0; i < iov_count; ++i) {
+        memcpy(&buf[copied], iov[i].iov_base, iov[i].iov_len);
+        copied += iov[i].iov_len;
+    }
+
+    cbp_put(this->pool, this->buf, this->size, this->mirrored);
+    this->buf = buf;
+    this->size = size;
+    this->start = 0;
+    this->mirrored = mirrored;
+    return true;
+}
+
+/* Hands the storage of a drained pooled buffer back to its pool. */
+void cb_release(CyclicBuffer* this) {
+    if (this->pool == NULL || this->count != 0 || this->pinned) return;
+
+    cbp_put(this->pool, this->buf, this->size, this->mirrored);
+    this->buf = NULL;
+    this->size = 0;
+    this->start = 0;
+    this->mirrored = false;
+}
+
+void cb_pin(CyclicBuffer* this, bool pinned) {
+    this->pinned = pinned;
+}
+
+bool cb_pinned(const CyclicBuffer* this) {
+    return this->pinned;
+}
+
+static void reverse(char* begin, char* end) {
+    while (begin < end) {
+        swap_char(begin++, --end);
+    }
+}
+
 void cb_shift(CyclicBuffer* this) {
-    if (this->start == 0) return;
-    
-    char* old_buf = memcpy(malloc(this->size), this->buf, this->size);
-    for (size_t i = 0; i < this->count; ++i) {
-        this->buf[i] = old_buf[(this->start + i) % this->size];
+    if (this->mirrored || this->start == 0) return;
+
+    if (this->start + this->count <= this->size) {
+        memmove(this->buf, cb_data(this), this->count);
+    } else {
+        reverse(this->buf, &this->buf[this->start]);
+        reverse(&this->buf[this->start], &this->buf[this->size]);
+        reverse(this->buf, &this->buf[this->size]);
     }
-    free(old_buf);
 
     this->start = 0;
 }
 
 bool cb_putc(CyclicBuffer* this, char c) {
-    if (cb_full(this)) return false;
+    if (!cb_reserve(this)) return false;
 
     this->buf[(this->start + this->count) % this->size] = c;
     cb_skip_right(this, 1);
@@ -94,17 +295,66 @@ size_t cb_gets(CyclicBuffer* this, char* s) {
     return i;
 }
 
+size_t cb_write(CyclicBuffer* this, const char* data, size_t count) {
+    count = min_size_t(count, cb_free_space(this));
+
+    size_t written = 0;
+    while (written < count && cb_reserve(this)) {
+        const size_t part = min_size_t(count - written, cb_free_contiguous_space(this));
+        memcpy(cb_data_end(this), &data[written], part);
+        cb_skip_right(this, part);
+        written += part;
+    }
+
+    return written;
+}
+
 void cb_clear(CyclicBuffer* this) {
     this->start = 0;
     this->count = 0;
+    cb_release(this);
+}
+
+static size_t fill_iov(struct iovec* iov, char* buf, size_t size, size_t start, size_t count, bool mirrored) {
+    if (count == 0) return 0;
+
+    const size_t first = mirrored ? count : min_size_t(count, size - start);
+    iov[0].iov_base = &buf[start];
+    iov[0].iov_len = first;
+
+    if (first == count) return 1;
+
+    iov[1].iov_base = buf;
+    iov[1].iov_len = count - first;
+    return 2;
+}
+
+size_t cb_used_iov(const CyclicBuffer* this, struct iovec* iov, size_t max_count) {
+    return fill_iov(iov, this->buf, this->size, this->start, min_size_t(this->count, max_count), this->mirrored);
+}
+
+size_t cb_free_iov(const CyclicBuffer* this, struct iovec* iov) {
+    if (this->size == 0) return 0;
+
+    const size_t end = (this->start + this->count) % this->size;
+    return fill_iov(iov, this->buf, this->size, end, cb_storage_space(this), this->mirrored);
+}
+
+static bool would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
 }
 
 ssize_t cb_recv(CyclicBuffer* this, int fd) {
-    cb_shift(this);
+    struct iovec iov[CB_MAX_SEGMENTS];
+    const size_t iov_count = cb_reserve(this) ? cb_free_iov(this, iov) : 0;
+    if (iov_count == 0) return 0;
 
-    const ssize_t free_space = cb_free_space(this);
-    const ssize_t count = read(fd, &this->buf[this->count], free_space);
+    const ssize_t count = readv(fd, iov, iov_count);
+    if (count <= 0) {
+        cb_release(this);
+    }
     if (count == -1) {
+        if (would_block()) return 0;
         perror("read");
         return count;
     }
@@ -118,12 +368,13 @@ ssize_t cb_recv(CyclicBuffer* this, int fd) {
 }
 
 ssize_t cb_send(CyclicBuffer* this, int fd) {
-    if (cb_contiguous_space(this) != cb_count(this)) {
-        cb_shift(this);
-    }
+    struct iovec iov[CB_MAX_SEGMENTS];
+    const size_t iov_count = cb_used_iov(this, iov, this->count);
+    if (iov_count == 0) return 0;
 
-    const ssize_t count = write(fd, &this->buf[this->start], this->count);
+    const ssize_t count = writev(fd, iov, iov_count);
     if (count == -1) {
+        if (would_block()) return 0;
         perror("write");
         return count;
     }
@@ -132,11 +383,104 @@ ssize_t cb_send(CyclicBuffer* this, int fd) {
     return count;
 }
 
+void cbb_init(CBBatch* this) {
+    this->iov_count = 0;
+    this->group_count = 0;
+    this->total = 0;
+}
+
+void cbb_begin_group(CBBatch* this) {
+    this->group_count++;
+}
+
+size_t cbb_free_slots(const CBBatch* this) {
+    return CB_BATCH_MAX_IOV - this->iov_count;
+}
+
+static void cbb_push(CBBatch* this, CyclicBuffer* owner, char* data, size_t count) {
+    this->iov[this->iov_count].iov_base = data;
+    this->iov[this->iov_count].iov_len = count;
+    this->owners[this->iov_count] = owner;
+    this->groups[this->iov_count] = this->group_count;
+    this->iov_count++;
+    this->total += count;
+}
+
+size_t cbb_add_buffer(CBBatch* this, CyclicBuffer* buffer, size_t max_count) {
+    if (cbb_free_slots(this) < CB_MAX_SEGMENTS) return 0;
+
+    struct iovec iov[CB_MAX_SEGMENTS];
+    const size_t iov_count = cb_used_iov(buffer, iov, max_count);
+
+    size_t added = 0;
+    for (size_t i = 0; i < iov_count; ++i) {
+        cbb_push(this, buffer, iov[i].iov_base, iov[i].iov_len);
+        added += iov[i].iov_len;
+    }
+    return added;
+}
+
+bool cbb_add_data(CBBatch* this, const char* data, size_t count) {
+    if (cbb_free_slots(this) == 0) return false;
+    if (count != 0) {
+        cbb_push(this, NULL, (char*) data, count);
+    }
+    return true;
+}
+
+/* Groups are written atomically from the point of view of their owners: the
+ * unsent tail of a partially written group is moved into remainder, so the
+ * owners of later groups keep all their data. */
+static void cbb_commit(CBBatch* this, size_t sent, CyclicBuffer* remainder) {
+    size_t i = 0;
+    for (; i < this->iov_count && sent >= this->iov[i].iov_len; ++i) {
+        sent -= this->iov[i].iov_len;
+        if (this->owners[i] != NULL) {
+            cb_skip(this->owners[i], this->iov[i].iov_len);
+        }
+    }
+
+    if (i == this->iov_count) return;
+
+    const size_t partial_group = this->groups[i];
+    for (; i < this->iov_count && this->groups[i] == partial_group; ++i) {
+        const size_t length = this->iov[i].iov_len;
+        const size_t sent_part = min_size_t(sent, length);
+        sent -= sent_part;
+
+        CyclicBuffer* owner = this->owners[i];
+        if (owner == remainder) {
+            cb_skip(owner, sent_part);
+            continue;
+        }
+
+        cb_write(remainder, (const char*) this->iov[i].iov_base + sent_part, length - sent_part);
+        if (owner != NULL) {
+            cb_skip(owner, length);
+        }
+    }
+}
+
+ssize_t cbb_send(CBBatch* this, int fd, CyclicBuffer* remainder) {
+    if (this->iov_count == 0) return 0;
+
+    const ssize_t count = writev(fd, this->iov, this->iov_count);
+    if (count == -1) {
+        if (would_block()) return 0;
+        perror("writev");
+        return count;
+    }
+
+    cbb_commit(this, count, remainder);
+    return count;
+}
+
 char* cb_data(CyclicBuffer* this) {
     return &this->buf[this->start];
 }
 
 char* cb_data_end(CyclicBuffer* this) {
+    if (this->size == 0) return this->buf;
     return &this->buf[(this->start + this->count) % this->size];
 }
 
@@ -146,7 +490,8 @@ void cb_skip(CyclicBuffer* this, size_t count) {
     }
 
     this->count -= count;
-    this->start = (this->start + count) % this->size;
+    this->start = this->count == 0 && !this->pinned ? 0 : (this->start + count) % this->size;
+    cb_release(this);
 }
 
 void cb_skip_right(CyclicBuffer* this, size_t count) {
@@ -156,3 +501,15 @@ void cb_skip_right(CyclicBuffer* this, size_t count) {
 
     this->count += count;
 }
+
+void cb_drop_right(CyclicBuffer* this, size_t count) {
+    if (count > this->count) {
+        count = this->count;
+    }
+
+    this->count -= count;
+    if (this->count == 0) {
+        this->start = 0;
+    }
+    cb_release(this);
+}
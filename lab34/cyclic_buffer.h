@@ -4,18 +4,59 @@
 #include <stddef.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 
 #define END_OF_BUFFER (-1)
 
+#define CB_MAX_SEGMENTS 2
+#define CB_BATCH_MAX_IOV 64
+
+/* Pooled storage comes in classes of one page doubling up to CBP_CLASS_COUNT
+ * steps, drained storage is kept mapped up to CBP_KEEP_BYTES per pool. */
+#define CBP_CLASS_COUNT 5
+#define CBP_MAX_KEPT 256
+#define CBP_KEEP_BYTES (1024 * 1024)
+
+typedef struct {
+    char* kept[CBP_CLASS_COUNT][CBP_MAX_KEPT];
+    size_t kept_count[CBP_CLASS_COUNT];
+    size_t kept_bytes;
+    size_t used_bytes;
+    size_t chunk_size;
+} CBPool;
+
+/* A pooled buffer owns no storage while it is empty. Storage is taken from
+ * the pool when the first byte arrives, replaced by the next class whenever
+ * it fills up below limit, and handed back once the buffer drains. A pinned
+ * buffer keeps its storage and layout, the kernel still works on it. */
 typedef struct {
     char* buf;
     size_t size;
     size_t count;
     size_t start;
+    bool mirrored;
+    bool pinned;
+
+    CBPool* pool;
+    size_t limit;
 } CyclicBuffer;
 
+typedef struct {
+    struct iovec iov[CB_BATCH_MAX_IOV];
+    CyclicBuffer* owners[CB_BATCH_MAX_IOV];
+    size_t groups[CB_BATCH_MAX_IOV];
+    size_t iov_count;
+    size_t group_count;
+    size_t total;
+} CBBatch;
+
 void cb_free(CyclicBuffer* this);
 void cb_init(CyclicBuffer* this, size_t size);
+bool cb_init_mirrored(CyclicBuffer* this, size_t size);
+void cb_init_pooled(CyclicBuffer* this, CBPool* pool, size_t limit);
+
+void cbp_init(CBPool* this);
+void cbp_free(CBPool* this);
 
 int cb_full(const CyclicBuffer* this);
 bool cb_empty(const CyclicBuffer* this);
@@ -26,6 +67,11 @@ size_t cb_free_contiguous_space(const CyclicBuffer* this);
 size_t cb_size(const CyclicBuffer* this);
 size_t cb_count(const CyclicBuffer* this);
 
+bool cb_reserve(CyclicBuffer* this);
+void cb_release(CyclicBuffer* this);
+void cb_pin(CyclicBuffer* this, bool pinned);
+bool cb_pinned(const CyclicBuffer* this);
+
 bool cb_putc(CyclicBuffer* this, char c);
 bool cb_getc(CyclicBuffer* this, char* c);
 
@@ -34,17 +80,30 @@ bool cb_peek(CyclicBuffer* this, char* c);
 size_t cb_puts(CyclicBuffer* this, const char* s);
 size_t cb_gets(CyclicBuffer* this, char* s);
 
+size_t cb_write(CyclicBuffer* this, const char* data, size_t count);
+
 void cb_clear(CyclicBuffer* this);
 
 void cb_shift(CyclicBuffer* this);
 ssize_t cb_recv(CyclicBuffer* this, int fd);
 ssize_t cb_send(CyclicBuffer* this, int fd);
 
+size_t cb_used_iov(const CyclicBuffer* this, struct iovec* iov, size_t max_count);
+size_t cb_free_iov(const CyclicBuffer* this, struct iovec* iov);
+
+void cbb_init(CBBatch* this);
+void cbb_begin_group(CBBatch* this);
+size_t cbb_free_slots(const CBBatch* this);
+size_t cbb_add_buffer(CBBatch* this, CyclicBuffer* buffer, size_t max_count);
+bool cbb_add_data(CBBatch* this, const char* data, size_t count);
+ssize_t cbb_send(CBBatch* this, int fd, CyclicBuffer* remainder);
+
 char* cb_data(CyclicBuffer* this);
 char* cb_data_end(CyclicBuffer* this);
 
 void cb_skip(CyclicBuffer* this, size_t count);
 void cb_skip_right(CyclicBuffer* this, size_t count);
+void cb_drop_right(CyclicBuffer* this, size_t count);
 
 /*void reserve(IOBuffer* this, size_t free_space);*/
 
@@ -0,0 +1,156 @@
+#include "handshake.h"
+
+#include "message_receiver.h"
+#include "transport_protocol_buffer.h"
+
+#include <sys/socket.h>
+#include <poll.h>
+#include <time.h>
+#include <stdio.h>
+
+#define HANDSHAKE_MESSAGE_SIZE 32
+
+#define HS_INCOMPLETE (-1)
+#define HS_MISMATCH (-2)
+
+/* A join names the tunnel and the tunnel count in the stream field. */
+#define HS_TUNNEL_BITS 8
+#define HS_TUNNEL_MASK ((1 << HS_TUNNEL_BITS) - 1)
+
+static int send_event(int fd, const TPBEvent* event) {
+    TPBuffer tpb;
+    tpb_init(&tpb, HANDSHAKE_MESSAGE_SIZE);
+
+    TPBControlBatch batch;
+    tpb_batch_init(&tpb, &batch);
+    tpb_batch_add(&batch, event, cb_free_space(&tpb.buffer));
+    tpb_batch_flush(&tpb, &batch);
+    cb_putc(&tpb.buffer, MESSAGE_EDGE);
+
+    int result = 0;
+    while (!tpb_empty(&tpb) && result != -1) {
+        result = tpb_send(&tpb, fd);
+    }
+
+    tpb_free(&tpb);
+    return result == -1 ? -1 : 0;
+}
+
+static int send_control(int fd, char op, int operand) {
+    return send_event(fd, &(TPBEvent) {.op = op, .stream = operand});
+}
+
+/* Looks at the pending input without consuming it and, if it starts with a
+ * complete control frame carrying op, consumes that frame and returns its
+ * stream field, the whole event goes to parsed. */
+static int try_receive_control(int fd, char op, TPBEvent* parsed) {
+    char input[HANDSHAKE_MESSAGE_SIZE];
+    const ssize_t count = recv(fd, input, sizeof(input), MSG_PEEK);
+    if (count <= 0) return HS_MISMATCH;
+
+    MessageReceiver mr;
+    init_mr(&mr, sizeof(input));
+    mr_puts(&mr, input, count);
+
+    char event[EVENT_MAX_LENGTH];
+    MRRange range;
+    const size_t ranges = mr_decode_ranges(&mr, event, sizeof(event), &range, 1);
+    const size_t consumed = count - mr_count(&mr);
+    free_messagerecv(&mr);
+
+    if (ranges == 0 || !range.complete) {
+        return count < HANDSHAKE_MESSAGE_SIZE ? HS_INCOMPLETE : HS_MISMATCH;
+    }
+
+    if (range.order != CONTROL_ORDER || tpb_parse_event(event, range.length, parsed) != range.length
+        || parsed->op != op || parsed->stream < 0) {
+        return HS_MISMATCH;
+    }
+
+    recv(fd, input, consumed, 0);
+    return parsed->stream;
+}
+
+static long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int wait_event(int fd, char op, int timeout, TPBEvent* event) {
+    static const struct timespec retry_time = {.tv_sec = 0, .tv_nsec = 1000000};
+    const long deadline = now_ms() + timeout;
+
+    for (long left = timeout; left >= 0; left = deadline - now_ms()) {
+        struct pollfd pollfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pollfd, 1, left) <= 0) break;
+
+        const int operand = try_receive_control(fd, op, event);
+        if (operand == HS_MISMATCH) break;
+        if (operand != HS_INCOMPLETE) return operand;
+
+        nanosleep(&retry_time, NULL);
+    }
+
+    return HS_MISMATCH;
+}
+
+static int wait_control(int fd, char op, int timeout) {
+    TPBEvent event;
+    return wait_event(fd, op, timeout, &event);
+}
+
+static PRFormat best_format(int formats) {
+    return (formats & PR_FORMAT_MASK(PR_FORMAT_LENGTH)) ? PR_FORMAT_LENGTH : PR_FORMAT_HDLC;
+}
+
+PRFormat hs_offer(int fd, int formats, int* features, int timeout) {
+    const int offered = *features;
+    *features = 0;
+
+    if (send_control(fd, CLIENT_HELLO, formats | offered) == -1) return PR_FORMAT_HDLC;
+
+    const int answer = wait_control(fd, CLIENT_HELLO_ACK, timeout);
+    const int chosen = answer & HS_FORMAT_BITS;
+    if (answer < 0 || (formats & PR_FORMAT_MASK(chosen)) == 0) {
+        fprintf(stderr, "Tunnel peer did not negotiate a format, falling back to HDLC\n");
+        return PR_FORMAT_HDLC;
+    }
+
+    *features = answer & offered & ~HS_FORMAT_BITS;
+    return chosen;
+}
+
+PRFormat hs_accept(int fd, int formats, int* features, int timeout) {
+    const int supported = *features;
+    *features = 0;
+
+    const int offered = wait_control(fd, CLIENT_HELLO, timeout);
+    if (offered < 0) return PR_FORMAT_HDLC;
+
+    const PRFormat chosen = best_format(offered & formats & HS_FORMAT_BITS);
+    const int agreed = offered & supported & ~HS_FORMAT_BITS;
+    if (send_control(fd, CLIENT_HELLO_ACK, chosen | agreed) == -1) return PR_FORMAT_HDLC;
+
+    *features = agreed;
+    return chosen;
+}
+
+bool hs_join(int fd, const HSJoin* join) {
+    const TPBEvent event = {
+        .op = CLIENT_JOIN,
+        .stream = join->tunnel << HS_TUNNEL_BITS | join->tunnel_count,
+        .operand = join->session,
+    };
+    return send_event(fd, &event) == 0;
+}
+
+bool hs_wait_join(int fd, HSJoin* join, int timeout) {
+    TPBEvent event;
+    if (wait_event(fd, CLIENT_JOIN, timeout, &event) < 0) return false;
+
+    join->session = event.operand;
+    join->tunnel = event.stream >> HS_TUNNEL_BITS;
+    join->tunnel_count = event.stream & HS_TUNNEL_MASK;
+    return join->tunnel < join->tunnel_count && join->tunnel_count <= HS_MAX_TUNNELS && event.operand <= UINT32_MAX;
+}
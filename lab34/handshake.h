@@ -0,0 +1,42 @@
+#ifndef HANDSHAKE_H
+#define HANDSHAKE_H
+
+#include "protocol.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HANDSHAKE_TIMEOUT 1000
+
+#define HS_SUPPORTED_FORMATS (PR_FORMAT_MASK(PR_FORMAT_HDLC) | PR_FORMAT_MASK(PR_FORMAT_LENGTH))
+
+/* Optional features share the hello operand with the format bits. */
+#define HS_FORMAT_BITS 0x0F
+#define HS_FEATURE_FLOW_CONTROL 0x10
+#define HS_FEATURE_COMPRESSION 0x20
+/* Only offered and accepted on UNIX socket tunnels, see shm_link.h. */
+#define HS_FEATURE_SHARED_MEMORY 0x40
+/* Striped tunnels span several connections and need the length format. */
+#define HS_FEATURE_STRIPING 0x80
+
+#define HS_SUPPORTED_FEATURES (HS_FEATURE_FLOW_CONTROL | HS_FEATURE_COMPRESSION | HS_FEATURE_SHARED_MEMORY \
+    | HS_FEATURE_STRIPING)
+
+#define HS_MAX_TUNNELS 16
+
+/* Every connection of a striped tunnel follows its hello with a CLIENT_JOIN
+ * naming the session, the connection's place in it and how many there are. */
+typedef struct {
+    uint32_t session;
+    size_t tunnel;
+    size_t tunnel_count;
+} HSJoin;
+
+PRFormat hs_offer(int fd, int formats, int* features, int timeout);
+PRFormat hs_accept(int fd, int formats, int* features, int timeout);
+
+bool hs_join(int fd, const HSJoin* join);
+bool hs_wait_join(int fd, HSJoin* join, int timeout);
+
+#endif // !HANDSHAKE_H
@@ -0,0 +1,63 @@
+#include "id_queue.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+void iq_init(IdQueue* this) {
+    memset(this, 0, sizeof(*this));
+}
+
+void iq_free(IdQueue* this) {
+    free(this->ids);
+    memset(this, 0, sizeof(*this));
+}
+
+bool iq_empty(const IdQueue* this) {
+    return this->count == 0;
+}
+
+size_t iq_count(const IdQueue* this) {
+    return this->count;
+}
+
+static bool iq_grow(IdQueue* this) {
+    const size_t capacity = this->capacity == 0 ? IQ_INITIAL_CAPACITY : 2 * this->capacity;
+    int* ids = malloc(capacity * sizeof(*ids));
+    if (ids == NULL) {
+        perror("malloc");
+        return false;
+    }
+
+    for (size_t i = 0; i < this->count; ++i) {
+        ids[i] = this->ids[(this->start + i) % this->capacity];
+    }
+
+    free(this->ids);
+    this->ids = ids;
+    this->capacity = capacity;
+    this->start = 0;
+    return true;
+}
+
+bool iq_push(IdQueue* this, int id) {
+    if (this->count == this->capacity && !iq_grow(this)) return false;
+
+    this->ids[(this->start + this->count) % this->capacity] = id;
+    this->count++;
+    return true;
+}
+
+bool iq_peek(const IdQueue* this, int* id) {
+    if (this->count == 0) return false;
+
+    *id = this->ids[this->start];
+    return true;
+}
+
+void iq_pop(IdQueue* this) {
+    if (this->count == 0) return;
+
+    this->start = (this->start + 1) % this->capacity;
+    this->count--;
+}
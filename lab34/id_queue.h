@@ -0,0 +1,26 @@
+#ifndef ID_QUEUE_H
+#define ID_QUEUE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define IQ_INITIAL_CAPACITY 16
+
+typedef struct {
+    int* ids;
+    size_t capacity;
+    size_t start;
+    size_t count;
+} IdQueue;
+
+void iq_init(IdQueue* this);
+void iq_free(IdQueue* this);
+
+bool iq_empty(const IdQueue* this);
+size_t iq_count(const IdQueue* this);
+
+bool iq_push(IdQueue* this, int id);
+bool iq_peek(const IdQueue* this, int* id);
+void iq_pop(IdQueue* this);
+
+#endif // !ID_QUEUE_H
@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+
+#include "io_ring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned arg_count) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, arg_count);
+}
+
+static void* ring_map(int fd, size_t size, off_t offset) {
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+bool ir_init(IoRing* this) {
+    memset(this, 0, sizeof(*this));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    this->fd = io_uring_setup(IR_ENTRIES, &params);
+    if (this->fd == -1) {
+        perror("io_uring_setup");
+        return false;
+    }
+
+    /* Requests outlive the call that submits them, their iovecs must not. */
+    if ((params.features & IORING_FEAT_SUBMIT_STABLE) == 0) {
+        fprintf(stderr, "io_uring: kernel does not copy requests on submit\n");
+        close(this->fd);
+        return false;
+    }
+
+    this->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    this->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (this->cq_map_size > this->sq_map_size) {
+            this->sq_map_size = this->cq_map_size;
+        }
+    }
+
+    this->sq_map = ring_map(this->fd, this->sq_map_size, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        this->cq_map = this->sq_map;
+    } else if (this->sq_map != NULL) {
+        this->cq_map = ring_map(this->fd, this->cq_map_size, IORING_OFF_CQ_RING);
+    }
+    this->sqes = ring_map(this->fd, params.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+
+    if (this->sq_map == NULL || this->cq_map == NULL || this->sqes == NULL) {
+        perror("mmap");
+        ir_free(this);
+        return false;
+    }
+
+    char* sq = this->sq_map;
+    this->sq_tail = (unsigned*) &sq[params.sq_off.tail];
+    this->sq_array = (unsigned*) &sq[params.sq_off.array];
+    this->sq_mask = *(unsigned*) &sq[params.sq_off.ring_mask];
+
+    char* cq = this->cq_map;
+    this->cq_head = (unsigned*) &cq[params.cq_off.head];
+    this->cq_tail = (unsigned*) &cq[params.cq_off.tail];
+    this->cq_mask = *(unsigned*) &cq[params.cq_off.ring_mask];
+    this->cqes = (struct io_uring_cqe*) &cq[params.cq_off.cqes];
+
+    return true;
+}
+
+void ir_free(IoRing* this) {
+    if (this->sqes != NULL) {
+        munmap(this->sqes, (this->sq_mask + 1) * sizeof(struct io_uring_sqe));
+    }
+    if (this->cq_map != NULL && this->cq_map != this->sq_map) {
+        munmap(this->cq_map, this->cq_map_size);
+    }
+    if (this->sq_map != NULL) {
+        munmap(this->sq_map, this->sq_map_size);
+    }
+    if (this->fd >= 0) {
+        close(this->fd);
+    }
+    memset(this, 0, sizeof(*this));
+}
+
+/* Completions signal the eventfd, so a poll loop wakes up for them. */
+bool ir_set_eventfd(IoRing* this, int event_fd) {
+    if (io_uring_register(this->fd, IORING_REGISTER_EVENTFD, &event_fd, 1) == -1) {
+        perror("io_uring_register");
+        return false;
+    }
+    return true;
+}
+
+unsigned ir_space(const IoRing* this) {
+    return IR_ENTRIES - this->prepared - this->in_flight;
+}
+
+unsigned ir_in_flight(const IoRing* this) {
+    return this->in_flight;
+}
+
+static bool ir_prepare(IoRing* this, int opcode, int fd, const struct iovec* iov, size_t iov_count, uint64_t tag) {
+    if (ir_space(this) == 0 || iov_count > IR_MAX_IOV) return false;
+
+    const unsigned tail = *this->sq_tail + this->prepared;
+    const unsigned index = tail & this->sq_mask;
+
+    memcpy(this->iov[index], iov, iov_count * sizeof(*iov));
+
+    struct io_uring_sqe* sqe = &this->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) this->iov[index];
+    sqe->len = iov_count;
+    sqe->user_data = tag;
+
+    this->sq_array[index] = index;
+    this->prepared++;
+    return true;
+}
+
+bool ir_readv(IoRing* this, int fd, const struct iovec* iov, size_t iov_count, uint64_t tag) {
+    return ir_prepare(this, IORING_OP_READV, fd, iov, iov_count, tag);
+}
+
+bool ir_writev(IoRing* this, int fd, const struct iovec* iov, size_t iov_count, uint64_t tag) {
+    return ir_prepare(this, IORING_OP_WRITEV, fd, iov, iov_count, tag);
+}
+
+static bool ir_has_completions(const IoRing* this) {
+    return __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE) != *this->cq_head;
+}
+
+/* Publishes the prepared requests and, if there were any, waits for the first
+ * completion unless one is there already. Requests that still wait for their
+ * socket complete in a later call. Returns the number of requests in flight
+ * or -1. */
+int ir_submit_wait(IoRing* this) {
+    __atomic_store_n(this->sq_tail, *this->sq_tail + this->prepared, __ATOMIC_RELEASE);
+    unsigned to_submit = this->prepared;
+    this->in_flight += this->prepared;
+    this->prepared = 0;
+
+    const bool wait = to_submit > 0;
+    while (to_submit > 0 || (wait && !ir_has_completions(this))) {
+        const unsigned min_complete = ir_has_completions(this) ? 0 : 1;
+        const int submitted = io_uring_enter(this->fd, to_submit, min_complete, IORING_ENTER_GETEVENTS);
+        this->enter_calls++;
+        if (submitted == -1) {
+            if (errno == EINTR) continue;
+            perror("io_uring_enter");
+            return -1;
+        }
+        to_submit -= submitted;
+    }
+
+    return this->in_flight;
+}
+
+bool ir_reap(IoRing* this, uint64_t* tag, int* result) {
+    if (!ir_has_completions(this)) return false;
+
+    const unsigned head = *this->cq_head;
+    const struct io_uring_cqe* cqe = &this->cqes[head & this->cq_mask];
+    *tag = cqe->user_data;
+    *result = cqe->res;
+
+    __atomic_store_n(this->cq_head, head + 1, __ATOMIC_RELEASE);
+    this->in_flight--;
+    return true;
+}
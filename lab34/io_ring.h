@@ -0,0 +1,53 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define IR_ENTRIES 256
+#define IR_MAX_IOV 2
+
+/* A bare io_uring without liburing. Requests are prepared in a batch and
+ * handed to the kernel with one io_uring_enter, which only waits for the
+ * first completion. The kernel copies the iovecs when it takes a request, but
+ * the memory they point to stays in use until the request completes. */
+typedef struct {
+    int fd;
+
+    void* sq_map;
+    size_t sq_map_size;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    struct io_uring_sqe* sqes;
+
+    void* cq_map;
+    size_t cq_map_size;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    unsigned prepared;
+    unsigned in_flight;
+    size_t enter_calls;
+    struct iovec iov[IR_ENTRIES][IR_MAX_IOV];
+} IoRing;
+
+bool ir_init(IoRing* this);
+void ir_free(IoRing* this);
+
+bool ir_set_eventfd(IoRing* this, int event_fd);
+
+unsigned ir_space(const IoRing* this);
+unsigned ir_in_flight(const IoRing* this);
+bool ir_readv(IoRing* this, int fd, const struct iovec* iov, size_t iov_count, uint64_t tag);
+bool ir_writev(IoRing* this, int fd, const struct iovec* iov, size_t iov_count, uint64_t tag);
+
+int ir_submit_wait(IoRing* this);
+bool ir_reap(IoRing* this, uint64_t* tag, int* result);
+
+#endif // !IO_RING_H
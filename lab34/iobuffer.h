@@ -6,10 +6,13 @@
 #include <stdbool.h>
 
 #define END_OF_BUFFER (-1)
-
+/* The data are the count bytes from start. Consuming only moves start, the
+ * data go back to the front once the space behind them gets too small for
+ * the next put or read. */
 typedef struct {
     char* buf;
     size_t size;
+    size_t start;
     size_t count;
 } IOBuffer;
 
@@ -20,6 +23,8 @@ int iob_full(const IOBuffer* this);
 bool iob_empty(const IOBuffer* this);
 size_t iob_free_space(const IOBuffer* this);
 
+char* iob_data(const IOBuffer* this);
+
 ssize_t iob_recv(IOBuffer* this, int fd);
 void iob_shift(IOBuffer* this, size_t offset);
 ssize_t iob_send(IOBuffer* this, int fd);
@@ -0,0 +1,1183 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_TSC
+#endif // __x86_64__ || __i386__
+
+#include "io_ring.h"
+#include "protocol.h"
+#include "message_buffer.h"
+#include "message_receiver.h"
+#include "transport_protocol_buffer.h"
+#include "server_management.h"
+#include "lz.h"
+#include "utils.h"
+
+/* Throughput and differential fuzzing of the tunnel codecs:
+ *   codec-bench bench [MEGABYTES]          GB/s and cycles per byte per codec
+ *   codec-bench fuzz [ITERATIONS] [SEED]   round trips across random splits */
+
+#define FRAME_SIZE 1024
+#define MESSAGE_SIZE (2 * FRAME_SIZE + 3)
+#define COMPRESSED_MESSAGE_SIZE (PR_COMPRESS_LIMIT + TPB_HEADER_LENGTH)
+#define PAYLOAD_SIZE (1024 * 1024)
+#define FEED_SIZE (64 * 1024)
+#define BENCH_STREAMS 4
+
+#define BENCH_DEFAULT_MEGABYTES 16
+/* Slack for timer noise before a vector encoder counts as slower than scalar. */
+#define ESCAPE_REGRESSION_RATIO 1.5
+#define ESCAPE_ROUNDS 5
+#define ENGINE_PAIRS 64
+#define ENGINE_CHUNK (16 * 1024)
+#define ENGINE_WAKEUP UINT32_MAX
+#define FUZZ_DEFAULT_ITERATIONS 500
+#define FUZZ_STREAMS 8
+#define FUZZ_MAX_FRAMES 64
+#define FUZZ_MAX_FRAME (8 * 1024)
+#define FUZZ_MAX_EVENTS 16
+
+typedef struct {
+    uint64_t state;
+} Rng;
+
+static uint64_t rng_next(Rng* this) {
+    this->state ^= this->state << 13;
+    this->state ^= this->state >> 7;
+    this->state ^= this->state << 17;
+    return this->state;
+}
+
+static size_t rng_range(Rng* this, size_t from, size_t to) {
+    return from + rng_next(this) % (to - from + 1);
+}
+
+static void rng_seed(Rng* this, uint64_t seed) {
+    this->state = seed * 0x9E3779B97F4A7C15ull + 1;
+}
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t size;
+} ByteVec;
+
+static void bv_free(ByteVec* this) {
+    free(this->data);
+    memset(this, 0, sizeof(*this));
+}
+
+static char* bv_reserve(ByteVec* this, size_t count) {
+    if (this->length + count > this->size) {
+        const size_t size = max_size_t(2 * this->size, this->length + count);
+        char* data = realloc(this->data, size);
+        if (data == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        this->data = data;
+        this->size = size;
+    }
+    return &this->data[this->length];
+}
+
+static void bv_append(ByteVec* this, const char* data, size_t count) {
+    memcpy(bv_reserve(this, count), data, count);
+    this->length += count;
+}
+
+/* Payloads */
+
+typedef enum {
+    PAYLOAD_RANDOM,
+    PAYLOAD_EDGES,
+    PAYLOAD_TEXT,
+    PAYLOAD_MIXED,
+    PAYLOAD_SPECIALS,
+    PAYLOAD_COUNT
+} PayloadKind;
+
+static const char* payload_names[PAYLOAD_COUNT] = {"random", "edges", "text", "mixed", "specials"};
+
+static const size_t mixed_sizes[] = {1, 7, 64, 300, 1024, 1460, 4096, 16384};
+
+static const char* words[] = {
+    "the", "tunnel", "stream", "frame", "buffer", "client", "server", "order",
+    "escape", "edge", "window", "credit", "batch", "length", "of", "a", "to", "and",
+};
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t* frames;
+    size_t frame_count;
+} Payload;
+
+static void fill_text(Rng* rng, char* data, size_t length) {
+    size_t i = 0;
+    while (i < length) {
+        const char* word = words[rng_next(rng) % (sizeof(words) / sizeof(*words))];
+        for (size_t j = 0; word[j] != '\0' && i < length; ++j) {
+            data[i++] = word[j];
+        }
+        if (i < length) {
+            data[i++] = rng_next(rng) % 12 == 0 ? '\n' : ' ';
+        }
+    }
+}
+
+static void fill_random(Rng* rng, char* data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        data[i] = (char) rng_next(rng);
+    }
+}
+
+static void fill_specials(Rng* rng, char* data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        data[i] = rng_next(rng) % 2 == 0 ? MESSAGE_EDGE : MESSAGE_ESCAPE;
+    }
+}
+
+static void payload_init(Payload* this, PayloadKind kind, Rng* rng) {
+    this->length = PAYLOAD_SIZE;
+    this->data = malloc(this->length);
+    this->frames = malloc(this->length * sizeof(*this->frames));
+    if (this->data == NULL || this->frames == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    switch (kind) {
+        case PAYLOAD_EDGES: memset(this->data, MESSAGE_EDGE, this->length); break;
+        case PAYLOAD_TEXT: fill_text(rng, this->data, this->length); break;
+        case PAYLOAD_SPECIALS: fill_specials(rng, this->data, this->length); break;
+        default: fill_random(rng, this->data, this->length); break;
+    }
+
+    this->frame_count = 0;
+    for (size_t offset = 0; offset < this->length; ) {
+        size_t frame = FRAME_SIZE;
+        if (kind == PAYLOAD_MIXED) {
+            frame = mixed_sizes[rng_next(rng) % (sizeof(mixed_sizes) / sizeof(*mixed_sizes))];
+        }
+        frame = min_size_t(frame, this->length - offset);
+        this->frames[this->frame_count++] = frame;
+        offset += frame;
+    }
+}
+
+static void payload_free(Payload* this) {
+    free(this->data);
+    free(this->frames);
+}
+
+/* Tunnel encoder setups */
+
+typedef struct {
+    const char* name;
+    PRFormat format;
+    bool compress;
+    bool sequenced;
+} Setup;
+
+static const Setup setups[] = {
+    {"hdlc", PR_FORMAT_HDLC, false, false},
+    {"length", PR_FORMAT_LENGTH, false, false},
+    {"length+seq", PR_FORMAT_LENGTH, false, true},
+    {"length+lz", PR_FORMAT_LENGTH, true, false},
+};
+
+#define SETUP_COUNT (sizeof(setups) / sizeof(*setups))
+
+static void setup_tpb(TPBuffer* tpb, const Setup* setup, size_t size) {
+    tpb_init(tpb, setup->compress ? PR_COMPRESS_LIMIT : size);
+    tpb_set_format(tpb, setup->format);
+    if (setup->compress) {
+        tpb_enable_compression(tpb);
+    }
+    if (setup->sequenced) {
+        tpb_enable_sequencing(tpb);
+    }
+}
+
+static void setup_mr(MessageReceiver* mr, const Setup* setup) {
+    init_mr(mr, setup->compress ? COMPRESSED_MESSAGE_SIZE : MESSAGE_SIZE);
+    mr_set_format(mr, setup->format);
+    if (setup->compress) {
+        mr_enable_compression(mr);
+    }
+}
+
+/* Moves up to max_count sealed bytes out of the tpb, to the wire if given. */
+static void tpb_drain(TPBuffer* tpb, ByteVec* wire, size_t max_count) {
+    tpb_seal(tpb);
+
+    struct iovec iov[CB_MAX_SEGMENTS];
+    const size_t iov_count = cb_used_iov(&tpb->buffer, iov, max_count);
+
+    size_t count = 0;
+    for (size_t i = 0; i < iov_count; ++i) {
+        if (wire != NULL) {
+            bv_append(wire, iov[i].iov_base, iov[i].iov_len);
+        }
+        count += iov[i].iov_len;
+    }
+    cb_skip(&tpb->buffer, count);
+}
+
+static void tpb_encode(TPBuffer* tpb, ByteVec* wire, Rng* splits, char* data, size_t length, int order, uint64_t seq) {
+    for (size_t done = 0; done < length; ) {
+        const size_t count = tpb_encapsulate(tpb, &data[done], length - done, order, seq + done);
+        done += count;
+        if (done < length && !tpb_empty(tpb)) {
+            const size_t pending = cb_count(&tpb->buffer);
+            tpb_drain(tpb, wire, splits == NULL ? pending : rng_range(splits, 1, pending));
+        }
+    }
+}
+
+/* Passes the data through a pipe into tpb_recv_frame, the path the sender
+ * reads idle clients with. */
+static void tpb_encode_direct(TPBuffer* tpb, ByteVec* wire, Rng* splits, const int* pipe_fds,
+    const char* data, size_t length, int order, uint64_t seq) {
+    for (size_t done = 0; done < length; ) {
+        const size_t chunk = write(pipe_fds[1], &data[done], rng_range(splits, 1, length - done));
+        done += chunk;
+
+        for (size_t left = chunk; left > 0; ) {
+            const ssize_t count = tpb_recv_frame(tpb, pipe_fds[0], order, seq + done - left, rng_range(splits, 1, left));
+            if (count > 0) {
+                left -= count;
+            } else {
+                tpb_drain(tpb, wire, rng_range(splits, 1, cb_count(&tpb->buffer)));
+            }
+        }
+    }
+}
+
+/* Benchmark */
+
+typedef struct {
+    struct timespec start;
+    uint64_t start_cycles;
+} Stopwatch;
+
+static void stopwatch_start(Stopwatch* this) {
+    clock_gettime(CLOCK_MONOTONIC, &this->start);
+#ifdef BENCH_HAS_TSC
+    this->start_cycles = __rdtsc();
+#endif // BENCH_HAS_TSC
+}
+
+static void stopwatch_report(const Stopwatch* this, const char* codec, const char* payload, size_t bytes) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const double seconds = (end.tv_sec - this->start.tv_sec) + (end.tv_nsec - this->start.tv_nsec) / 1e9;
+
+    printf("%-14s %-8s %-8s %8.3f GB/s", codec, pr_impl_name(pr_current_impl()), payload, bytes / seconds / 1e9);
+#ifdef BENCH_HAS_TSC
+    printf(" %8.3f cycles/B", (double) (__rdtsc() - this->start_cycles) / bytes);
+#endif // BENCH_HAS_TSC
+    printf("\n");
+}
+
+static volatile size_t bench_sink;
+
+static void escape_payload(const Payload* payload) {
+    char message[2 * PR_COMPRESS_LIMIT + 2];
+    const char* data = payload->data;
+    for (size_t i = 0; i < payload->frame_count; data += payload->frames[i++]) {
+        size_t written;
+        pr_encapsulate(data, payload->frames[i], message, sizeof(message), &written);
+        bench_sink += written;
+    }
+}
+
+static void bench_escape(const Payload* payload, size_t total, const char* name) {
+    Stopwatch watch;
+    size_t done = 0;
+
+    stopwatch_start(&watch);
+    for (; done < total; done += payload->length) {
+        escape_payload(payload);
+    }
+    stopwatch_report(&watch, "pr_encapsulate", name, done);
+
+    stopwatch_start(&watch);
+    for (done = 0; done < total; done += payload->length) {
+        const char* data = payload->data;
+        for (size_t i = 0; i < payload->frame_count; data += payload->frames[i++]) {
+            bench_sink += message_length(data, payload->frames[i]);
+        }
+    }
+    stopwatch_report(&watch, "message_length", name, done);
+}
+
+/* The best of a few rounds, single runs are too noisy to compare. */
+static double time_escape(const Payload* payload, size_t total) {
+    double best = 0;
+    for (int round = 0; round < ESCAPE_ROUNDS; ++round) {
+        struct timespec start;
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t done = 0; done < total; done += payload->length) {
+            escape_payload(payload);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (round == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+    return best;
+}
+
+/* A vector encoder that loses to the byte loop on input that is nothing but
+ * specials is a regression. */
+static int check_escape(const Payload* payload, size_t total, const char* name) {
+    int result = EXIT_SUCCESS;
+    double scalar = 0;
+    for (int impl = PR_IMPL_SCALAR; impl < PR_IMPL_COUNT; ++impl) {
+        if (!pr_select_impl(impl)) continue;
+
+        const double seconds = time_escape(payload, total);
+        if (impl == PR_IMPL_SCALAR) {
+            scalar = seconds;
+        } else if (seconds > scalar * ESCAPE_REGRESSION_RATIO) {
+            fprintf(stderr, "bench: pr_encapsulate with %s is %.2fx slower than scalar on %s\n",
+                pr_impl_name(impl), seconds / scalar, name);
+            result = EXIT_FAILURE;
+        }
+    }
+    return result;
+}
+
+static void bench_message_buffer(const Payload* payload, size_t total, const char* name) {
+    MessageBuffer mb;
+    init_mb(&mb, FEED_SIZE);
+
+    Stopwatch watch;
+    size_t done = 0;
+
+    stopwatch_start(&watch);
+    while (done < total) {
+        const char* data = payload->data;
+        for (size_t i = 0; i < payload->frame_count; data += payload->frames[i++]) {
+            const char order = (char) pr_wire_order(i % BENCH_STREAMS);
+            for (size_t encoded = 0; encoded < payload->frames[i]; ) {
+                const ssize_t count = encapsulate(&mb, &data[encoded], payload->frames[i] - encoded, order);
+                if (count > 0) {
+                    encoded += count;
+                }
+                if (encoded < payload->frames[i]) {
+                    iob_clear(&mb.message);
+                }
+            }
+        }
+        done += payload->length;
+    }
+    stopwatch_report(&watch, "message_buffer", name, done);
+
+    free_messagebuf(&mb);
+}
+
+static void bench_tpb(const Payload* payload, size_t total, const char* name, const Setup* setup) {
+    TPBuffer tpb;
+    setup_tpb(&tpb, setup, FEED_SIZE);
+
+    char codec[32];
+    snprintf(codec, sizeof(codec), "tpb-%s", setup->name);
+
+    Stopwatch watch;
+    size_t done = 0;
+
+    stopwatch_start(&watch);
+    while (done < total) {
+        char* data = payload->data;
+        for (size_t i = 0; i < payload->frame_count; data += payload->frames[i++]) {
+            tpb_encode(&tpb, NULL, NULL, data, payload->frames[i], i % BENCH_STREAMS, 0);
+        }
+        tpb_drain(&tpb, NULL, cb_count(&tpb.buffer));
+        done += payload->length;
+    }
+    stopwatch_report(&watch, codec, name, done);
+
+    tpb_free(&tpb);
+}
+
+static void bench_mr(const Payload* payload, size_t total, const char* name, const Setup* setup) {
+    TPBuffer tpb;
+    setup_tpb(&tpb, setup, FEED_SIZE);
+
+    ByteVec wire = {0};
+    char* data = payload->data;
+    for (size_t i = 0; i < payload->frame_count; data += payload->frames[i++]) {
+        tpb_encode(&tpb, &wire, NULL, data, payload->frames[i], i % BENCH_STREAMS, 0);
+    }
+    tpb_drain(&tpb, &wire, cb_count(&tpb.buffer));
+    tpb_free(&tpb);
+
+    char codec[32];
+    snprintf(codec, sizeof(codec), "mr-%s", setup->name);
+
+    char* output = malloc(FEED_SIZE);
+    MessageReceiver mr;
+    Stopwatch watch;
+    size_t done = 0;
+
+    stopwatch_start(&watch);
+    while (done < total) {
+        setup_mr(&mr, setup);
+        for (size_t fed = 0; fed < wire.length || !mr_empty(&mr); ) {
+            const size_t put = mr_puts(&mr, &wire.data[fed], min_size_t(FEED_SIZE, wire.length - fed));
+            fed += put;
+
+            size_t decoded = 0;
+            while (get_current_order(&mr) != MR_NO_ORDER) {
+                const ssize_t count = decapsulate(&mr, output, FEED_SIZE);
+                decoded += count;
+                if (count == 0 && mr_empty(&mr)) break;
+            }
+            bench_sink += decoded;
+            if (put == 0 && decoded == 0) break;
+        }
+        free_messagerecv(&mr);
+        done += payload->length;
+    }
+    stopwatch_report(&watch, codec, name, done);
+
+    free(output);
+    bv_free(&wire);
+}
+
+/* Client I/O engines. Socket pairs stand in for clients, one end is written
+ * and the other read, the way the sender serves its clients: epoll tells
+ * which ends are ready, and either every end gets its own read or write call
+ * or all of them go through the ring in one io_uring_enter. */
+
+typedef struct {
+    int fds[ENGINE_PAIRS][2];
+    size_t to_send[ENGINE_PAIRS];
+    bool pending[ENGINE_PAIRS][2];
+    char chunks[ENGINE_PAIRS][ENGINE_CHUNK];
+
+    const char* data;
+    size_t received;
+    int epoll_fd;
+    int event_fd;
+    size_t syscalls;
+} EngineBench;
+
+static void engine_free(EngineBench* this) {
+    for (size_t i = 0; i < ENGINE_PAIRS; ++i) {
+        close(this->fds[i][0]);
+        close(this->fds[i][1]);
+    }
+    close(this->epoll_fd);
+    close(this->event_fd);
+}
+
+/* End 0 of a pair is read, end 1 is written. */
+static bool engine_init(EngineBench* this, const char* data, size_t per_pair) {
+    memset(this, 0, sizeof(*this));
+    this->data = data;
+    this->epoll_fd = epoll_create1(0);
+    this->event_fd = eventfd(0, EFD_NONBLOCK);
+
+    struct epoll_event wakeup = {.events = EPOLLIN, .data.u32 = ENGINE_WAKEUP};
+    bool ok = this->epoll_fd != -1 && this->event_fd != -1
+        && epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->event_fd, &wakeup) == 0;
+
+    for (size_t i = 0; i < ENGINE_PAIRS; ++i) {
+        this->to_send[i] = per_pair;
+        if (!ok || socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, this->fds[i]) == -1) {
+            this->fds[i][0] = this->fds[i][1] = -1;
+            ok = false;
+            continue;
+        }
+
+        struct epoll_event in = {.events = EPOLLIN, .data.u32 = 2 * i};
+        struct epoll_event out = {.events = EPOLLOUT, .data.u32 = 2 * i + 1};
+        ok = epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->fds[i][0], &in) == 0
+            && epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->fds[i][1], &out) == 0;
+    }
+
+    if (!ok) {
+        perror("engine_init");
+        engine_free(this);
+    }
+    return ok;
+}
+
+static int engine_wait(EngineBench* this, struct epoll_event* events) {
+    this->syscalls++;
+    return epoll_wait(this->epoll_fd, events, 2 * ENGINE_PAIRS + 1, -1);
+}
+
+static void engine_done(EngineBench* this, size_t pair, size_t end, ssize_t count) {
+    if (count <= 0) return;
+
+    if (end == 0) {
+        this->received += count;
+        return;
+    }
+
+    this->to_send[pair] -= count;
+    if (this->to_send[pair] == 0) {
+        struct epoll_event none = {.events = 0, .data.u32 = 2 * pair + 1};
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, this->fds[pair][1], &none);
+        this->syscalls++;
+    }
+}
+
+static struct iovec engine_iov(EngineBench* this, size_t pair, size_t end) {
+    if (end == 0) return (struct iovec) {.iov_base = this->chunks[pair], .iov_len = ENGINE_CHUNK};
+    return (struct iovec) {.iov_base = (char*) this->data, .iov_len = min_size_t(ENGINE_CHUNK, this->to_send[pair])};
+}
+
+static bool engine_run_epoll(EngineBench* this, size_t total) {
+    struct epoll_event events[2 * ENGINE_PAIRS + 1];
+    while (this->received < total) {
+        const int count = engine_wait(this, events);
+        if (count == -1) return false;
+
+        for (int i = 0; i < count; ++i) {
+            const size_t pair = events[i].data.u32 / 2;
+            const size_t end = events[i].data.u32 % 2;
+            const struct iovec iov = engine_iov(this, pair, end);
+
+            this->syscalls++;
+            const ssize_t done = end == 0
+                ? read(this->fds[pair][0], iov.iov_base, iov.iov_len)
+                : write(this->fds[pair][1], iov.iov_base, iov.iov_len);
+            engine_done(this, pair, end, done);
+        }
+    }
+    return true;
+}
+
+static bool engine_run_ring(EngineBench* this, IoRing* ring, size_t total) {
+    struct epoll_event events[2 * ENGINE_PAIRS + 1];
+    while (this->received < total) {
+        const int count = engine_wait(this, events);
+        if (count == -1) return false;
+
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.u32 == ENGINE_WAKEUP) {
+                uint64_t value;
+                this->syscalls++;
+                read(this->event_fd, &value, sizeof(value));
+                continue;
+            }
+
+            const size_t pair = events[i].data.u32 / 2;
+            const size_t end = events[i].data.u32 % 2;
+            if (this->pending[pair][end]) continue;
+
+            const struct iovec iov = engine_iov(this, pair, end);
+            this->pending[pair][end] = end == 0
+                ? ir_readv(ring, this->fds[pair][0], &iov, 1, events[i].data.u32)
+                : ir_writev(ring, this->fds[pair][1], &iov, 1, events[i].data.u32);
+        }
+
+        if (ir_submit_wait(ring) == -1) return false;
+
+        uint64_t tag;
+        int result;
+        while (ir_reap(ring, &tag, &result)) {
+            this->pending[tag / 2][tag % 2] = false;
+            engine_done(this, tag / 2, tag % 2, result);
+        }
+    }
+
+    this->syscalls += ring->enter_calls;
+    return true;
+}
+
+static void engine_report(const EngineBench* this, const char* engine, const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const double seconds = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+
+    printf("%-14s %-8s %8.3f GB/s %8.1f syscalls/MB\n", "client io", engine,
+        this->received / seconds / 1e9, this->syscalls / (this->received / 1e6));
+}
+
+static void bench_engines(const Payload* payload, size_t total) {
+    const size_t per_pair = total / ENGINE_PAIRS;
+    EngineBench* bench = malloc(sizeof(*bench));
+    if (bench == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    struct timespec start;
+    if (engine_init(bench, payload->data, per_pair)) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (engine_run_epoll(bench, per_pair * ENGINE_PAIRS)) {
+            engine_report(bench, "epoll", &start);
+        }
+        engine_free(bench);
+    }
+
+    IoRing ring;
+    if (!ir_init(&ring)) {
+        printf("%-14s %-8s unavailable\n", "client io", "uring");
+        free(bench);
+        return;
+    }
+
+    /* Reads are still in flight at the end, the ring goes before the sockets. */
+    const bool ready = engine_init(bench, payload->data, per_pair);
+    if (ready && ir_set_eventfd(&ring, bench->event_fd)) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (engine_run_ring(bench, &ring, per_pair * ENGINE_PAIRS)) {
+            engine_report(bench, "uring", &start);
+        }
+    }
+
+    ir_free(&ring);
+    if (ready) {
+        engine_free(bench);
+    }
+    free(bench);
+}
+
+static int run_bench(size_t megabytes) {
+    Rng rng;
+    rng_seed(&rng, 1);
+
+    Payload payloads[PAYLOAD_COUNT];
+    for (int kind = 0; kind < PAYLOAD_COUNT; ++kind) {
+        payload_init(&payloads[kind], kind, &rng);
+    }
+
+    const size_t total = megabytes * 1024 * 1024;
+    for (int impl = PR_IMPL_SCALAR; impl < PR_IMPL_COUNT; ++impl) {
+        if (!pr_select_impl(impl)) continue;
+
+        for (int kind = 0; kind < PAYLOAD_COUNT; ++kind) {
+            const Payload* payload = &payloads[kind];
+            bench_escape(payload, total, payload_names[kind]);
+            bench_message_buffer(payload, total, payload_names[kind]);
+
+            for (size_t i = 0; i < SETUP_COUNT; ++i) {
+                bench_tpb(payload, total, payload_names[kind], &setups[i]);
+                bench_mr(payload, total, payload_names[kind], &setups[i]);
+            }
+        }
+    }
+
+    bench_engines(&payloads[PAYLOAD_RANDOM], total);
+
+    const int result = check_escape(&payloads[PAYLOAD_SPECIALS], total, payload_names[PAYLOAD_SPECIALS]);
+
+    for (int kind = 0; kind < PAYLOAD_COUNT; ++kind) {
+        payload_free(&payloads[kind]);
+    }
+    return result;
+}
+
+/* Fuzzing */
+
+typedef struct {
+    int streams[FUZZ_STREAMS];
+    ByteVec expected[FUZZ_STREAMS + 1];
+    ByteVec decoded[FUZZ_STREAMS + 1];
+    TPBEvent events[FUZZ_MAX_EVENTS];
+    size_t event_count;
+} FuzzCase;
+
+/* The last slot collects the control stream. */
+static ByteVec* fuzz_stream(FuzzCase* this, ByteVec* streams, int order) {
+    if (order == CONTROL_ORDER) return &streams[FUZZ_STREAMS];
+
+    for (size_t i = 0; i < FUZZ_STREAMS; ++i) {
+        if (this->streams[i] == order) return &streams[i];
+    }
+    return NULL;
+}
+
+static void fuzz_case_reset(FuzzCase* this) {
+    for (size_t i = 0; i <= FUZZ_STREAMS; ++i) {
+        this->expected[i].length = 0;
+        this->decoded[i].length = 0;
+    }
+    this->event_count = 0;
+}
+
+static void fuzz_case_free(FuzzCase* this) {
+    for (size_t i = 0; i <= FUZZ_STREAMS; ++i) {
+        bv_free(&this->expected[i]);
+        bv_free(&this->decoded[i]);
+    }
+}
+
+/* Streams below 126 keep a single byte wire order, which is what the legacy
+ * MessageBuffer writes. */
+static void fuzz_pick_streams(FuzzCase* this, Rng* rng, bool small) {
+    for (size_t i = 0; i < FUZZ_STREAMS; ) {
+        const int stream = small ? (int) rng_range(rng, 0, 125)
+            : (int) (rng_next(rng) % 2 ? rng_range(rng, 0, 300) : rng_range(rng, 0, (MAX_CLIENTS << TPB_GENERATION_BITS) - 1));
+
+        bool used = false;
+        for (size_t j = 0; j < i; ++j) {
+            used |= this->streams[j] == stream;
+        }
+        if (!used) {
+            this->streams[i++] = stream;
+        }
+    }
+}
+
+/* Payload bytes lean towards the escaped ones so that runs of them and
+ * escapes split across buffers are common. */
+static void fuzz_fill(Rng* rng, char* data, size_t length) {
+    const int style = rng_next(rng) % 4;
+    if (style == 0) {
+        fill_text(rng, data, length);
+        return;
+    }
+
+    for (size_t i = 0; i < length; ++i) {
+        const uint64_t value = rng_next(rng);
+        if (style == 1 || value % 4 != 0) {
+            data[i] = (char) (value >> 8);
+        } else {
+            data[i] = value % 8 < 4 ? MESSAGE_EDGE : MESSAGE_ESCAPE;
+        }
+    }
+}
+
+typedef struct {
+    int order;
+    char* data;
+    size_t length;
+    uint64_t seq;
+    TPBEvent event;
+} FuzzFrame;
+
+static size_t fuzz_make_frames(FuzzCase* this, Rng* rng, FuzzFrame* frames, ByteVec* storage) {
+    const size_t frame_count = rng_range(rng, 1, FUZZ_MAX_FRAMES);
+
+    size_t total = 0;
+    size_t lengths[FUZZ_MAX_FRAMES];
+    for (size_t i = 0; i < frame_count; ++i) {
+        lengths[i] = rng_next(rng) % 3 == 0 ? rng_range(rng, 1, 8) : rng_range(rng, 1, FUZZ_MAX_FRAME);
+        total += lengths[i];
+    }
+
+    storage->length = 0;
+    char* data = bv_reserve(storage, total);
+    fuzz_fill(rng, data, total);
+    storage->length = total;
+
+    for (size_t i = 0; i < frame_count; ++i) {
+        FuzzFrame* frame = &frames[i];
+        frame->data = data;
+        frame->length = lengths[i];
+        data += lengths[i];
+
+        if (this->event_count < FUZZ_MAX_EVENTS && rng_next(rng) % 8 == 0) {
+            static const char ops[] = {CLIENT_ADD, CLIENT_REMOVE, CLIENT_WINDOW, CLIENT_JOIN};
+            frame->order = CONTROL_ORDER;
+            frame->event.op = ops[rng_next(rng) % sizeof(ops)];
+            frame->event.stream = this->streams[rng_next(rng) % FUZZ_STREAMS];
+            frame->event.operand = frame->event.op == CLIENT_ADD ? 0 : rng_next(rng) >> (rng_next(rng) % 64);
+            this->events[this->event_count++] = frame->event;
+        } else {
+            frame->order = this->streams[rng_next(rng) % FUZZ_STREAMS];
+            ByteVec* stream = fuzz_stream(this, this->expected, frame->order);
+            frame->seq = stream->length;
+            bv_append(stream, frame->data, frame->length);
+        }
+    }
+
+    return frame_count;
+}
+
+static void fuzz_encode_tpb(const FuzzFrame* frames, size_t frame_count, const Setup* setup,
+    size_t tpb_size, uint64_t split_seed, ByteVec* wire) {
+    TPBuffer tpb;
+    setup_tpb(&tpb, setup, tpb_size);
+
+    Rng splits;
+    rng_seed(&splits, split_seed);
+
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_NONBLOCK) == -1) {
+        perror("pipe2");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Events in a row share a batch, as they do in the sender. */
+    TPBControlBatch batch;
+    batch.length = 0;
+
+    wire->length = 0;
+    for (size_t i = 0; i < frame_count; ++i) {
+        const FuzzFrame* frame = &frames[i];
+        if (frame->order == CONTROL_ORDER) {
+            if (batch.length == 0) {
+                tpb_batch_init(&tpb, &batch);
+            }
+            while (!tpb_batch_add(&batch, &frame->event, cb_free_space(&tpb.buffer))) {
+                if (batch.length == 0 && tpb_empty(&tpb)) break;
+
+                tpb_batch_flush(&tpb, &batch);
+                tpb_drain(&tpb, wire, rng_range(&splits, 1, cb_count(&tpb.buffer)));
+                tpb_batch_init(&tpb, &batch);
+            }
+        } else {
+            tpb_batch_flush(&tpb, &batch);
+            if (rng_next(&splits) % 2) {
+                tpb_encode_direct(&tpb, wire, &splits, pipe_fds, frame->data, frame->length, frame->order, frame->seq);
+            } else {
+                tpb_encode(&tpb, wire, &splits, frame->data, frame->length, frame->order, frame->seq);
+            }
+        }
+
+        if (rng_next(&splits) % 4 == 0) {
+            tpb_batch_flush(&tpb, &batch);
+            tpb_drain(&tpb, wire, rng_range(&splits, 0, cb_count(&tpb.buffer)));
+        }
+    }
+    tpb_batch_flush(&tpb, &batch);
+    tpb_drain(&tpb, wire, cb_count(&tpb.buffer));
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    tpb_free(&tpb);
+}
+
+static void fuzz_mb_put(MessageBuffer* mb, ByteVec* wire, const char* data, size_t length, int stream) {
+    const char order = (char) pr_wire_order(stream);
+    for (size_t encoded = 0; ; ) {
+        const ssize_t count = encapsulate(mb, &data[encoded], length - encoded, order);
+        if (count > 0) {
+            encoded += count;
+        }
+        if (count != NO_SPACE && encoded == length) return;
+
+        bv_append(wire, iob_data(&mb->message), mb->message.count);
+        iob_clear(&mb->message);
+    }
+}
+
+static void fuzz_encode_mb(const FuzzCase* this, const FuzzFrame* frames, size_t frame_count,
+    size_t mb_size, ByteVec* wire) {
+    MessageBuffer mb;
+    init_mb(&mb, mb_size);
+
+    wire->length = 0;
+    int last = this->streams[0];
+    for (size_t i = 0; i < frame_count; ++i) {
+        if (frames[i].order == CONTROL_ORDER) continue;
+
+        fuzz_mb_put(&mb, wire, frames[i].data, frames[i].length, frames[i].order);
+        last = frames[i].order;
+    }
+
+    /* The byte after an escape is held back until the next call, an empty
+     * frame on another stream flushes it. */
+    fuzz_mb_put(&mb, wire, NULL, 0, last == this->streams[0] ? this->streams[1] : this->streams[0]);
+    bv_append(wire, iob_data(&mb.message), mb.message.count);
+
+    free_messagebuf(&mb);
+}
+
+/* Feeds the wire in random chunks and decodes with random output sizes,
+ * through decapsulate or mr_decode_ranges. Returns false on an unknown order,
+ * a wrong stream offset or when the decoder stops making progress. */
+static bool fuzz_decode(FuzzCase* this, const Setup* setup, const ByteVec* wire, Rng* rng) {
+    MessageReceiver mr;
+    setup_mr(&mr, setup);
+
+    const bool ranges = rng_next(rng) % 2;
+    char output[FUZZ_MAX_FRAME];
+    MRRange range_list[8];
+
+    bool ok = true;
+    for (size_t fed = 0; ok; ) {
+        const size_t put = mr_puts(&mr, &wire->data[fed], rng_range(rng, 0, wire->length - fed));
+        fed += put;
+
+        size_t produced = 0;
+        for (int order; ok && (order = get_current_order(&mr)) != MR_NO_ORDER; ) {
+            const size_t want = rng_range(rng, 1, sizeof(output));
+            if (ranges) {
+                const size_t range_count = mr_decode_ranges(&mr, output, want, range_list, 8);
+                if (range_count == 0) break;
+
+                for (size_t i = 0; ok && i < range_count; ++i) {
+                    ByteVec* stream = fuzz_stream(this, this->decoded, range_list[i].order);
+                    ok = stream != NULL;
+                    if (ok) {
+                        bv_append(stream, &output[range_list[i].offset], range_list[i].length);
+                    }
+                    produced += range_list[i].length + 1;
+                }
+                continue;
+            }
+
+            /* A sequenced frame names the stream offset it continues at. */
+            ByteVec* stream = fuzz_stream(this, this->decoded, order);
+            if (stream == NULL || ((get_current_flags(&mr) & PR_FLAG_SEQUENCED)
+                    && (!setup->sequenced || get_current_seq(&mr) != stream->length))) {
+                ok = false;
+                break;
+            }
+
+            const ssize_t count = decapsulate(&mr, bv_reserve(stream, want), want);
+            stream->length += count;
+            produced += count;
+            if (count == 0 && mr_empty(&mr)) break;
+            produced++;
+        }
+
+        if (fed == wire->length && (mr_empty(&mr) || (put == 0 && produced == 0))) break;
+        if (put == 0 && produced == 0 && mr_full(&mr)) {
+            ok = false;
+        }
+    }
+
+    ok = ok && mr_empty(&mr);
+    free_messagerecv(&mr);
+    return ok;
+}
+
+static bool fuzz_check_events(const FuzzCase* this, const ByteVec* control) {
+    size_t offset = 0;
+    for (size_t i = 0; i < this->event_count; ++i) {
+        TPBEvent parsed;
+        const size_t length = tpb_parse_event(&control->data[offset], control->length - offset, &parsed);
+        if (length == 0) return false;
+
+        for (size_t prefix = 1; prefix < length; ++prefix) {
+            TPBEvent partial;
+            if (tpb_parse_event(&control->data[offset], prefix, &partial) != 0) return false;
+        }
+
+        const TPBEvent* event = &this->events[i];
+        if (parsed.op != event->op || parsed.stream != event->stream || parsed.operand != event->operand) return false;
+        offset += length;
+    }
+    return offset == control->length;
+}
+
+static bool fuzz_compare(FuzzCase* this, bool events) {
+    for (size_t i = 0; i < FUZZ_STREAMS; ++i) {
+        if (this->expected[i].length != this->decoded[i].length
+            || memcmp(this->expected[i].data, this->decoded[i].data, this->expected[i].length) != 0) {
+            return false;
+        }
+    }
+    return !events || fuzz_check_events(this, &this->decoded[FUZZ_STREAMS]);
+}
+
+static void fuzz_clear_decoded(FuzzCase* this) {
+    for (size_t i = 0; i <= FUZZ_STREAMS; ++i) {
+        this->decoded[i].length = 0;
+    }
+}
+
+static bool fuzz_escape(Rng* rng, const char* data, size_t length) {
+    char fast[2 * FUZZ_MAX_FRAME];
+    char scalar[2 * FUZZ_MAX_FRAME];
+
+    if (message_length(data, length) != message_length_scalar(data, length)) return false;
+
+    const size_t space = rng_range(rng, 0, sizeof(fast) - 1);
+    size_t fast_written;
+    size_t scalar_written;
+    const size_t fast_count = pr_encapsulate(data, length, fast, space, &fast_written);
+    const size_t scalar_count = pr_encapsulate_scalar(data, length, scalar, space, &scalar_written);
+
+    if (fast_count != scalar_count || fast_written != scalar_written || memcmp(fast, scalar, fast_written) != 0) {
+        return false;
+    }
+
+    /* Decode the escaped bytes back, from a random state, with an edge after
+     * them and into a random amount of space. */
+    fast[fast_written++] = MESSAGE_EDGE;
+    const size_t data_space = rng_range(rng, 0, length + 1);
+    bool fast_escape = rng_next(rng) % 8 == 0;
+    bool scalar_escape = fast_escape;
+    bool fast_edge;
+    bool scalar_edge;
+    size_t fast_decoded;
+    size_t scalar_decoded;
+    const size_t fast_consumed = pr_decapsulate(fast, fast_written, scalar, data_space,
+        &fast_decoded, &fast_escape, &fast_edge);
+    char decoded[FUZZ_MAX_FRAME + 1];
+    const size_t scalar_consumed = pr_decapsulate_scalar(fast, fast_written, decoded, data_space,
+        &scalar_decoded, &scalar_escape, &scalar_edge);
+
+    return fast_consumed == scalar_consumed && fast_decoded == scalar_decoded
+        && fast_escape == scalar_escape && fast_edge == scalar_edge
+        && memcmp(scalar, decoded, fast_decoded) == 0;
+}
+
+/* Garbage must neither crash the decoders nor make them overrun. */
+static void fuzz_garbage(Rng* rng, const char* data, size_t length) {
+    char output[PR_COMPRESS_LIMIT];
+    bench_sink += lz_decompress(data, length, output, rng_range(rng, 0, sizeof(output)));
+
+    for (size_t i = 0; i < SETUP_COUNT; ++i) {
+        MessageReceiver mr;
+        setup_mr(&mr, &setups[i]);
+        for (size_t fed = 0; fed < length; ) {
+            fed += mr_puts(&mr, &data[fed], rng_range(rng, 1, length - fed));
+            while (get_current_order(&mr) != MR_NO_ORDER) {
+                const ssize_t count = decapsulate(&mr, output, sizeof(output));
+                if (count == 0) break;
+            }
+            if (mr_full(&mr)) break;
+        }
+        free_messagerecv(&mr);
+    }
+}
+
+static int fuzz_fail(const char* what, size_t iteration, uint64_t seed) {
+    fprintf(stderr, "fuzz: %s failed in iteration %zu (seed %llu, impl %s)\n",
+        what, iteration, (unsigned long long) seed, pr_impl_name(pr_current_impl()));
+    return EXIT_FAILURE;
+}
+
+static int run_fuzz(size_t iterations, uint64_t seed) {
+    static const size_t tpb_sizes[] = {4096, 8192, MESSAGE_SIZE, FEED_SIZE};
+
+    FuzzCase fuzz_case = {0};
+    FuzzFrame frames[FUZZ_MAX_FRAMES];
+    ByteVec storage = {0};
+    ByteVec wire = {0};
+    ByteVec reference = {0};
+
+    int impls[PR_IMPL_COUNT];
+    size_t impl_count = 0;
+    for (int impl = PR_IMPL_SCALAR; impl < PR_IMPL_COUNT; ++impl) {
+        if (pr_select_impl(impl)) {
+            impls[impl_count++] = impl;
+        }
+    }
+
+    Rng rng;
+    rng_seed(&rng, seed);
+
+    int result = EXIT_SUCCESS;
+    for (size_t iteration = 0; iteration < iterations && result == EXIT_SUCCESS; ++iteration) {
+        fuzz_case_reset(&fuzz_case);
+        const bool small = rng_next(&rng) % 4 == 0;
+        fuzz_pick_streams(&fuzz_case, &rng, small);
+        const size_t frame_count = fuzz_make_frames(&fuzz_case, &rng, frames, &storage);
+
+        for (size_t s = 0; s < SETUP_COUNT && result == EXIT_SUCCESS; ++s) {
+            const size_t tpb_size = tpb_sizes[rng_next(&rng) % (sizeof(tpb_sizes) / sizeof(*tpb_sizes))];
+            const uint64_t split_seed = rng_next(&rng);
+
+            /* Every scan implementation has to put the same bytes on the wire. */
+            for (size_t i = 0; i < impl_count && result == EXIT_SUCCESS; ++i) {
+                pr_select_impl(impls[i]);
+                fuzz_encode_tpb(frames, frame_count, &setups[s], tpb_size, split_seed, &wire);
+
+                if (i == 0) {
+                    reference.length = 0;
+                    bv_append(&reference, wire.data, wire.length);
+                } else if (wire.length != reference.length || memcmp(wire.data, reference.data, wire.length) != 0) {
+                    result = fuzz_fail(setups[s].name, iteration, seed);
+                    break;
+                }
+
+                fuzz_clear_decoded(&fuzz_case);
+                if (!fuzz_decode(&fuzz_case, &setups[s], &wire, &rng) || !fuzz_compare(&fuzz_case, true)) {
+                    result = fuzz_fail(setups[s].name, iteration, seed);
+                }
+            }
+        }
+
+        for (size_t i = 0; i < impl_count && result == EXIT_SUCCESS; ++i) {
+            pr_select_impl(impls[i]);
+            for (size_t f = 0; f < frame_count; ++f) {
+                if (!fuzz_escape(&rng, frames[f].data, frames[f].length)) {
+                    result = fuzz_fail("pr_encapsulate", iteration, seed);
+                    break;
+                }
+            }
+
+            if (small && result == EXIT_SUCCESS) {
+                fuzz_encode_mb(&fuzz_case, frames, frame_count, rng_range(&rng, 8, FEED_SIZE), &wire);
+                fuzz_clear_decoded(&fuzz_case);
+                if (!fuzz_decode(&fuzz_case, &setups[0], &wire, &rng) || !fuzz_compare(&fuzz_case, false)) {
+                    result = fuzz_fail("message_buffer", iteration, seed);
+                }
+            }
+
+            if (result == EXIT_SUCCESS) {
+                fuzz_garbage(&rng, storage.data, min_size_t(storage.length, FUZZ_MAX_FRAME));
+            }
+        }
+    }
+
+    if (result == EXIT_SUCCESS) {
+        printf("fuzz: %zu iterations with seed %llu passed\n", iterations, (unsigned long long) seed);
+    }
+
+    fuzz_case_free(&fuzz_case);
+    bv_free(&storage);
+    bv_free(&wire);
+    bv_free(&reference);
+    return result;
+}
+
+static int parse_count(const char* arg, size_t fallback, size_t* count) {
+    *count = fallback;
+    if (arg == NULL) return EXIT_SUCCESS;
+
+    char* end;
+    const unsigned long long value = strtoull(arg, &end, 10);
+    if (*end != '\0' || value == 0) {
+        fprintf(stderr, "Expected a positive integer, got %s\n", arg);
+        return EXIT_FAILURE;
+    }
+
+    *count = value;
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "bench") == 0) {
+        size_t megabytes;
+        if (parse_count(argc == 3 ? argv[2] : NULL, BENCH_DEFAULT_MEGABYTES, &megabytes) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+        return run_bench(megabytes);
+    }
+
+    if (argc >= 2 && argc <= 4 && strcmp(argv[1], "fuzz") == 0) {
+        size_t iterations;
+        size_t seed;
+        if (parse_count(argc >= 3 ? argv[2] : NULL, FUZZ_DEFAULT_ITERATIONS, &iterations) == EXIT_FAILURE
+            || parse_count(argc == 4 ? argv[3] : NULL, time(NULL), &seed) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+        return run_fuzz(iterations, seed);
+    }
+
+    fprintf(stderr, "Usage: %s bench [MEGABYTES] | fuzz [ITERATIONS] [SEED]\n", argv[0]);
+    return EXIT_FAILURE;
+}
@@ -15,78 +15,634 @@
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <time.h>
+#include <sys/random.h>
 
 #include "iobuffer.h"
 #include "cyclic_buffer.h"
+#include "message_receiver.h"
 #include "socket_utils.h"
 #include "server_management.h"
 #include "transport_protocol_buffer.h"
+#include "handshake.h"
+#include "utils.h"
+#include "scheduler.h"
+#include "id_queue.h"
+#include "stats.h"
+#include "io_ring.h"
+#include "shm_link.h"
 
 #define BUFFER_SIZE 1024
 #define MESSAGE_SIZE (2 * BUFFER_SIZE + 3)
+#define COMPRESSED_MESSAGE_SIZE (PR_COMPRESS_LIMIT + TPB_HEADER_LENGTH)
 
+#define SCHED_QUANTUM BUFFER_SIZE
+#define INTERACTIVE_PRIORITY 0
+#define BULK_PRIORITY 1
+#define BULK_THRESHOLD (4 * BUFFER_SIZE)
+
+#define STREAM_WINDOW (64 * BUFFER_SIZE)
+#define WINDOW_UPDATE_THRESHOLD (STREAM_WINDOW / 4)
+#define UNLIMITED_CREDIT ((size_t) -1)
+
+#define MAX_CONNECTIONS SERVER_MAX_TUNNELS
+
+/* While data is waiting, control batches get a quarter of the free tunnel
+ * buffer per pass, but never less than room for a few events. */
+#define CONTROL_SHARE_DIVISOR 4
+#define CONTROL_MIN_BUDGET 64
+
+/* Events parsed off the control reader per pass. */
+#define CONTROL_PARSE_EVENTS 64
+
+#define RING_RECV 0
+#define RING_SEND 1
+
+/* Most a single pass moves through the shared memory link each way. */
+#define SHM_PASS_LIMIT SL_RING_SIZE
+
+#define GATHER_LIMIT (64 * BUFFER_SIZE)
+#define GATHER_MAX_STREAMS (CB_BATCH_MAX_IOV / (1 + CB_MAX_SEGMENTS))
+
+/* Per client state, indexed by the Server id. The id is the slot of the
+ * stream on the wire and generation tells its users apart. */
+typedef struct {
+    unsigned generation;
+    int table_index;
+    size_t burst;
+    bool in_batch;
+
+    /* Data may only follow the CLIENT_ADD of the stream. */
+    bool announced;
+    bool remove_flag;
+    bool peer_closed;
+
+    /* The tunnel connection the stream's frames go to and the stream offset
+     * of the next byte framed. A stream starts on the connection its id
+     * hashes to and may only leave it once the peer has granted credit for
+     * it, which proves that the CLIENT_ADD arrived. */
+    size_t tunnel;
+    uint64_t seq;
+    bool confirmed;
+
+    size_t send_credit;
+    size_t window_pending;
+    bool window_queued;
+
+    CyclicBuffer tunnel_buffer;
+    CyclicBuffer client_buffer;
+} TSClient;
+
+/* One connection of the tunnel with its own frame buffers, control queues
+ * and scheduler. A stream is served by the scheduler of its connection. */
+typedef struct {
+    Scheduler scheduler;
+
+    IdQueue add_queue;
+    IdQueue remove_queue;
+    IdQueue window_queue;
+
+    TPBuffer tpb;
+
+    MessageReceiver mr;
+    TPBEventReader control;
+} TSTunnel;
+
+/* All tunnel connections are driven by the one loop that serves the clients,
+ * a stream moving between them needs no locking that way. */
 typedef struct {
     Server server;
-    int send_order;
-    size_t send_count;
 
-    int id_table[MAX_CLIENTS];
-    bool remove_flag[MAX_CLIENTS];
+    TSClient* clients;
+    size_t capacity;
+    int* id_table;
     size_t client_count;
+    CBPool pool;
+
+    bool flow_control;
+
+    TSTunnel tunnels[SERVER_MAX_TUNNELS];
+    size_t tunnel_count;
+
+    bool tunnel_lost;
+
+    bool use_ring;
+    IoRing ring;
 
-    CyclicBuffer add_queue;
+    bool use_shm;
+    ShmLink shm;
 
-    CyclicBuffer tunnel_buffers[MAX_CLIENTS];
-    TPBuffer tunnel_tpb;
-    CyclicBuffer client_buffers[MAX_CLIENTS];
+    TunnelStats stats;
+    StatsTable stream_stats;
 } TunnelServer;
 
-static TunnelServer tunnel_server;
+static TunnelServer* tunnel_server;
+static int stats_fd = -1;
 
+void ts_cleanup(TunnelServer* this) {
+    cleanup_server(&this->server);
+    if (this->use_ring) {
+        ir_free(&this->ring);
+    }
+
+    for (size_t i = 0; i < this->client_count; ++i) {
+        cb_free(&this->clients[this->id_table[i]].client_buffer);
+        cb_free(&this->clients[this->id_table[i]].tunnel_buffer);
+    }
+    free(this->clients);
+    free(this->id_table);
+    cbp_free(&this->pool);
+
+    for (size_t i = 0; i < this->tunnel_count; ++i) {
+        TSTunnel* tunnel = &this->tunnels[i];
+        sched_free(&tunnel->scheduler);
+        tpb_free(&tunnel->tpb);
+        free_messagerecv(&tunnel->mr);
+        iq_free(&tunnel->add_queue);
+        iq_free(&tunnel->remove_queue);
+        iq_free(&tunnel->window_queue);
+    }
+
+    if (this->use_shm) {
+        sl_free(&this->shm);
+    }
+}
+
+uint32_t ts_session_id(void) {
+    uint32_t session;
+    if (getrandom(&session, sizeof(session), 0) != sizeof(session)) {
+        session = getpid() ^ time(NULL);
+    }
+    return session;
+}
+
+/* Every connection is negotiated on its own and has to agree with the first
+ * one. The connections of a striped tunnel then join the same session, which
+ * is how the peer groups them. */
+int ts_handshake(TunnelServer* this, PRFormat* format, int* features) {
+    const size_t count = server_tunnel_count(&this->server);
+
+    int offered = HS_SUPPORTED_FEATURES & ~(count > 1 ? HS_FEATURE_SHARED_MEMORY : HS_FEATURE_STRIPING);
+    if (!is_local_socket(tunnel_fd(&this->server, 0))) {
+        offered &= ~HS_FEATURE_SHARED_MEMORY;
+    }
+
+    HSJoin join = {.session = ts_session_id(), .tunnel_count = count};
+    for (size_t i = 0; i < count; ++i) {
+        int agreed = offered;
+        const PRFormat chosen = hs_offer(tunnel_fd(&this->server, i), HS_SUPPORTED_FORMATS, &agreed, HANDSHAKE_TIMEOUT);
+        if (i == 0) {
+            *format = chosen;
+            *features = agreed;
+        } else if (chosen != *format || agreed != *features) {
+            fprintf(stderr, "Tunnel connections negotiated differently\n");
+            return EXIT_FAILURE;
+        }
+
+        if (count == 1) break;
+        if (chosen != PR_FORMAT_LENGTH || !(agreed & HS_FEATURE_STRIPING)) {
+            fprintf(stderr, "Tunnel peer does not support several connections\n");
+            return EXIT_FAILURE;
+        }
+
+        join.tunnel = i;
+        if (!hs_join(tunnel_fd(&this->server, i), &join)) return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void ts_init_tunnel(TSTunnel* this, int policy, PRFormat format, bool compression, bool sequenced) {
+    sched_init(&this->scheduler, policy, SCHED_QUANTUM);
+
+    iq_init(&this->add_queue);
+    iq_init(&this->remove_queue);
+    iq_init(&this->window_queue);
+
+    tpb_init(&this->tpb, compression ? PR_COMPRESS_LIMIT : MESSAGE_SIZE);
+    init_mr(&this->mr, compression ? COMPRESSED_MESSAGE_SIZE : MESSAGE_SIZE);
+    tpb_reader_init(&this->control);
+    tpb_set_format(&this->tpb, format);
+    mr_set_format(&this->mr, format);
+    if (compression) {
+        tpb_enable_compression(&this->tpb);
+        mr_enable_compression(&this->mr);
+    }
+    if (sequenced) {
+        tpb_enable_sequencing(&this->tpb);
+    }
+}
+
+/* The stream stats outlive ts_cleanup, the stats thread may still read
+ * them. run_sender frees them. */
 int init_tserver(TunnelServer* this, const TunnelParams* params) {
     memset(this, 0, sizeof(*this));
 
-    if (init_server(&this->server, params) == EXIT_FAILURE) return EXIT_FAILURE;
+    if (!stats_table_init(&this->stream_stats, MAX_CLIENTS)) return EXIT_FAILURE;
+
+    if (init_server(&this->server, params) == EXIT_FAILURE) {
+        stats_table_free(&this->stream_stats);
+        return EXIT_FAILURE;
+    }
+
+    cbp_init(&this->pool);
+
+    if (params->io_uring) {
+        this->use_ring = ir_init(&this->ring);
+        if (this->use_ring && !ir_set_eventfd(&this->ring, server_wakeup_fd(&this->server))) {
+            ir_free(&this->ring);
+            this->use_ring = false;
+        }
+        if (!this->use_ring) {
+            fprintf(stderr, "io_uring is not available, falling back to poll\n");
+        }
+    }
+
+    PRFormat format;
+    int features;
+    if (ts_handshake(this, &format, &features) == EXIT_FAILURE) {
+        ts_cleanup(this);
+        stats_table_free(&this->stream_stats);
+        return EXIT_FAILURE;
+    }
+    this->flow_control = features & HS_FEATURE_FLOW_CONTROL;
+
+    if (features & HS_FEATURE_SHARED_MEMORY) {
+        this->use_shm = sl_create(&this->shm, tunnel_fd(&this->server, 0), HANDSHAKE_TIMEOUT);
+        if (!this->use_shm) {
+            fprintf(stderr, "Shared memory link is not available, staying on the socket\n");
+        }
+    }
+    const bool compression = format == PR_FORMAT_LENGTH && (features & HS_FEATURE_COMPRESSION);
+    const bool striped = features & HS_FEATURE_STRIPING;
 
-    tpb_init(&this->tunnel_tpb, MESSAGE_SIZE);
-    cb_init(&this->add_queue, MAX_CLIENTS);
+    this->tunnel_count = server_tunnel_count(&this->server);
+    for (size_t i = 0; i < this->tunnel_count; ++i) {
+        ts_init_tunnel(&this->tunnels[i], params->policy, format, compression, striped);
+    }
+
+    for (size_t i = 0; i < this->tunnel_count; ++i) {
+        if (set_nonblocking(tunnel_fd(&this->server, i)) == EXIT_FAILURE) {
+            ts_cleanup(this);
+            stats_table_free(&this->stream_stats);
+            return EXIT_FAILURE;
+        }
+    }
 
     return EXIT_SUCCESS;
 }
 
-void ts_remove_client(TunnelServer* this, int i) {
-    const int id = this->id_table[i];
+TSTunnel* ts_tunnel(TunnelServer* this, int id) {
+    return &this->tunnels[this->clients[id].tunnel];
+}
+
+/* A buffer stays pinned while a ring request on it is in flight. */
+bool ts_ring_pending(const TunnelServer* this, int id) {
+    return cb_pinned(&this->clients[id].client_buffer) || cb_pinned(&this->clients[id].tunnel_buffer);
+}
+
+void ts_remove_client(TunnelServer* this, int id) {
+    /* The ring holds on to the socket, a shutdown ends its requests. */
+    if (ts_ring_pending(this, id) && client_fd(&this->server, id) != REMOVED_CLIENT) {
+        shutdown(client_fd(&this->server, id), SHUT_RDWR);
+    }
     disconnect_client(&this->server, id);
-    this->remove_flag[id] = true;
+    if (this->clients[id].remove_flag) return;
+
+    this->clients[id].remove_flag = iq_push(&ts_tunnel(this, id)->remove_queue, id);
+}
+
+/* Follows the Server tables, which only grow. */
+int ts_reserve(TunnelServer* this, size_t capacity) {
+    if (capacity <= this->capacity) return EXIT_SUCCESS;
+
+    TSClient* clients = realloc(this->clients, capacity * sizeof(*clients));
+    if (clients == NULL) {
+        perror("realloc");
+        return EXIT_FAILURE;
+    }
+    memset(&clients[this->capacity], 0, (capacity - this->capacity) * sizeof(*clients));
+    for (size_t id = this->capacity; id < capacity; ++id) {
+        clients[id].table_index = NO_ID;
+    }
+    this->clients = clients;
+
+    int* id_table = realloc(this->id_table, capacity * sizeof(*id_table));
+    if (id_table == NULL) {
+        perror("realloc");
+        return EXIT_FAILURE;
+    }
+    this->id_table = id_table;
+
+    for (size_t i = 0; i < this->tunnel_count; ++i) {
+        if (!sched_reserve(&this->tunnels[i].scheduler, capacity)) return EXIT_FAILURE;
+    }
+    if (!stats_table_reserve(&this->stream_stats, capacity)) return EXIT_FAILURE;
+
+    this->capacity = capacity;
+    return EXIT_SUCCESS;
 }
 
-int ts_add_client(TunnelServer* this, int fd) {    
+int ts_stream(const TunnelServer* this, int id) {
+    return TPB_STREAM_ID(id, this->clients[id].generation);
+}
+
+StreamStats* ts_stats(TunnelServer* this, int id) {
+    return stats_stream(&this->stream_stats, id);
+}
+
+int ts_add_client(TunnelServer* this, int fd) {
     const int id = add_client(&this->server, fd);
-    if (id == NO_ID) return EXIT_FAILURE;
+    if (id == NO_ID) {
+        close(fd);
+        return EXIT_FAILURE;
+    }
 
-    cb_init(&this->client_buffers[id], BUFFER_SIZE);
-    cb_init(&this->tunnel_buffers[id], BUFFER_SIZE);
+    if (ts_reserve(this, server_capacity(&this->server)) == EXIT_FAILURE) {
+        remove_client(&this->server, id);
+        return EXIT_FAILURE;
+    }
 
-    cb_putc(&this->add_queue, (char) id);
+    const int stream = TPB_STREAM_ID(id, this->clients[id].generation + 1);
+    const size_t tunnel = tpb_stream_tunnel(stream, this->tunnel_count);
+    if (!iq_push(&this->tunnels[tunnel].add_queue, stream)) {
+        remove_client(&this->server, id);
+        return EXIT_FAILURE;
+    }
 
+    cb_init_pooled(&this->clients[id].client_buffer, &this->pool, BUFFER_SIZE);
+    cb_init_pooled(&this->clients[id].tunnel_buffer, &this->pool, this->flow_control ? STREAM_WINDOW : BUFFER_SIZE);
+
+    this->clients[id].announced = false;
+    this->clients[id].remove_flag = false;
+    this->clients[id].peer_closed = false;
+    this->clients[id].send_credit = this->flow_control ? STREAM_WINDOW : UNLIMITED_CREDIT;
+    this->clients[id].window_pending = 0;
+    this->clients[id].burst = 0;
+    this->clients[id].tunnel = tunnel;
+    this->clients[id].seq = 0;
+    this->clients[id].confirmed = false;
+    this->clients[id].generation++;
+    for (size_t i = 0; i < this->tunnel_count; ++i) {
+        sched_reset_stream(&this->tunnels[i].scheduler, id);
+    }
+
+    this->clients[id].table_index = this->client_count;
     this->id_table[this->client_count++] = id;
+
+    stats_open_stream(ts_stats(this, id), ts_stream(this, id));
+    stats_add(&this->stats.opened, 1);
     return EXIT_SUCCESS;
 }
 
+/* Bytes of the stream that may go to the tunnel right now. */
+size_t ts_sendable(const TunnelServer* this, int id) {
+    if (!this->clients[id].announced) return 0;
+    return min_size_t(cb_count(&this->clients[id].client_buffer), this->clients[id].send_credit);
+}
+
+void ts_consume_credit(TunnelServer* this, int id, size_t sent) {
+    if (this->flow_control) {
+        this->clients[id].send_credit -= sent;
+    }
+}
+
+void ts_account_pick(TunnelServer* this, int id) {
+    stats_add(&ts_stats(this, id)->picks, 1);
+    stats_add(&this->stats.picks, 1);
+}
+
+void ts_account_frame(TunnelServer* this, int id, size_t payload, size_t wire) {
+    if (payload == 0) return;
+
+    StreamStats* stats = ts_stats(this, id);
+
+    stats_add(&stats->frames, 1);
+    stats_add(&stats->wire_bytes, wire);
+    stats_add(&this->stats.frames, 1);
+    stats_add(&this->stats.payload_bytes, payload);
+    stats_add(&this->stats.wire_bytes, wire);
+}
+
+void ts_update_readable(TunnelServer* this, int id) {
+    const CyclicBuffer* buffer = &this->clients[id].client_buffer;
+    StreamStats* stats = ts_stats(this, id);
+    stats_set(&stats->client_buffered, cb_count(buffer));
+    stats_note_full(&stats->read_full_ns, &stats->read_full_since, cb_full(buffer));
+
+    set_client_readable(&this->server, id, !cb_full(buffer) && cb_count(buffer) < this->clients[id].send_credit);
+}
+
+void ts_update_writeable(TunnelServer* this, int id) {
+    const CyclicBuffer* buffer = &this->clients[id].tunnel_buffer;
+    StreamStats* stats = ts_stats(this, id);
+    stats_set(&stats->tunnel_buffered, cb_count(buffer));
+    stats_note_full(&stats->write_full_ns, &stats->write_full_since, cb_full(buffer));
+
+    const bool empty = cb_empty(buffer);
+    set_client_writeable(&this->server, id, !empty);
+
+    if (empty && this->clients[id].peer_closed && !this->clients[id].remove_flag) {
+        ts_remove_client(this, id);
+    }
+}
+
+/* Hands the bytes delivered to the client back to the peer as credit, in
+ * batches so that a slowly draining client does not flood the tunnel. */
+void ts_return_window(TunnelServer* this, int id, size_t delivered) {
+    if (!this->flow_control) return;
+
+    this->clients[id].window_pending += delivered;
+    if (this->clients[id].window_queued) return;
+
+    if (this->clients[id].window_pending >= WINDOW_UPDATE_THRESHOLD || cb_empty(&this->clients[id].tunnel_buffer)) {
+        this->clients[id].window_queued = iq_push(&ts_tunnel(this, id)->window_queue, id);
+    }
+}
+
+int ts_priority(const TunnelServer* this, int id) {
+    return this->clients[id].burst > BULK_THRESHOLD ? BULK_PRIORITY : INTERACTIVE_PRIORITY;
+}
+
+/* Moves a stream the peer already knows off a connection that is backed up,
+ * its frames still queued, onto the idle connection with the fewest streams
+ * waiting. The sequence numbers let the peer put the bytes back in order. */
+bool ts_rebalance(TunnelServer* this, int id) {
+    TSClient* client = &this->clients[id];
+    if (!client->confirmed || tpb_empty(&this->tunnels[client->tunnel].tpb)) return false;
+
+    size_t target = client->tunnel;
+    for (size_t i = 0; i < this->tunnel_count; ++i) {
+        if (!tpb_empty(&this->tunnels[i].tpb)) continue;
+
+        if (target == client->tunnel || sched_active_count(&this->tunnels[i].scheduler)
+            < sched_active_count(&this->tunnels[target].scheduler)) {
+            target = i;
+        }
+    }
+    if (target == client->tunnel) return false;
+
+    Scheduler* from = &this->tunnels[client->tunnel].scheduler;
+    Scheduler* to = &this->tunnels[target].scheduler;
+    const bool active = sched_active(from, id);
+
+    sched_deactivate(from, id);
+    client->tunnel = target;
+    sched_set_priority(to, id, ts_priority(this, id));
+    if (active) {
+        sched_activate(to, id);
+    }
+    return true;
+}
+
+void ts_activate(TunnelServer* this, int id) {
+    ts_rebalance(this, id);
+    sched_activate(&ts_tunnel(this, id)->scheduler, id);
+}
+
 void interrupt(int unused) {
     write(STDERR_FILENO, "\nInterrupted. Exiting...\n", sizeof("Interrupted. Exiting...\n"));
-    safe_cleanup(&tunnel_server.server);
+    if (tunnel_server != NULL) {
+        safe_cleanup(&tunnel_server->server);
+    }
     _exit(EXIT_SUCCESS);
 }
 
+/* Returns false once the client is gone. */
+bool ts_received(TunnelServer* this, int id, ssize_t count) {
+    if (count == -1) {
+        ts_remove_client(this, id);
+        return false;
+    }
+
+    stats_add(&ts_stats(this, id)->bytes_in, count);
+    ts_update_readable(this, id);
+    if (ts_sendable(this, id) > 0) {
+        ts_activate(this, id);
+    }
+    return true;
+}
+
+bool ts_sent(TunnelServer* this, int id, ssize_t sent) {
+    if (sent == -1) {
+        ts_remove_client(this, id);
+        return false;
+    }
+
+    stats_add(&ts_stats(this, id)->bytes_out, sent);
+    ts_return_window(this, id, sent);
+    ts_update_writeable(this, id);
+    return true;
+}
+
+/* A client with nothing staged is read straight into the tunnel buffer while
+ * that has room for a quantum, so the bytes skip client_buffer. The quantum
+ * keeps such reads from starving the streams the scheduler serves. */
+bool ts_can_read_direct(TunnelServer* this, int id) {
+    return this->clients[id].announced && this->clients[id].send_credit > 0
+        && cb_empty(&this->clients[id].client_buffer)
+        && tpb_direct_space(&ts_tunnel(this, id)->tpb, ts_stream(this, id)) >= SCHED_QUANTUM;
+}
+
+ssize_t ts_recv_direct(TunnelServer* this, int id) {
+    TPBuffer* tpb = &ts_tunnel(this, id)->tpb;
+    const size_t limit = min_size_t(SCHED_QUANTUM, this->clients[id].send_credit);
+
+    const size_t buffered = cb_count(&tpb->buffer);
+    const ssize_t count = tpb_recv_frame(tpb, client_fd(&this->server, id), ts_stream(this, id),
+        this->clients[id].seq, limit);
+    if (count > 0) {
+        this->clients[id].seq += count;
+        ts_consume_credit(this, id, count);
+        ts_account_frame(this, id, count, cb_count(&tpb->buffer) - buffered);
+    }
+    return count;
+}
+
 void perform_client_io(TunnelServer* this, size_t ioable_count) {
     Server* server = &this->server;
 
-    size_t ioable_processed = 0;
-    if (tunnel_ioable(server)) {
-        ioable_processed++;
+    size_t ioable_processed = tunnels_ioable(server);
+
+    for (size_t i = 0; ioable_processed < ioable_count && i < this->client_count; ++i) {
+        const int id = this->id_table[i];
+
+        if (client_ioable(server, id)) {
+            ++ioable_processed;
+        }
+
+        if (client_has_errors(server, id)) {
+            ts_remove_client(this, id);
+            continue;
+        }
+
+        if (!cb_full(&this->clients[id].client_buffer) && client_readable(server, id)) {
+            const ssize_t count = ts_can_read_direct(this, id)
+                ? ts_recv_direct(this, id)
+                : cb_recv(&this->clients[id].client_buffer, client_fd(server, id));
+            if (!ts_received(this, id, count)) continue;
+        }
+
+        if (!cb_empty(&this->clients[id].tunnel_buffer) && client_writeable(server, id)) {
+            ts_sent(this, id, cb_send(&this->clients[id].tunnel_buffer, client_fd(server, id)));
+        }
+    }
+}
+
+/* Maps a ring completion to what cb_recv and cb_send would have returned. */
+ssize_t ring_result(CyclicBuffer* buffer, int result, bool recv) {
+    if (recv && result <= 0) {
+        cb_release(buffer);
+    }
+    if (result == -EAGAIN || result == -EWOULDBLOCK) return 0;
+    if (result < 0) {
+        fprintf(stderr, "%s: %s\n", recv ? "read" : "write", strerror(-result));
+        return -1;
+    }
+    if (recv && result == 0) return -1;
+
+    if (recv) {
+        cb_skip_right(buffer, result);
+    } else {
+        cb_skip(buffer, result);
+    }
+    return result;
+}
+
+void ts_reap_ring(TunnelServer* this) {
+    if (ir_submit_wait(&this->ring) == -1) {
+        this->tunnel_lost = true;
+    }
+
+    uint64_t tag;
+    int result;
+    while (ir_reap(&this->ring, &tag, &result)) {
+        const int id = tag >> 1;
+        const bool recv = (tag & 1) == RING_RECV;
+        CyclicBuffer* buffer = recv ? &this->clients[id].client_buffer : &this->clients[id].tunnel_buffer;
+        cb_pin(buffer, false);
+
+        /* A failed read already dropped the client, its write has to go. */
+        if (client_fd(&this->server, id) == REMOVED_CLIENT) continue;
+
+        if (recv) {
+            ts_received(this, id, ring_result(buffer, result, true));
+        } else {
+            ts_sent(this, id, ring_result(buffer, result, false));
+        }
     }
+}
+
+/* The io_uring engine does the same work as perform_client_io, but the reads
+ * and writes of all ready clients reach the kernel in one io_uring_enter.
+ * A client gets no new request in a direction until the last one completed,
+ * and a full ring falls back to the plain calls. */
+void perform_client_io_ring(TunnelServer* this, size_t ioable_count) {
+    Server* server = &this->server;
+    IoRing* ring = &this->ring;
+
+    size_t ioable_processed = tunnels_ioable(server);
 
     for (size_t i = 0; ioable_processed < ioable_count && i < this->client_count; ++i) {
         const int id = this->id_table[i];
@@ -96,225 +652,654 @@ void perform_client_io(TunnelServer* this, size_t ioable_count) {
         }
 
         if (client_has_errors(server, id)) {
-            ts_remove_client(this, i);
+            ts_remove_client(this, id);
             continue;
         }
 
-        if (!cb_full(&this->client_buffers[id]) && client_readable(server, id)) {
-            const ssize_t count = cb_recv(&this->client_buffers[id], client_fd(server, id));
-            if (count == -1) {
-                ts_remove_client(this, i);
+        /* Room for both requests of the client. */
+        if (ir_space(ring) < 2) {
+            ts_reap_ring(this);
+        }
+
+        struct iovec iov[CB_MAX_SEGMENTS];
+        CyclicBuffer* client_buffer = &this->clients[id].client_buffer;
+
+        if (!cb_pinned(client_buffer) && !cb_full(client_buffer)
+            && client_readable(server, id) && cb_reserve(client_buffer)) {
+            const size_t iov_count = cb_free_iov(client_buffer, iov);
+            if (ir_readv(ring, client_fd(server, id), iov, iov_count, (uint64_t) id << 1 | RING_RECV)) {
+                cb_pin(client_buffer, true);
+            } else if (!ts_received(this, id, cb_recv(client_buffer, client_fd(server, id)))) {
                 continue;
             }
         }
 
-        /*if (!iob_empty(&this->tunnel_buffers[id]) && can_write(client)) {
-            const ssize_t sent = iob_send(&this->tunnel_buffers[id], client->fd);
-            if (sent == -1) {
-                ts_remove_client(this, i);
-                continue;
+        CyclicBuffer* tunnel_buffer = &this->clients[id].tunnel_buffer;
+        if (!cb_pinned(tunnel_buffer) && !cb_empty(tunnel_buffer) && client_writeable(server, id)) {
+            const size_t iov_count = cb_used_iov(tunnel_buffer, iov, cb_count(tunnel_buffer));
+            if (ir_writev(ring, client_fd(server, id), iov, iov_count, (uint64_t) id << 1 | RING_SEND)) {
+                cb_pin(tunnel_buffer, true);
+            } else {
+                ts_sent(this, id, cb_send(tunnel_buffer, client_fd(server, id)));
             }
-        }*/
+        }
     }
+
+    ts_reap_ring(this);
 }
 
-int next_message_client(TunnelServer* this, int previous) {
-    if (this->client_count == 0) return NO_ORDER;
+void ts_actual_remove(TunnelServer* this, int id) {
+    const int i = this->clients[id].table_index;
 
-    Server* server = &this->server;
+    remove_client(&this->server, id);
+    sched_deactivate(&ts_tunnel(this, id)->scheduler, id);
+    this->clients[id].window_queued = false;
+    this->clients[id].remove_flag = false;
+    this->clients[id].table_index = NO_ID;
 
-    const int start = (previous == NO_ORDER) ? 0 : (previous + 1) % this->client_count;
-    const int end = (start >= 1) ? ((start - 1) % this->client_count) : (this->client_count - 1);
+    cb_free(&this->clients[id].client_buffer);
+    cb_free(&this->clients[id].tunnel_buffer);
 
-    int i;
-    for (i = start; i != end; i = (i + 1) % this->client_count) {
-        if (!cb_empty(&this->client_buffers[this->id_table[i]])) break;
-    }
+    stats_close_stream(ts_stats(this, id));
+    stats_add(&this->stats.closed, 1);
 
-    if (i == end && cb_empty(&this->client_buffers[this->id_table[i]])) {
-        return NO_ORDER;
+    const int last_id = this->id_table[--this->client_count];
+    this->id_table[i] = last_id;
+    if (last_id != id) {
+        this->clients[last_id].table_index = i;
     }
-    return i;
 }
 
-void ts_actual_remove(TunnelServer* this, int i) {
-    const int id = this->id_table[i];
+size_t ts_flush_control(TunnelServer* this, TSTunnel* tunnel, TPBControlBatch* batch) {
+    if (batch->length == 0) return 0;
 
-    remove_client(&this->server, id);
+    stats_add(&this->stats.control_frames, 1);
+    return tpb_batch_flush(&tunnel->tpb, batch);
+}
+
+/* Puts the event into the batch, flushing the batch when it is full. Fails
+ * once the control budget of the pass is used up. */
+bool ts_put_event(TunnelServer* this, TSTunnel* tunnel, TPBControlBatch* batch, size_t* budget,
+    char op, int stream, uint64_t operand) {
+    const TPBEvent event = {op, stream, operand};
+    if (!tpb_batch_add(batch, &event, *budget)) {
+        if (batch->length == 0) return false;
 
-    cb_free(&this->client_buffers[id]);
-    cb_free(&this->tunnel_buffers[id]);
+        *budget -= ts_flush_control(this, tunnel, batch);
+        if (!tpb_batch_add(batch, &event, *budget)) return false;
+    }
 
-    this->id_table[i] = this->id_table[this->client_count - 1];
-    this->client_count--;
+    stats_add(&this->stats.control_events, 1);
+    return true;
 }
 
-bool process_empty_removed(TunnelServer* this) {
-    TPBuffer* tpb = &this->tunnel_tpb;
+bool process_added(TunnelServer* this, TSTunnel* tunnel, TPBControlBatch* batch, size_t* budget) {
+    for (int stream; iq_peek(&tunnel->add_queue, &stream); iq_pop(&tunnel->add_queue)) {
+        const int id = TPB_STREAM_SLOT(stream);
+        if (this->clients[id].table_index == NO_ID || this->clients[id].announced
+            || ts_stream(this, id) != stream) continue;
 
-    for (size_t i = 0; i < this->client_count; ) {
-        const int id = this->id_table[i];
-        
-        if (!this->remove_flag[id] ||
-            !cb_empty(&this->client_buffers[id])) {
-                ++i;
-                continue;
-            }
+        if (!ts_put_event(this, tunnel, batch, budget, CLIENT_ADD, stream, 0)) return false;
+
+        this->clients[id].announced = true;
+        if (ts_sendable(this, id) > 0) {
+            ts_activate(this, id);
+        }
+    }
+
+    return true;
+}
+
+/* A removed client goes once all of its data is framed. Clients the peer
+ * never heard of go without any event. Those that are not done yet go back
+ * to the end of the queue. The event carries the length of the stream, its
+ * last frames may still be on their way over another connection. */
+bool process_empty_removed(TunnelServer* this, TSTunnel* tunnel, TPBControlBatch* batch, size_t* budget) {
+    for (size_t left = iq_count(&tunnel->remove_queue); left > 0; --left) {
+        int id;
+        iq_peek(&tunnel->remove_queue, &id);
+
+        if (!cb_empty(&this->clients[id].client_buffer) || ts_ring_pending(this, id)) {
+            iq_pop(&tunnel->remove_queue);
+            iq_push(&tunnel->remove_queue, id);
+            continue;
+        }
 
-        if (!cb_empty(&this->client_buffers[id])) continue;
-        if (!tpb_contol_message(tpb, CLIENT_REMOVE, id)) return false;
+        if (this->clients[id].announced && !ts_put_event(this, tunnel, batch, budget,
+                CLIENT_REMOVE, ts_stream(this, id), this->clients[id].seq)) {
+            return false;
+        }
 
-        this->remove_flag[id] = false;
+        iq_pop(&tunnel->remove_queue);
         ts_actual_remove(this, id);
     }
 
     return true;
 }
 
-bool process_added(TunnelServer* this) {
-    TPBuffer* tpb = &this->tunnel_tpb;
+bool process_windows(TunnelServer* this, TSTunnel* tunnel, TPBControlBatch* batch, size_t* budget) {
+    for (int id; iq_peek(&tunnel->window_queue, &id); iq_pop(&tunnel->window_queue)) {
+        if (!this->clients[id].window_queued) continue;
+
+        if (!ts_put_event(this, tunnel, batch, budget, CLIENT_WINDOW, ts_stream(this, id),
+                this->clients[id].window_pending)) {
+            return false;
+        }
 
-    for (char id; cb_peek(&this->add_queue, &id); cb_skip(&this->add_queue, 1)) {
-        if (!tpb_contol_message(tpb, CLIENT_ADD, id)) return false;
+        this->clients[id].window_pending = 0;
+        this->clients[id].window_queued = false;
     }
 
     return true;
 }
 
-void fill_message(TunnelServer* this) {
-    if (!process_empty_removed(this)) return;
-    if (!process_added(this)) return;
+bool ts_control_pending(const TSTunnel* tunnel) {
+    return !iq_empty(&tunnel->add_queue) || !iq_empty(&tunnel->remove_queue) || !iq_empty(&tunnel->window_queue);
+}
 
-    TPBuffer* tpb = &this->tunnel_tpb;
+void ts_account_burst(TunnelServer* this, int id, size_t sent, bool backlogged) {
+    Scheduler* scheduler = &ts_tunnel(this, id)->scheduler;
+    if (scheduler->policy != SCHED_PRIORITY) return;
 
-    do {
-        if (this->send_order == NO_ORDER || this->send_count == 0) {
-            this->send_order = next_message_client(this, this->send_order);
-            if (this->send_order == NO_ORDER) break;
-        }
+    this->clients[id].burst = backlogged ? this->clients[id].burst + sent : 0;
+    sched_set_priority(scheduler, id, ts_priority(this, id));
+}
 
-        CyclicBuffer* data_buf = &this->client_buffers[this->id_table[this->send_order]];
-        if (this->send_count == 0) {
-            this->send_count = data_buf->count;
-        }
+/* Control events are coalesced into batch frames ahead of the data. Their
+ * budget is capped while streams have data waiting, so a storm of accepts
+ * and closes drains over several passes instead of stalling the data. */
+void fill_control(TunnelServer* this, TSTunnel* tunnel) {
+    TPBuffer* tpb = &tunnel->tpb;
 
-        if (this->send_count == 0) break;
+    size_t budget = cb_free_space(&tpb->buffer);
+    if (!sched_empty(&tunnel->scheduler)) {
+        budget = min_size_t(budget, max_size_t(budget / CONTROL_SHARE_DIVISOR, CONTROL_MIN_BUDGET));
+    }
+
+    TPBControlBatch batch;
+    tpb_batch_init(tpb, &batch);
+
+    if (process_added(this, tunnel, &batch, &budget) && process_empty_removed(this, tunnel, &batch, &budget)) {
+        process_windows(this, tunnel, &batch, &budget);
+    }
+
+    ts_flush_control(this, tunnel, &batch);
+}
+
+/* A stream whose frames no longer fit is moved to another connection before
+ * the next pass. */
+bool fill_message(TunnelServer* this, TSTunnel* tunnel) {
+    fill_control(this, tunnel);
+
+    TPBuffer* tpb = &tunnel->tpb;
+    Scheduler* scheduler = &tunnel->scheduler;
+
+    int id;
+    size_t budget;
+    while ((id = sched_next(scheduler, &budget)) != SCHED_NO_STREAM) {
+        CyclicBuffer* data_buf = &this->clients[id].client_buffer;
+        const size_t requested = min_size_t(budget, ts_sendable(this, id));
 
         cb_shift(data_buf);
-        const ssize_t count = tpb_encapsulate(tpb, cb_data(data_buf), this->send_count, this->id_table[this->send_order]);
-        if (count >= 0) {
-            this->send_count -= count;
-        }
+        const size_t buffered = cb_count(&tpb->buffer);
+        const size_t count = tpb_encapsulate(tpb, cb_data(data_buf), requested, ts_stream(this, id),
+            this->clients[id].seq);
         cb_skip(data_buf, count);
-    } while (this->send_count == 0);
+        this->clients[id].seq += count;
+        ts_consume_credit(this, id, count);
+        ts_account_pick(this, id);
+        ts_account_frame(this, id, count, cb_count(&tpb->buffer) - buffered);
+
+        const bool backlogged = ts_sendable(this, id) > 0;
+        ts_account_burst(this, id, count, backlogged);
+        sched_consume(scheduler, id, count, backlogged);
+        ts_update_readable(this, id);
+
+        if (count < requested) {
+            if (backlogged) {
+                ts_rebalance(this, id);
+            }
+            break;
+        }
+    }
+
+    return !sched_empty(scheduler) || ts_control_pending(tunnel);
+}
+
+void ts_send_gather(TunnelServer* this, size_t t) {
+    TSTunnel* tunnel = &this->tunnels[t];
+    TPBuffer* tpb = &tunnel->tpb;
+    Scheduler* scheduler = &tunnel->scheduler;
+
+    CBBatch batch;
+    char headers[GATHER_MAX_STREAMS][TPB_HEADER_LENGTH];
+    int ids[GATHER_MAX_STREAMS];
+    size_t pending[GATHER_MAX_STREAMS];
+    size_t stream_count = 0;
+
+    tpb_seal(tpb);
+    cbb_init(&batch);
+    cbb_add_buffer(&batch, &tpb->buffer, cb_count(&tpb->buffer));
+
+    const size_t frame_limit = cb_size(&tpb->buffer) - TPB_HEADER_LENGTH;
+
+    int id;
+    size_t budget;
+    while (stream_count < GATHER_MAX_STREAMS && batch.total < GATHER_LIMIT
+        && (id = sched_next(scheduler, &budget)) != SCHED_NO_STREAM && !this->clients[id].in_batch) {
+        CyclicBuffer* data_buf = &this->clients[id].client_buffer;
+        const size_t sendable = ts_sendable(this, id);
+        const size_t count = min_size_t(min_size_t(budget, sendable), frame_limit);
+        const bool backlogged = sendable > count;
+
+        const size_t header_length = tpb_frame_header(headers[stream_count], ts_stream(this, id),
+            tpb_data_flags(tpb), this->clients[id].seq, count);
+        cbb_begin_group(&batch);
+        cbb_add_data(&batch, headers[stream_count], header_length);
+        cbb_add_buffer(&batch, data_buf, count);
+        ts_account_pick(this, id);
+        ts_account_frame(this, id, count, header_length + count);
+
+        ts_account_burst(this, id, count, backlogged);
+        sched_consume(scheduler, id, count, backlogged);
+        this->clients[id].in_batch = true;
+        pending[stream_count] = cb_count(data_buf);
+        ids[stream_count++] = id;
+    }
+
+    const ssize_t sent = cbb_send(&batch, tunnel_fd(&this->server, t), &tpb->buffer);
+    if (sent == -1) {
+        this->tunnel_lost = true;
+    } else {
+        tpb_note_passthrough(tpb, sent);
+        stats_add(&this->stats.tunnel_out, sent);
+    }
+
+    /* A frame that went out in part is finished from the tunnel buffer, so
+     * the stream offset moves by whole frames. */
+    for (size_t i = 0; i < stream_count; ++i) {
+        const int id = ids[i];
+        const size_t consumed = pending[i] - cb_count(&this->clients[id].client_buffer);
+        this->clients[id].in_batch = false;
+        this->clients[id].seq += consumed;
+        ts_consume_credit(this, id, consumed);
+
+        if (ts_sendable(this, id) > 0) {
+            ts_activate(this, id);
+        }
+        ts_update_readable(this, id);
+    }
+}
+
+bool ts_has_output(TSTunnel* tunnel) {
+    if (!tpb_empty(&tunnel->tpb) || ts_control_pending(tunnel)) return true;
+    return tunnel->tpb.format == PR_FORMAT_LENGTH && !sched_empty(&tunnel->scheduler);
+}
+
+/* Returns the id of the client the stream belongs to or NO_ID for streams
+ * that are closed, including earlier generations of an open slot. */
+int ts_stream_client(TunnelServer* this, int stream) {
+    if (stream < 0) return NO_ID;
+
+    const int id = TPB_STREAM_SLOT(stream);
+    if (client_fd(&this->server, id) == REMOVED_CLIENT || ts_stream(this, id) != stream) return NO_ID;
+    return id;
 }
 
-/*#define KB (1 << 10)
-#define MB (KB << 10)
+void ts_grant_credit(TunnelServer* this, int id, size_t credit) {
+    if (!this->flow_control) return;
+
+    this->clients[id].send_credit += credit;
+    if (ts_sendable(this, id) > 0) {
+        ts_activate(this, id);
+    }
+    ts_update_readable(this, id);
+}
 
-#define MAX_BUF_SIZE (MB)
+/* Credit is granted only for a stream the peer has set up, from then on the
+ * stream may move to another connection. */
+void process_control(TunnelServer* this, const TPBEvent* event) {
+    const int id = ts_stream_client(this, event->stream);
+    if (id == NO_ID) return;
+
+    if (event->op == CLIENT_REMOVE) {
+        this->clients[id].peer_closed = true;
+        ts_update_writeable(this, id);
+    } else if (event->op == CLIENT_WINDOW) {
+        this->clients[id].confirmed = true;
+        ts_grant_credit(this, id, event->operand);
+    }
+}
+
+/* Control frames are decoded as a whole, the reader keeps an event that is
+ * cut by the end of the input until the rest arrives. */
+void process_control_events(TunnelServer* this, TSTunnel* tunnel) {
+    TPBEvent events[CONTROL_PARSE_EVENTS];
+    for (size_t count; (count = tpb_reader_parse(&tunnel->control, events, CONTROL_PARSE_EVENTS)) > 0; ) {
+        for (size_t i = 0; i < count; ++i) {
+            process_control(this, &events[i]);
+        }
+    }
+}
 
-void distribute_message(TunnelServer* this) {
-    MessageReceiver* mb = &this->server.client_mb;
+/* The peer keeps every stream on the connection it was opened on, so the
+ * data of a stream arrives in order and needs no sequence numbers. */
+bool distribute_message(TunnelServer* this, TSTunnel* tunnel) {
+    MessageReceiver* mr = &tunnel->mr;
 
     int order;
-    while ((order = get_current_order(mb)) != NO_ORDER) {
-        const size_t count = get_contiguous_count(mb);
+    while ((order = get_current_order(mr)) != MR_NO_ORDER) {
+        ssize_t count;
+        int id;
 
         if (order == CONTROL_ORDER) {
-            //count == 1, that's obvious (no)
-            char removed_id;
-            decapsulate(mb, &removed_id, 1);
-            ts_remove_client(this, removed_id);
-            continue;
+            count = decapsulate(mr, tpb_reader_end(&tunnel->control), tpb_reader_space(&tunnel->control));
+            tpb_reader_put(&tunnel->control, count);
+            process_control_events(this, tunnel);
+        } else if ((id = ts_stream_client(this, order)) == NO_ID) {
+            count = skip(mr, (size_t) -1);
+        } else {
+            CyclicBuffer* buffer = &this->clients[id].tunnel_buffer;
+            if (!cb_reserve(buffer)) return false;
+
+            count = decapsulate(mr, cb_data_end(buffer), cb_free_contiguous_space(buffer));
+            cb_skip_right(buffer, count);
+            ts_update_writeable(this, id);
         }
 
-        if (this->remove_flag[order]) {
-            skip(mb, count);
+        if (count == 0 && mr_empty(mr)) break;
+    }
+
+    return true;
+}
+
+/* Frames go into the ring as fast as they are built, so a pass keeps
+ * building until the streams run dry or the ring is full. A full ring asked
+ * the peer to ring the doorbell once it has made room. */
+void ts_send_shm(TunnelServer* this, TSTunnel* tunnel) {
+    bool pending;
+    size_t passed = 0;
+
+    do {
+        pending = fill_message(this, tunnel);
+        const ssize_t sent = tpb_send_link(&tunnel->tpb, &this->shm);
+        if (sent == -1) {
+            this->tunnel_lost = true;
+            return;
         }
+        stats_add(&this->stats.tunnel_out, sent);
+        passed += sent;
+    } while (pending && tpb_empty(&tunnel->tpb) && passed < SHM_PASS_LIMIT);
+
+    if (pending && tpb_empty(&tunnel->tpb)) {
+        notify_server(&this->server);
+    }
+}
 
-        IOBuffer* buffer = get_client_buf(&this->server, order);
-        reserve(buffer, count);
+/* The tunnel socket only carries doorbells here, the data is read from the
+ * ring and distributed until the ring is empty, which asks the peer to ring,
+ * or a client buffer is full. */
+void ts_recv_shm(TunnelServer* this, TSTunnel* tunnel) {
+    MessageReceiver* mr = &tunnel->mr;
 
-        const size_t decapsulated = decapsulate(mb, &buffer->buf[buffer->count], count);
-        if (decapsulated < count) {
-            fprintf(stderr, 
-                "contiguous count and decapsulated count don't match!: (cont: %d, real: %d)\n",
-                count, decapsulated);
+    if (tunnel_readable(&this->server, 0) && sl_clear_doorbell(&this->shm) == -1) {
+        this->tunnel_lost = true;
+        return;
+    }
+
+    size_t passed = 0;
+    while (distribute_message(this, tunnel) && !mr_full(mr)) {
+        if (passed >= SHM_PASS_LIMIT) {
+            notify_server(&this->server);
+            break;
         }
-        buffer->count += decapsulated;
 
-        if (buffer->size >= MAX_BUF_SIZE) {
-            ts_remove_client(this, order);
+        const ssize_t received = mr_recv_link(mr, &this->shm);
+        if (received == -1) {
+            this->tunnel_lost = true;
+            return;
         }
+        if (received == 0) break;
+
+        stats_add(&this->stats.tunnel_in, received);
+        passed += received;
     }
-}*/
+}
 
-void perform_protocol_io(TunnelServer* this) {
+void perform_tunnel_io(TunnelServer* this, size_t t) {
     Server* server = &this->server;
+    TSTunnel* tunnel = &this->tunnels[t];
+    MessageReceiver* mr = &tunnel->mr;
 
-    fill_message(this);
-    if (tunnel_writeable(server)) {
-        tpb_send(&this->tunnel_tpb, tunnel_fd(server));
+    if (tunnel->tpb.format == PR_FORMAT_LENGTH && !tpb_compressing(&tunnel->tpb)) {
+        fill_control(this, tunnel);
+        if (tunnel_writeable(server, t)) {
+            ts_send_gather(this, t);
+        }
+    } else {
+        const bool pending = fill_message(this, tunnel);
+        if (tunnel_writeable(server, t)) {
+            const ssize_t sent = tpb_send(&tunnel->tpb, tunnel_fd(server, t));
+            if (sent == -1) {
+                this->tunnel_lost = true;
+            } else {
+                stats_add(&this->stats.tunnel_out, sent);
+            }
+
+            if (pending && tpb_empty(&tunnel->tpb)) {
+                notify_server(server);
+            }
+        }
     }
 
-    /*distribute_message(this);
-    message = &server->client_mb.message;
+    if (!mr_full(mr) && tunnel_readable(server, t)) {
+        const ssize_t received = mr_recv(mr, tunnel_fd(server, t));
+        if (received == -1) {
+            this->tunnel_lost = true;
+            return;
+        }
+        stats_add(&this->stats.tunnel_in, received);
+    }
 
-    if (can_read(get_tunnel(server))) {
-        iob_recv(message, get_tunnel(server)->fd);
-    }*/
+    distribute_message(this, tunnel);
+    set_tunnel_readable(server, t, !mr_full(mr));
 }
 
-void ts_cleanup(TunnelServer* this) {
-    cleanup_server(&this->server);
-
-    for (size_t i = 0; i < get_client_count(&this->server); ++i) {
-        cb_free(&this->client_buffers[this->id_table[i]]);
-        cb_free(&this->tunnel_buffers[this->id_table[i]]);
+void perform_protocol_io(TunnelServer* this) {
+    if (this->use_shm) {
+        ts_send_shm(this, &this->tunnels[0]);
+        ts_recv_shm(this, &this->tunnels[0]);
+        return;
     }
 
-    tpb_free(&this->tunnel_tpb);
+    for (size_t t = 0; t < this->tunnel_count && !this->tunnel_lost; ++t) {
+        perform_tunnel_io(this, t);
+    }
 }
 
 int main_loop(TunnelServer* this) {
     Server* server = &this->server;
 
-    size_t fd_count;
-    while ((fd_count = poll(server->clients, get_poll_count(server), -1)) != -1) {
+    int fd_count;
+    while ((fd_count = wait_server(server, -1)) != -1) {
+        if (any_tunnel_has_errors(server)) {
+            fprintf(stderr, "Tunnel connection lost\n");
+            break;
+        }
+
         const int has_pending = get_listener(server)->revents & POLLIN;
 
         if (has_pending) {
-            const int client_fd = accept(get_listener(server)->fd, NULL, NULL);
+            /* A client that reads slowly must never block the loop, a write
+             * that would block leaves EPOLLOUT armed for the rest. */
+            const int client_fd = accept4(get_listener(server)->fd, NULL, NULL, SOCK_NONBLOCK);
 
             if (client_fd == -1) {
-                perror("accept");
+                perror("accept4");
                 continue;
             }
 
-            if (!is_full(server)) {
-                ts_add_client(this, client_fd);
-            } else {
-                close(client_fd);
-            }
+            ts_add_client(this, client_fd);
         }
 
-        perform_client_io(this, has_pending ? fd_count - 1 : fd_count);
+        if (this->use_ring) {
+            perform_client_io_ring(this, has_pending ? fd_count - 1 : fd_count);
+        } else {
+            perform_client_io(this, has_pending ? fd_count - 1 : fd_count);
+        }
         perform_protocol_io(this);
+        stats_set(&this->stats.buffer_bytes, this->pool.used_bytes);
+        stats_set(&this->stats.pooled_bytes, this->pool.kept_bytes);
+        if (this->tunnel_lost) {
+            fprintf(stderr, "Tunnel connection lost\n");
+            break;
+        }
 
-        set_tunnel_writeable(server, !tpb_empty(&this->tunnel_tpb));
-        static const struct timespec sleep_time = {.tv_sec=0, .tv_nsec=10000000};
-        nanosleep(&sleep_time, NULL);
+        for (size_t t = 0; t < this->tunnel_count; ++t) {
+            set_tunnel_writeable(server, t, !this->use_shm && ts_has_output(&this->tunnels[t]));
+        }
     }
 
-    perror("poll");
+    if (fd_count == -1) {
+        perror("epoll_wait");
+    }
     ts_cleanup(this);
     return EXIT_FAILURE;
 }
 
+/* Every connection to the stats socket gets a snapshot of the counters of
+ * the tunnel and one line per open stream. The sender never waits for the
+ * reader. */
+void* stats_worker(void* unused) {
+    for (;;) {
+        const int fd = accept(stats_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        FILE* out = fdopen(fd, "w");
+        if (out == NULL) {
+            perror("fdopen");
+            close(fd);
+            continue;
+        }
+
+        stats_write_tunnel(out, 0, &tunnel_server->stats);
+        stats_write_table(out, 0, &tunnel_server->stream_stats);
+        fclose(out);
+    }
+
+    return NULL;
+}
+
+bool start_stats(pthread_t* thread, const TunnelParams* params) {
+    if (params->stats_path == NULL) return false;
+
+    stats_fd = stats_listen(params->stats_path);
+    if (stats_fd == -1) return false;
+
+    const int err_code = pthread_create(thread, NULL, stats_worker, NULL);
+    if (err_code != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+        close(stats_fd);
+        stats_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void stop_stats(pthread_t thread, const TunnelParams* params) {
+    shutdown(stats_fd, SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(stats_fd);
+    stats_fd = -1;
+    unlink(params->stats_path);
+}
+
+int run_sender(const TunnelParams* params) {
+    TunnelServer* server = aligned_alloc(STATS_CACHE_LINE, sizeof(*server));
+    if (server == NULL) {
+        perror("aligned_alloc");
+        return EXIT_FAILURE;
+    }
+
+    pr_current_impl();
+
+    if (init_tserver(server, params) == EXIT_FAILURE) {
+        free(server);
+        return EXIT_FAILURE;
+    }
+    tunnel_server = server;
+
+    pthread_t stats_thread;
+    const bool stats = start_stats(&stats_thread, params);
+
+    main_loop(server);
+
+    if (stats) {
+        stop_stats(stats_thread, params);
+    }
+    stats_table_free(&server->stream_stats);
+    return EXIT_FAILURE;
+}
+
+int parse_policy(TunnelParams* this, const char* policy) {
+    if (policy == NULL || strcmp(policy, "drr") == 0) {
+        this->policy = SCHED_DRR;
+    } else if (strcmp(policy, "priority") == 0) {
+        this->policy = SCHED_PRIORITY;
+    } else {
+        fprintf(stderr, "SCHEDULER must be either drr or priority\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int parse_engine(TunnelParams* this, const char* engine) {
+    if (engine == NULL || strcmp(engine, "poll") == 0) {
+        this->io_uring = false;
+    } else if (strcmp(engine, "uring") == 0) {
+        this->io_uring = true;
+    } else {
+        fprintf(stderr, "ENGINE must be either poll or uring\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int parse_connections(TunnelParams* this, const char* connections) {
+    this->connections = 1;
+    if (connections == NULL) return EXIT_SUCCESS;
+
+    char* end;
+    const long count = strtol(connections, &end, 10);
+    if (*end != '\0' || count < 1 || count > MAX_CONNECTIONS) {
+        fprintf(stderr, "CONNECTIONS must be an integer from 1 to %d\n", MAX_CONNECTIONS);
+        return EXIT_FAILURE;
+    }
+
+    this->connections = count;
+    return EXIT_SUCCESS;
+}
+
 int parse_params(TunnelParams* this, int argc, char* argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s LISTENING_PORT IP_ADDR DESTINATION_PORT\n", argv[0]);
+    if (argc < 4 || argc > 8) {
+        fprintf(stderr, "Usage: %s LISTENING_PORT {IP_ADDR DESTINATION_PORT|unix SOCKET_PATH} [drr|priority] [CONNECTIONS] [STATS_SOCKET|-] [poll|uring]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    this->stats_path = argc >= 7 && strcmp(argv[6], "-") != 0 ? argv[6] : NULL;
+
+    if (parse_engine(this, argc == 8 ? argv[7] : NULL) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    if (parse_policy(this, argc >= 5 ? argv[4] : NULL) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    if (parse_connections(this, argc >= 6 ? argv[5] : NULL) == EXIT_FAILURE) {
         return EXIT_FAILURE;
     }
 
@@ -346,10 +1331,7 @@ int main(int argc, char* argv[]) {
     struct sigaction act = {};
     act.sa_handler = interrupt;
     sigaction(SIGINT, &act, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
-    if (init_tserver(&tunnel_server, &params) != EXIT_SUCCESS) {
-        return EXIT_FAILURE;
-    }
-
-    return main_loop(&tunnel_server);
+    return run_sender(&params);
 }
@@ -0,0 +1,1192 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "cyclic_buffer.h"
+#include "message_receiver.h"
+#include "socket_utils.h"
+#include "server_management.h"
+#include "transport_protocol_buffer.h"
+#include "handshake.h"
+#include "utils.h"
+#include "scheduler.h"
+#include "id_queue.h"
+#include "shm_link.h"
+
+#define BUFFER_SIZE 1024
+#define MESSAGE_SIZE (2 * BUFFER_SIZE + 3)
+#define COMPRESSED_MESSAGE_SIZE (PR_COMPRESS_LIMIT + TPB_HEADER_LENGTH)
+
+#define SCHED_QUANTUM BUFFER_SIZE
+
+#define STREAM_WINDOW (64 * BUFFER_SIZE)
+#define WINDOW_UPDATE_THRESHOLD (STREAM_WINDOW / 4)
+#define UNLIMITED_CREDIT ((size_t) -1)
+
+#define TUNNEL_BACKLOG 16
+
+#define CONTROL_SHARE_DIVISOR 4
+#define CONTROL_MIN_BUDGET 64
+
+/* Events parsed off the control reader per pass. */
+#define CONTROL_PARSE_EVENTS 64
+
+#define SHM_PASS_LIMIT SL_RING_SIZE
+
+#define CONNECT_TIMEOUT 5000
+
+/* Striped sessions waiting for the rest of their connections. */
+#define MAX_PENDING_SESSIONS 16
+#define SESSION_JOIN_TIMEOUT (HANDSHAKE_TIMEOUT * HS_MAX_TUNNELS)
+
+/* Data of a stream that arrived ahead of its offset, waiting for the bytes
+ * before it. */
+typedef struct TMHeld {
+    uint64_t seq;
+    size_t length;
+    size_t offset;
+    struct TMHeld* next;
+    char data[];
+} TMHeld;
+
+typedef struct {
+    int stream;
+    int table_index;
+    bool remove_flag;
+    bool peer_closed;
+
+    /* The connection the stream's downstream data and events go to. */
+    size_t tunnel;
+
+    /* A stream whose slot the sender already reused, still waiting for
+     * frames that took another connection. */
+    bool detached;
+
+    /* The stream offset the upstream buffer continues at and the length the
+     * sender reported with CLIENT_REMOVE. */
+    uint64_t next_seq;
+    uint64_t final_seq;
+    TMHeld* held;
+    size_t held_bytes;
+
+    size_t send_credit;
+    size_t window_pending;
+    bool window_queued;
+
+    bool connecting;
+    long deadline;
+    int next_connect;
+    int prev_connect;
+
+    CyclicBuffer upstream_buffer;
+    CyclicBuffer downstream_buffer;
+} TMUpstream;
+
+/* One connection of the tunnel. Streams are served by the connection their
+ * id hashes to, the same one the sender opened them on. */
+typedef struct {
+    Scheduler scheduler;
+
+    IdQueue refuse_queue;
+    IdQueue close_queue;
+    IdQueue window_queue;
+
+    TPBuffer tpb;
+
+    MessageReceiver mr;
+    TPBEventReader control;
+} TMTunnel;
+
+/* The far end of lab34-sender: every stream the sender announces with
+ * CLIENT_ADD gets its own upstream connection to the backend. Streams are
+ * named by the sender's stream ids on the wire and by local Server ids here,
+ * local_ids maps the slot of a stream id to the upstream serving it. */
+typedef struct {
+    Server server;
+    SocketAddress backend;
+
+    int* local_ids;
+    size_t slot_count;
+    size_t detached_count;
+
+    TMUpstream* upstreams;
+    size_t capacity;
+    int* id_table;
+    size_t client_count;
+    CBPool pool;
+
+    bool flow_control;
+
+    /* Upstream connects still in progress, oldest first. They all get the
+     * same timeout, so the oldest one always expires next. */
+    int connect_head;
+    int connect_tail;
+
+    TMTunnel tunnels[SERVER_MAX_TUNNELS];
+    size_t tunnel_count;
+
+    bool tunnel_lost;
+
+    bool use_shm;
+    ShmLink shm;
+} Terminator;
+
+void tm_free_held(TMUpstream* upstream) {
+    while (upstream->held != NULL) {
+        TMHeld* next = upstream->held->next;
+        free(upstream->held);
+        upstream->held = next;
+    }
+    upstream->held_bytes = 0;
+}
+
+void tm_cleanup(Terminator* this) {
+    cleanup_server(&this->server);
+
+    for (size_t i = 0; i < this->client_count; ++i) {
+        cb_free(&this->upstreams[this->id_table[i]].upstream_buffer);
+        cb_free(&this->upstreams[this->id_table[i]].downstream_buffer);
+        tm_free_held(&this->upstreams[this->id_table[i]]);
+    }
+    free(this->upstreams);
+    free(this->id_table);
+    free(this->local_ids);
+    cbp_free(&this->pool);
+
+    for (size_t i = 0; i < this->tunnel_count; ++i) {
+        TMTunnel* tunnel = &this->tunnels[i];
+        sched_free(&tunnel->scheduler);
+        tpb_free(&tunnel->tpb);
+        free_messagerecv(&tunnel->mr);
+        iq_free(&tunnel->refuse_queue);
+        iq_free(&tunnel->close_queue);
+        iq_free(&tunnel->window_queue);
+    }
+
+    if (this->use_shm) {
+        sl_free(&this->shm);
+    }
+}
+
+void tm_init_tunnel(TMTunnel* this, PRFormat format, bool compression) {
+    sched_init(&this->scheduler, SCHED_DRR, SCHED_QUANTUM);
+
+    iq_init(&this->refuse_queue);
+    iq_init(&this->close_queue);
+    iq_init(&this->window_queue);
+
+    tpb_init(&this->tpb, compression ? PR_COMPRESS_LIMIT : MESSAGE_SIZE);
+    init_mr(&this->mr, compression ? COMPRESSED_MESSAGE_SIZE : MESSAGE_SIZE);
+    tpb_reader_init(&this->control);
+    tpb_set_format(&this->tpb, format);
+    mr_set_format(&this->mr, format);
+    if (compression) {
+        tpb_enable_compression(&this->tpb);
+        mr_enable_compression(&this->mr);
+    }
+}
+
+/* The tunnel connections are already negotiated and ordered the way the
+ * sender numbered them. */
+int init_terminator(Terminator* this, const int* tunnel_fds, size_t tunnel_count,
+    PRFormat format, int features, const SocketAddress* backend) {
+    memset(this, 0, sizeof(*this));
+
+    if (init_server_fds(&this->server, REMOVED_CLIENT, tunnel_fds, tunnel_count) == EXIT_FAILURE) {
+        for (size_t i = 0; i < tunnel_count; ++i) {
+            close(tunnel_fds[i]);
+        }
+        return EXIT_FAILURE;
+    }
+
+    this->backend = *backend;
+    this->connect_head = NO_ID;
+    this->connect_tail = NO_ID;
+    cbp_init(&this->pool);
+
+    this->flow_control = features & HS_FEATURE_FLOW_CONTROL;
+
+    if (features & HS_FEATURE_SHARED_MEMORY) {
+        this->use_shm = sl_attach(&this->shm, tunnel_fds[0], HANDSHAKE_TIMEOUT);
+        if (!this->use_shm) {
+            fprintf(stderr, "Shared memory link is not available, staying on the socket\n");
+        }
+    }
+    const bool compression = format == PR_FORMAT_LENGTH && (features & HS_FEATURE_COMPRESSION);
+
+    this->tunnel_count = tunnel_count;
+    for (size_t i = 0; i < tunnel_count; ++i) {
+        tm_init_tunnel(&this->tunnels[i], format, compression);
+    }
+
+    for (size_t i = 0; i < tunnel_count; ++i) {
+        if (set_nonblocking(tunnel_fds[i]) == EXIT_FAILURE) {
+            tm_cleanup(this);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+TMTunnel* tm_tunnel(Terminator* this, int id) {
+    return &this->tunnels[this->upstreams[id].tunnel];
+}
+
+int tm_reserve(Terminator* this, size_t capacity) {
+    if (capacity <= this->capacity) return EXIT_SUCCESS;
+
+    TMUpstream* upstreams = realloc(this->upstreams, capacity * sizeof(*upstreams));
+    if (upstreams == NULL) {
+        perror("realloc");
+        return EXIT_FAILURE;
+    }
+    this->upstreams = upstreams;
+
+    int* id_table = realloc(this->id_table, capacity * sizeof(*id_table));
+    if (id_table == NULL) {
+        perror("realloc");
+        return EXIT_FAILURE;
+    }
+    this->id_table = id_table;
+
+    for (size_t i = 0; i < this->tunnel_count; ++i) {
+        if (!sched_reserve(&this->tunnels[i].scheduler, capacity)) return EXIT_FAILURE;
+    }
+
+    this->capacity = capacity;
+    return EXIT_SUCCESS;
+}
+
+int tm_reserve_slots(Terminator* this, size_t slot_count) {
+    if (slot_count <= this->slot_count) return EXIT_SUCCESS;
+    slot_count = max_size_t(slot_count, 2 * this->slot_count);
+
+    int* local_ids = realloc(this->local_ids, slot_count * sizeof(*local_ids));
+    if (local_ids == NULL) {
+        perror("realloc");
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = this->slot_count; i < slot_count; ++i) {
+        local_ids[i] = NO_ID;
+    }
+    this->local_ids = local_ids;
+    this->slot_count = slot_count;
+    return EXIT_SUCCESS;
+}
+
+/* Returns the upstream serving the stream or NO_ID, also for streams whose
+ * slot has been taken over by a later generation. Detached streams are no
+ * longer in local_ids and are looked up the slow way, there are only ever a
+ * few of them and only for as long as their last frames are under way. */
+int tm_stream_upstream(const Terminator* this, int stream) {
+    if (stream < 0 || (size_t) TPB_STREAM_SLOT(stream) >= this->slot_count) return NO_ID;
+
+    const int id = this->local_ids[TPB_STREAM_SLOT(stream)];
+    if (id != NO_ID && this->upstreams[id].stream == stream) return id;
+
+    for (size_t i = 0; this->detached_count > 0 && i < this->client_count; ++i) {
+        const int detached_id = this->id_table[i];
+        if (this->upstreams[detached_id].detached && this->upstreams[detached_id].stream == stream) {
+            return detached_id;
+        }
+    }
+    return NO_ID;
+}
+
+size_t tm_sendable(const Terminator* this, int id) {
+    return min_size_t(cb_count(&this->upstreams[id].downstream_buffer), this->upstreams[id].send_credit);
+}
+
+void tm_update_readable(Terminator* this, int id) {
+    const CyclicBuffer* buffer = &this->upstreams[id].downstream_buffer;
+    set_client_readable(&this->server, id, !cb_full(buffer) && cb_count(buffer) < this->upstreams[id].send_credit);
+}
+
+long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void tm_push_connect(Terminator* this, int id) {
+    TMUpstream* upstream = &this->upstreams[id];
+    upstream->connecting = true;
+    upstream->deadline = now_ms() + CONNECT_TIMEOUT;
+    upstream->next_connect = NO_ID;
+    upstream->prev_connect = this->connect_tail;
+
+    if (this->connect_tail == NO_ID) {
+        this->connect_head = id;
+    } else {
+        this->upstreams[this->connect_tail].next_connect = id;
+    }
+    this->connect_tail = id;
+}
+
+void tm_unlink_connect(Terminator* this, int id) {
+    TMUpstream* upstream = &this->upstreams[id];
+    if (!upstream->connecting) return;
+    upstream->connecting = false;
+
+    if (upstream->prev_connect == NO_ID) {
+        this->connect_head = upstream->next_connect;
+    } else {
+        this->upstreams[upstream->prev_connect].next_connect = upstream->next_connect;
+    }
+
+    if (upstream->next_connect == NO_ID) {
+        this->connect_tail = upstream->prev_connect;
+    } else {
+        this->upstreams[upstream->next_connect].prev_connect = upstream->prev_connect;
+    }
+}
+
+/* Waits no longer than until the oldest connect expires. */
+int tm_wait_timeout(const Terminator* this) {
+    if (this->connect_head == NO_ID) return -1;
+
+    const long left = this->upstreams[this->connect_head].deadline - now_ms();
+    return left > 0 ? left : 0;
+}
+
+void tm_actual_remove(Terminator* this, int id) {
+    const int i = this->upstreams[id].table_index;
+    const size_t slot = TPB_STREAM_SLOT(this->upstreams[id].stream);
+
+    tm_unlink_connect(this, id);
+    remove_client(&this->server, id);
+    sched_deactivate(&tm_tunnel(this, id)->scheduler, id);
+    this->upstreams[id].window_queued = false;
+    if (this->local_ids[slot] == id) {
+        this->local_ids[slot] = NO_ID;
+    }
+    if (this->upstreams[id].detached) {
+        this->upstreams[id].detached = false;
+        this->detached_count--;
+    }
+
+    cb_free(&this->upstreams[id].upstream_buffer);
+    cb_free(&this->upstreams[id].downstream_buffer);
+    tm_free_held(&this->upstreams[id]);
+
+    const int last_id = this->id_table[--this->client_count];
+    this->id_table[i] = last_id;
+    this->upstreams[last_id].table_index = i;
+}
+
+/* The upstream went away: the stream is reported to the sender once all of
+ * its data is framed. The close queue names it by stream, so an entry goes
+ * stale once the slot is taken over. */
+void tm_close_upstream(Terminator* this, int id) {
+    tm_unlink_connect(this, id);
+    disconnect_client(&this->server, id);
+    if (this->upstreams[id].remove_flag) return;
+
+    this->upstreams[id].remove_flag = iq_push(&tm_tunnel(this, id)->close_queue, this->upstreams[id].stream);
+}
+
+/* The sender closed the stream and every byte it sent has arrived. */
+bool tm_peer_done(const Terminator* this, int id) {
+    return this->upstreams[id].peer_closed && this->upstreams[id].next_seq >= this->upstreams[id].final_seq;
+}
+
+/* A pending connect keeps the upstream polled for writing, that is how it
+ * reports being done. */
+void tm_update_writeable(Terminator* this, int id) {
+    const bool empty = cb_empty(&this->upstreams[id].upstream_buffer);
+    set_client_writeable(&this->server, id, !empty || this->upstreams[id].connecting);
+
+    if (empty && tm_peer_done(this, id) && !this->upstreams[id].remove_flag) {
+        tm_close_upstream(this, id);
+    }
+}
+
+/* Moves the held data that the stream has caught up with into the upstream
+ * buffer. Credit bounds what the sender has in flight, so it normally fits. */
+void tm_release_held(Terminator* this, int id) {
+    TMUpstream* upstream = &this->upstreams[id];
+
+    TMHeld* chunk;
+    while ((chunk = upstream->held) != NULL && chunk->seq + chunk->offset == upstream->next_seq) {
+        const size_t written = cb_write(&upstream->upstream_buffer, &chunk->data[chunk->offset],
+            chunk->length - chunk->offset);
+        chunk->offset += written;
+        upstream->next_seq += written;
+        upstream->held_bytes -= written;
+        if (chunk->offset < chunk->length) break;
+
+        upstream->held = chunk->next;
+        free(chunk);
+    }
+}
+
+/* Data that got ahead of the stream over another connection is copied aside
+ * in offset order. A sender that keeps more in flight than the window is
+ * broken, its stream is closed. */
+ssize_t tm_hold(Terminator* this, int id, MessageReceiver* mr) {
+    TMUpstream* upstream = &this->upstreams[id];
+    const uint64_t seq = get_current_seq(mr);
+    const size_t length = get_contiguous_count(mr);
+
+    if (seq < upstream->next_seq) return skip(mr, length);
+
+    TMHeld* chunk = NULL;
+    if (upstream->held_bytes + length <= STREAM_WINDOW) {
+        chunk = malloc(sizeof(*chunk) + length);
+        if (chunk == NULL) {
+            perror("malloc");
+        }
+    }
+    if (chunk == NULL) {
+        tm_close_upstream(this, id);
+        return skip(mr, (size_t) -1);
+    }
+
+    const ssize_t count = decapsulate(mr, chunk->data, length);
+    chunk->seq = seq;
+    chunk->length = count;
+    chunk->offset = 0;
+
+    TMHeld** link = &upstream->held;
+    while (*link != NULL && (*link)->seq < seq) {
+        link = &(*link)->next;
+    }
+    chunk->next = *link;
+    *link = chunk;
+    upstream->held_bytes += count;
+    return count;
+}
+
+/* Drops the streams whose upstream did not answer in time. */
+void tm_expire_connects(Terminator* this) {
+    const long now = now_ms();
+
+    while (this->connect_head != NO_ID && this->upstreams[this->connect_head].deadline <= now) {
+        fprintf(stderr, "connect: timed out\n");
+        tm_close_upstream(this, this->connect_head);
+    }
+}
+
+/* The upstream turns writable or fails once the connect finished. */
+bool tm_try_finish_connect(Terminator* this, int id) {
+    if (!client_ioable(&this->server, id)) return false;
+
+    tm_unlink_connect(this, id);
+    if (finish_connect(client_fd(&this->server, id)) == EXIT_FAILURE) {
+        tm_close_upstream(this, id);
+        return false;
+    }
+
+    tm_update_writeable(this, id);
+    return true;
+}
+
+void tm_return_window(Terminator* this, int id, size_t delivered) {
+    if (!this->flow_control) return;
+
+    this->upstreams[id].window_pending += delivered;
+    if (this->upstreams[id].window_queued) return;
+
+    if (this->upstreams[id].window_pending >= WINDOW_UPDATE_THRESHOLD || cb_empty(&this->upstreams[id].upstream_buffer)) {
+        this->upstreams[id].window_queued = iq_push(&tm_tunnel(this, id)->window_queue, id);
+    }
+}
+
+/* A stream reusing a slot means the sender is done with the one before. Its
+ * CLIENT_REMOVE and last frames may still be on another connection though,
+ * so an earlier stream that is not closing yet is only detached from the
+ * slot. The upstream connects without blocking the loop. */
+void tm_open_stream(Terminator* this, int stream) {
+    const size_t slot = TPB_STREAM_SLOT(stream);
+    TMTunnel* tunnel = &this->tunnels[tpb_stream_tunnel(stream, this->tunnel_count)];
+    if (tm_reserve_slots(this, slot + 1) == EXIT_FAILURE) {
+        iq_push(&tunnel->refuse_queue, stream);
+        return;
+    }
+
+    const int previous = this->local_ids[slot];
+    if (previous != NO_ID && this->upstreams[previous].remove_flag) {
+        tm_actual_remove(this, previous);
+    } else if (previous != NO_ID) {
+        this->upstreams[previous].detached = true;
+        this->detached_count++;
+        this->local_ids[slot] = NO_ID;
+    }
+
+    bool connected;
+    const int fd = start_connect(&this->backend, &connected);
+    const int id = fd == ERR_SOCKET ? NO_ID : add_client(&this->server, fd);
+    if (id == NO_ID || tm_reserve(this, server_capacity(&this->server)) == EXIT_FAILURE) {
+        if (id != NO_ID) {
+            remove_client(&this->server, id);
+        } else if (fd != ERR_SOCKET) {
+            close(fd);
+        }
+        iq_push(&tunnel->refuse_queue, stream);
+        return;
+    }
+
+    cb_init_pooled(&this->upstreams[id].downstream_buffer, &this->pool, BUFFER_SIZE);
+    cb_init_pooled(&this->upstreams[id].upstream_buffer, &this->pool, this->flow_control ? STREAM_WINDOW : BUFFER_SIZE);
+
+    this->local_ids[slot] = id;
+    this->upstreams[id].stream = stream;
+    this->upstreams[id].remove_flag = false;
+    this->upstreams[id].peer_closed = false;
+    this->upstreams[id].send_credit = this->flow_control ? STREAM_WINDOW : UNLIMITED_CREDIT;
+    this->upstreams[id].window_pending = 0;
+    this->upstreams[id].window_queued = false;
+    this->upstreams[id].connecting = false;
+    this->upstreams[id].tunnel = tunnel - this->tunnels;
+    this->upstreams[id].detached = false;
+    this->upstreams[id].next_seq = 0;
+    this->upstreams[id].final_seq = 0;
+    this->upstreams[id].held = NULL;
+    this->upstreams[id].held_bytes = 0;
+    sched_reset_stream(&tunnel->scheduler, id);
+
+    this->upstreams[id].table_index = this->client_count;
+    this->id_table[this->client_count++] = id;
+
+    /* Until the backend answers, the stream's data only goes into the buffer
+     * towards it. */
+    if (!connected) {
+        tm_push_connect(this, id);
+        tm_update_writeable(this, id);
+    }
+}
+
+void interrupt(int unused) {
+    write(STDERR_FILENO, "\nInterrupted. Exiting...\n", sizeof("Interrupted. Exiting...\n"));
+    _exit(EXIT_SUCCESS);
+}
+
+void perform_upstream_io(Terminator* this, size_t ioable_count) {
+    Server* server = &this->server;
+
+    size_t ioable_processed = tunnels_ioable(server);
+
+    for (size_t i = 0; ioable_processed < ioable_count && i < this->client_count; ++i) {
+        const int id = this->id_table[i];
+
+        if (client_ioable(server, id)) {
+            ++ioable_processed;
+        }
+
+        if (this->upstreams[id].connecting && !tm_try_finish_connect(this, id)) continue;
+
+        if (client_has_errors(server, id)) {
+            tm_close_upstream(this, id);
+            continue;
+        }
+
+        if (!cb_full(&this->upstreams[id].downstream_buffer) && client_readable(server, id)) {
+            if (cb_recv(&this->upstreams[id].downstream_buffer, client_fd(server, id)) == -1) {
+                tm_close_upstream(this, id);
+                continue;
+            }
+            tm_update_readable(this, id);
+            if (tm_sendable(this, id) > 0) {
+                sched_activate(&tm_tunnel(this, id)->scheduler, id);
+            }
+        }
+
+        if (!cb_empty(&this->upstreams[id].upstream_buffer) && client_writeable(server, id)) {
+            const ssize_t sent = cb_send(&this->upstreams[id].upstream_buffer, client_fd(server, id));
+            if (sent == -1) {
+                tm_close_upstream(this, id);
+                continue;
+            }
+            tm_return_window(this, id, sent);
+            tm_release_held(this, id);
+            tm_update_writeable(this, id);
+        }
+    }
+}
+
+bool tm_put_event(TMTunnel* tunnel, TPBControlBatch* batch, size_t* budget, char op, int stream, uint64_t operand) {
+    const TPBEvent event = {op, stream, operand};
+    if (tpb_batch_add(batch, &event, *budget)) return true;
+    if (batch->length == 0) return false;
+
+    *budget -= tpb_batch_flush(&tunnel->tpb, batch);
+    return tpb_batch_add(batch, &event, *budget);
+}
+
+bool process_closed(Terminator* this, TMTunnel* tunnel, TPBControlBatch* batch, size_t* budget) {
+    for (int stream; iq_peek(&tunnel->refuse_queue, &stream); iq_pop(&tunnel->refuse_queue)) {
+        if (!tm_put_event(tunnel, batch, budget, CLIENT_REMOVE, stream, 0)) return false;
+    }
+
+    /* Streams closed by the sender are dropped silently, it does not expect
+     * a CLIENT_REMOVE back. */
+    for (size_t left = iq_count(&tunnel->close_queue); left > 0; --left) {
+        int stream;
+        iq_peek(&tunnel->close_queue, &stream);
+
+        const int id = tm_stream_upstream(this, stream);
+        if (id == NO_ID) {
+            iq_pop(&tunnel->close_queue);
+            continue;
+        }
+
+        if (!this->upstreams[id].peer_closed && !cb_empty(&this->upstreams[id].downstream_buffer)) {
+            iq_pop(&tunnel->close_queue);
+            iq_push(&tunnel->close_queue, stream);
+            continue;
+        }
+
+        if (!this->upstreams[id].peer_closed && !tm_put_event(tunnel, batch, budget, CLIENT_REMOVE, stream, 0)) {
+            return false;
+        }
+
+        iq_pop(&tunnel->close_queue);
+        tm_actual_remove(this, id);
+    }
+
+    return true;
+}
+
+bool process_windows(Terminator* this, TMTunnel* tunnel, TPBControlBatch* batch, size_t* budget) {
+    for (int id; iq_peek(&tunnel->window_queue, &id); iq_pop(&tunnel->window_queue)) {
+        if (!this->upstreams[id].window_queued) continue;
+
+        if (!tm_put_event(tunnel, batch, budget, CLIENT_WINDOW, this->upstreams[id].stream,
+                this->upstreams[id].window_pending)) {
+            return false;
+        }
+
+        this->upstreams[id].window_pending = 0;
+        this->upstreams[id].window_queued = false;
+    }
+
+    return true;
+}
+
+bool tm_control_pending(const TMTunnel* tunnel) {
+    return !iq_empty(&tunnel->refuse_queue) || !iq_empty(&tunnel->close_queue) || !iq_empty(&tunnel->window_queue);
+}
+
+/* Control events share the tunnel with the data the same way as in
+ * lab34-sender. */
+void fill_control(Terminator* this, TMTunnel* tunnel) {
+    TPBuffer* tpb = &tunnel->tpb;
+
+    size_t budget = cb_free_space(&tpb->buffer);
+    if (!sched_empty(&tunnel->scheduler)) {
+        budget = min_size_t(budget, max_size_t(budget / CONTROL_SHARE_DIVISOR, CONTROL_MIN_BUDGET));
+    }
+
+    TPBControlBatch batch;
+    tpb_batch_init(tpb, &batch);
+
+    if (process_closed(this, tunnel, &batch, &budget)) {
+        process_windows(this, tunnel, &batch, &budget);
+    }
+
+    tpb_batch_flush(tpb, &batch);
+}
+
+/* Downstream data never changes connection, so it goes unsequenced. */
+bool fill_message(Terminator* this, TMTunnel* tunnel) {
+    fill_control(this, tunnel);
+
+    TPBuffer* tpb = &tunnel->tpb;
+    Scheduler* scheduler = &tunnel->scheduler;
+
+    int id;
+    size_t budget;
+    while ((id = sched_next(scheduler, &budget)) != SCHED_NO_STREAM) {
+        CyclicBuffer* data_buf = &this->upstreams[id].downstream_buffer;
+        const size_t requested = min_size_t(budget, tm_sendable(this, id));
+
+        cb_shift(data_buf);
+        const size_t count = tpb_encapsulate(tpb, cb_data(data_buf), requested, this->upstreams[id].stream, 0);
+        cb_skip(data_buf, count);
+        if (this->flow_control) {
+            this->upstreams[id].send_credit -= count;
+        }
+
+        sched_consume(scheduler, id, count, tm_sendable(this, id) > 0);
+        tm_update_readable(this, id);
+
+        if (count < requested) break;
+    }
+
+    return !sched_empty(scheduler) || tm_control_pending(tunnel);
+}
+
+/* Any connection may carry the events of a stream that moved, CLIENT_ADD
+ * always comes over the one the stream hashes to. */
+void process_control(Terminator* this, const TPBEvent* event) {
+    if (event->stream < 0 || TPB_STREAM_SLOT(event->stream) >= MAX_CLIENTS) return;
+
+    if (event->op == CLIENT_ADD) {
+        tm_open_stream(this, event->stream);
+        return;
+    }
+
+    const int id = tm_stream_upstream(this, event->stream);
+    if (id == NO_ID) return;
+
+    if (event->op == CLIENT_REMOVE) {
+        this->upstreams[id].peer_closed = true;
+        this->upstreams[id].final_seq = event->operand;
+        tm_update_writeable(this, id);
+    } else if (event->op == CLIENT_WINDOW && this->flow_control) {
+        this->upstreams[id].send_credit += event->operand;
+        if (tm_sendable(this, id) > 0) {
+            sched_activate(&tm_tunnel(this, id)->scheduler, id);
+        }
+        tm_update_readable(this, id);
+    }
+}
+
+/* Control frames are decoded as a whole, the reader keeps an event that is
+ * cut by the end of the input until the rest arrives. */
+void process_control_events(Terminator* this, TMTunnel* tunnel) {
+    TPBEvent events[CONTROL_PARSE_EVENTS];
+    for (size_t count; (count = tpb_reader_parse(&tunnel->control, events, CONTROL_PARSE_EVENTS)) > 0; ) {
+        for (size_t i = 0; i < count; ++i) {
+            process_control(this, &events[i]);
+        }
+    }
+}
+
+/* A sequenced frame that is not next in its stream is held back, the rest
+ * goes straight into the upstream buffer and may release held data. */
+bool distribute_message(Terminator* this, TMTunnel* tunnel) {
+    MessageReceiver* mr = &tunnel->mr;
+
+    int order;
+    while ((order = get_current_order(mr)) != MR_NO_ORDER) {
+        ssize_t count;
+        int id;
+
+        if (order == CONTROL_ORDER) {
+            count = decapsulate(mr, tpb_reader_end(&tunnel->control), tpb_reader_space(&tunnel->control));
+            tpb_reader_put(&tunnel->control, count);
+            process_control_events(this, tunnel);
+        } else if ((id = tm_stream_upstream(this, order)) == NO_ID || this->upstreams[id].remove_flag) {
+            count = skip(mr, (size_t) -1);
+        } else if ((get_current_flags(mr) & PR_FLAG_SEQUENCED) && get_current_seq(mr) != this->upstreams[id].next_seq
+            && get_contiguous_count(mr) > 0) {
+            count = tm_hold(this, id, mr);
+        } else {
+            CyclicBuffer* buffer = &this->upstreams[id].upstream_buffer;
+            if (!cb_reserve(buffer)) return false;
+
+            count = decapsulate(mr, cb_data_end(buffer), cb_free_contiguous_space(buffer));
+            cb_skip_right(buffer, count);
+            this->upstreams[id].next_seq += count;
+            tm_release_held(this, id);
+            tm_update_writeable(this, id);
+        }
+
+        if (count == 0 && mr_empty(mr)) break;
+    }
+
+    return true;
+}
+
+/* Same as on the sender: the ring is filled and drained a pass at a time and
+ * the tunnel socket only carries doorbells. */
+void tm_send_shm(Terminator* this, TMTunnel* tunnel) {
+    bool pending;
+    size_t passed = 0;
+
+    do {
+        pending = fill_message(this, tunnel);
+        const ssize_t sent = tpb_send_link(&tunnel->tpb, &this->shm);
+        if (sent == -1) {
+            this->tunnel_lost = true;
+            return;
+        }
+        passed += sent;
+    } while (pending && tpb_empty(&tunnel->tpb) && passed < SHM_PASS_LIMIT);
+
+    if (pending && tpb_empty(&tunnel->tpb)) {
+        notify_server(&this->server);
+    }
+}
+
+void tm_recv_shm(Terminator* this, TMTunnel* tunnel) {
+    MessageReceiver* mr = &tunnel->mr;
+
+    if (tunnel_readable(&this->server, 0) && sl_clear_doorbell(&this->shm) == -1) {
+        this->tunnel_lost = true;
+        return;
+    }
+
+    size_t passed = 0;
+    while (distribute_message(this, tunnel) && !mr_full(mr)) {
+        if (passed >= SHM_PASS_LIMIT) {
+            notify_server(&this->server);
+            break;
+        }
+
+        const ssize_t received = mr_recv_link(mr, &this->shm);
+        if (received == -1) {
+            this->tunnel_lost = true;
+            return;
+        }
+        if (received == 0) break;
+        passed += received;
+    }
+}
+
+void perform_tunnel_io(Terminator* this, size_t t) {
+    Server* server = &this->server;
+    TMTunnel* tunnel = &this->tunnels[t];
+    MessageReceiver* mr = &tunnel->mr;
+
+    const bool pending = fill_message(this, tunnel);
+    if (tunnel_writeable(server, t)) {
+        if (tpb_send(&tunnel->tpb, tunnel_fd(server, t)) == -1) {
+            this->tunnel_lost = true;
+        }
+
+        if (pending && tpb_empty(&tunnel->tpb)) {
+            notify_server(server);
+        }
+    }
+
+    if (!mr_full(mr) && tunnel_readable(server, t)) {
+        if (mr_recv(mr, tunnel_fd(server, t)) == -1) {
+            this->tunnel_lost = true;
+            return;
+        }
+    }
+
+    distribute_message(this, tunnel);
+    set_tunnel_readable(server, t, !mr_full(mr));
+}
+
+void perform_protocol_io(Terminator* this) {
+    if (this->use_shm) {
+        tm_send_shm(this, &this->tunnels[0]);
+        tm_recv_shm(this, &this->tunnels[0]);
+        return;
+    }
+
+    for (size_t t = 0; t < this->tunnel_count && !this->tunnel_lost; ++t) {
+        perform_tunnel_io(this, t);
+    }
+}
+
+bool tm_has_output(const TMTunnel* tunnel) {
+    return !tpb_empty(&tunnel->tpb) || !sched_empty(&tunnel->scheduler) || tm_control_pending(tunnel);
+}
+
+void tm_loop(Terminator* this) {
+    Server* server = &this->server;
+
+    int fd_count;
+    while ((fd_count = wait_server(server, tm_wait_timeout(this))) != -1) {
+        if (any_tunnel_has_errors(server)) break;
+
+        perform_upstream_io(this, fd_count);
+        perform_protocol_io(this);
+        if (this->tunnel_lost) break;
+
+        tm_expire_connects(this);
+
+        for (size_t t = 0; t < this->tunnel_count; ++t) {
+            set_tunnel_writeable(server, t, !this->use_shm && tm_has_output(&this->tunnels[t]));
+        }
+    }
+
+    if (fd_count == -1) {
+        perror("epoll_wait");
+    }
+    fprintf(stderr, "Tunnel closed\n");
+}
+
+/* A striped session collects its connections here. The thread of the last
+ * one to join runs the session, the others are done once they handed their
+ * connection over. */
+typedef struct {
+    bool used;
+    uint32_t session;
+    size_t tunnel_count;
+    size_t joined;
+    int fds[HS_MAX_TUNNELS];
+    PRFormat format;
+    int features;
+    long deadline;
+} TMPendingSession;
+
+static TMPendingSession pending_sessions[MAX_PENDING_SESSIONS];
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void tm_drop_pending(TMPendingSession* pending) {
+    for (size_t i = 0; i < pending->tunnel_count; ++i) {
+        if (pending->fds[i] != -1) {
+            close(pending->fds[i]);
+        }
+    }
+    pending->used = false;
+}
+
+/* Sessions whose connections did not all come in time are dropped the next
+ * time anyone joins. */
+TMPendingSession* tm_find_pending(const HSJoin* join) {
+    const long now = now_ms();
+    TMPendingSession* found = NULL;
+    TMPendingSession* unused = NULL;
+
+    for (size_t i = 0; i < MAX_PENDING_SESSIONS; ++i) {
+        TMPendingSession* pending = &pending_sessions[i];
+        if (pending->used && pending->deadline <= now) {
+            fprintf(stderr, "Striped session timed out\n");
+            tm_drop_pending(pending);
+        }
+
+        if (pending->used && pending->session == join->session) {
+            found = pending;
+        } else if (!pending->used && unused == NULL) {
+            unused = pending;
+        }
+    }
+    if (found != NULL || unused == NULL) return found;
+
+    unused->used = true;
+    unused->session = join->session;
+    unused->tunnel_count = join->tunnel_count;
+    unused->joined = 0;
+    unused->deadline = now + SESSION_JOIN_TIMEOUT;
+    for (size_t i = 0; i < HS_MAX_TUNNELS; ++i) {
+        unused->fds[i] = -1;
+    }
+    return unused;
+}
+
+/* Returns the number of connections once the session is complete, they are
+ * then in fds ordered by their place in the session. Returns 0 while more
+ * are due and -1 if the connection does not fit the session, both with the
+ * connection taken care of. */
+int tm_join_session(const HSJoin* join, int fd, PRFormat format, int features, int* fds) {
+    pthread_mutex_lock(&sessions_lock);
+
+    TMPendingSession* pending = tm_find_pending(join);
+    if (pending == NULL) {
+        pthread_mutex_unlock(&sessions_lock);
+        fprintf(stderr, "Too many striped sessions pending\n");
+        close(fd);
+        return -1;
+    }
+
+    if (pending->joined == 0) {
+        pending->format = format;
+        pending->features = features;
+    }
+
+    if (pending->tunnel_count != join->tunnel_count || pending->fds[join->tunnel] != -1
+        || pending->format != format || pending->features != features) {
+        tm_drop_pending(pending);
+        pthread_mutex_unlock(&sessions_lock);
+        fprintf(stderr, "Striped session connections do not match\n");
+        close(fd);
+        return -1;
+    }
+
+    pending->fds[join->tunnel] = fd;
+    if (++pending->joined < pending->tunnel_count) {
+        pthread_mutex_unlock(&sessions_lock);
+        return 0;
+    }
+
+    const int count = pending->tunnel_count;
+    memcpy(fds, pending->fds, count * sizeof(*fds));
+    pending->used = false;
+    pthread_mutex_unlock(&sessions_lock);
+    return count;
+}
+
+typedef struct {
+    int tunnel_fd;
+    SocketAddress backend;
+} SessionParams;
+
+/* Every accepted connection is negotiated by a thread of its own. A plain
+ * tunnel is a session by itself, the connections of a striped one are
+ * gathered first. */
+void* tm_session(void* arg) {
+    SessionParams params = *(SessionParams*) arg;
+    free(arg);
+
+    int features = HS_SUPPORTED_FEATURES;
+    if (!is_local_socket(params.tunnel_fd)) {
+        features &= ~HS_FEATURE_SHARED_MEMORY;
+    }
+    const PRFormat format = hs_accept(params.tunnel_fd, HS_SUPPORTED_FORMATS, &features, HANDSHAKE_TIMEOUT);
+
+    int fds[HS_MAX_TUNNELS] = {params.tunnel_fd};
+    int count = 1;
+    if (features & HS_FEATURE_STRIPING) {
+        HSJoin join;
+        if (format != PR_FORMAT_LENGTH || !hs_wait_join(params.tunnel_fd, &join, HANDSHAKE_TIMEOUT)) {
+            fprintf(stderr, "Striped tunnel connection did not join\n");
+            close(params.tunnel_fd);
+            return NULL;
+        }
+
+        count = tm_join_session(&join, params.tunnel_fd, format, features, fds);
+        if (count <= 0) return NULL;
+    }
+
+    Terminator* terminator = malloc(sizeof(*terminator));
+    if (terminator == NULL) {
+        perror("malloc");
+        for (int i = 0; i < count; ++i) {
+            close(fds[i]);
+        }
+        return NULL;
+    }
+
+    if (init_terminator(terminator, fds, count, format, features, &params.backend) == EXIT_SUCCESS) {
+        tm_loop(terminator);
+        tm_cleanup(terminator);
+    }
+
+    free(terminator);
+    return NULL;
+}
+
+int start_session(int tunnel_fd, const SocketAddress* backend) {
+    SessionParams* params = malloc(sizeof(*params));
+    if (params == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    params->tunnel_fd = tunnel_fd;
+    params->backend = *backend;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    const int err_code = pthread_create(&thread, &attr, tm_session, params);
+    pthread_attr_destroy(&attr);
+
+    if (err_code != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+        free(params);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Tunnels come in over TCP and, for a sender on the same host, over the
+ * optional UNIX socket, where they may move to a shared memory link. */
+int accept_loop(struct pollfd* listeners, size_t count, const SocketAddress* backend) {
+    for (;;) {
+        if (poll(listeners, count, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            if (!(listeners[i].revents & POLLIN)) continue;
+
+            const int tunnel_fd = accept(listeners[i].fd, NULL, NULL);
+            if (tunnel_fd == -1) {
+                perror("accept");
+                continue;
+            }
+
+            if (start_session(tunnel_fd, backend) == EXIT_FAILURE) {
+                close(tunnel_fd);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        close(listeners[i].fd);
+    }
+    return EXIT_FAILURE;
+}
+
+int parse_params(SocketAddress* listener, SocketAddress* local_listener, SocketAddress* backend, int argc, char* argv[]) {
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "Usage: %s TUNNEL_PORT BACKEND_ADDR BACKEND_PORT [SOCKET_PATH]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    local_listener->length = 0;
+    if (argc == 5 && parse_unix_address(local_listener, argv[4]) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    if (parse_address(backend, argv[2], argv[3]) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    char* end;
+    const in_port_t tunnel_port = strtol(argv[1], &end, 10);
+    if (*end != '\0' || tunnel_port < 0) {
+        fprintf(stderr, "TUNNEL_PORT must be a positive integer\n");
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_in addr_in;
+    init_addr_in(&addr_in, htonl(INADDR_LOOPBACK), htons(tunnel_port), AF_INET);
+    memcpy(&listener->address, &addr_in, sizeof(addr_in));
+    listener->length = sizeof(addr_in);
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+    SocketAddress listener;
+    SocketAddress local_listener;
+    SocketAddress backend;
+    if (parse_params(&listener, &local_listener, &backend, argc, argv) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction act = {};
+    act.sa_handler = interrupt;
+    sigaction(SIGINT, &act, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pr_current_impl();
+
+    struct pollfd listeners[2] = {{.events = POLLIN}, {.events = POLLIN}};
+    size_t listener_count = 1;
+
+    listeners[0].fd = server_setup(&listener, TUNNEL_BACKLOG);
+    if (listeners[0].fd == ERR_SOCKET) {
+        return EXIT_FAILURE;
+    }
+
+    if (local_listener.length != 0) {
+        unlink(argv[4]);
+        listeners[1].fd = server_setup(&local_listener, TUNNEL_BACKLOG);
+        if (listeners[1].fd == ERR_SOCKET) {
+            close(listeners[0].fd);
+            return EXIT_FAILURE;
+        }
+        listener_count = 2;
+    }
+
+    return accept_loop(listeners, listener_count, &backend);
+}
@@ -0,0 +1,171 @@
+#include "lz.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_NIBBLE_MAX 15
+#define LZ_SKIP_SHIFT 5
+
+/* Every block is a sequence of tokens: the high nibble of the token byte is
+ * the literal count and the low one the match length minus LZ_MIN_MATCH, both
+ * continued with 255-terminated extension bytes when they reach 15. Literals
+ * follow, then a 16 bit little endian offset and the match extension. The
+ * last token carries literals only. */
+
+size_t lz_bound(size_t src_len) {
+    return src_len + src_len / 255 + 16;
+}
+
+static uint32_t lz_hash(const unsigned char* data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static size_t lz_length_bytes(size_t length) {
+    return length < LZ_NIBBLE_MAX ? 0 : (length - LZ_NIBBLE_MAX) / 255 + 1;
+}
+
+static size_t lz_put_length(unsigned char* out, size_t length) {
+    size_t written = 0;
+    for (length -= LZ_NIBBLE_MAX; length >= 255; length -= 255) {
+        out[written++] = 255;
+    }
+    out[written++] = (unsigned char) length;
+    return written;
+}
+
+/* Writes one sequence, a match length of 0 marks the last one. Returns the
+ * new output position or 0 if it does not fit. */
+static size_t lz_put_sequence(unsigned char* out, size_t out_pos, size_t out_len,
+    const unsigned char* literals, size_t literal_count, size_t offset, size_t match_length) {
+    const size_t match_code = match_length == 0 ? 0 : match_length - LZ_MIN_MATCH;
+    const size_t needed = 1 + lz_length_bytes(literal_count) + literal_count
+        + (match_length == 0 ? 0 : 2 + lz_length_bytes(match_code));
+    if (out_len - out_pos < needed) return 0;
+
+    unsigned char* token = &out[out_pos++];
+    *token = (literal_count < LZ_NIBBLE_MAX ? literal_count : LZ_NIBBLE_MAX) << 4;
+    if (literal_count >= LZ_NIBBLE_MAX) {
+        out_pos += lz_put_length(&out[out_pos], literal_count);
+    }
+
+    memcpy(&out[out_pos], literals, literal_count);
+    out_pos += literal_count;
+
+    if (match_length == 0) return out_pos;
+
+    out[out_pos++] = offset & 0xFF;
+    out[out_pos++] = offset >> 8;
+
+    *token |= match_code < LZ_NIBBLE_MAX ? match_code : LZ_NIBBLE_MAX;
+    if (match_code >= LZ_NIBBLE_MAX) {
+        out_pos += lz_put_length(&out[out_pos], match_code);
+    }
+
+    return out_pos;
+}
+
+/* Returns the compressed length or 0 if the result does not fit into dst. */
+size_t lz_compress(const char* src, size_t src_len, char* dst, size_t dst_len) {
+    if (src_len > LZ_MAX_BLOCK) return 0;
+
+    const unsigned char* in = (const unsigned char*) src;
+    unsigned char* out = (unsigned char*) dst;
+
+    uint16_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t out_pos = 0;
+    size_t anchor = 0;
+    size_t misses = 0;
+
+    for (size_t i = 0; i + LZ_MIN_MATCH <= src_len; ) {
+        const uint32_t hash = lz_hash(&in[i]);
+        const size_t candidate = table[hash];
+        table[hash] = (uint16_t) i;
+
+        if (candidate >= i || i - candidate > LZ_MAX_OFFSET
+            || memcmp(&in[candidate], &in[i], LZ_MIN_MATCH) != 0) {
+            /* Incompressible input is skipped through faster and faster. */
+            i += 1 + (misses++ >> LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        size_t length = LZ_MIN_MATCH;
+        while (i + length < src_len && in[candidate + length] == in[i + length]) {
+            length++;
+        }
+
+        out_pos = lz_put_sequence(out, out_pos, dst_len, &in[anchor], i - anchor, i - candidate, length);
+        if (out_pos == 0) return 0;
+
+        i += length;
+        anchor = i;
+        misses = 0;
+    }
+
+    return lz_put_sequence(out, out_pos, dst_len, &in[anchor], src_len - anchor, 0, 0);
+}
+
+static bool lz_get_length(const unsigned char* in, size_t in_len, size_t* in_pos, size_t* length) {
+    if (*length != LZ_NIBBLE_MAX) return true;
+
+    unsigned char byte;
+    do {
+        if (*in_pos == in_len) return false;
+        byte = in[(*in_pos)++];
+        *length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+/* Returns the decompressed length or -1 if the block is malformed or does not
+ * fit into dst. */
+ssize_t lz_decompress(const char* src, size_t src_len, char* dst, size_t dst_len) {
+    const unsigned char* in = (const unsigned char*) src;
+    unsigned char* out = (unsigned char*) dst;
+
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+
+    while (in_pos < src_len) {
+        const unsigned char token = in[in_pos++];
+
+        size_t literal_count = token >> 4;
+        if (!lz_get_length(in, src_len, &in_pos, &literal_count)) return -1;
+        if (literal_count > src_len - in_pos || literal_count > dst_len - out_pos) return -1;
+
+        memcpy(&out[out_pos], &in[in_pos], literal_count);
+        in_pos += literal_count;
+        out_pos += literal_count;
+
+        if (in_pos == src_len) break;
+        if (src_len - in_pos < 2) return -1;
+
+        const size_t offset = in[in_pos] | (in[in_pos + 1] << 8);
+        in_pos += 2;
+        if (offset == 0 || offset > out_pos) return -1;
+
+        size_t length = token & LZ_NIBBLE_MAX;
+        if (!lz_get_length(in, src_len, &in_pos, &length)) return -1;
+        length += LZ_MIN_MATCH;
+        if (length > dst_len - out_pos) return -1;
+
+        const unsigned char* match = &out[out_pos - offset];
+        if (offset >= length) {
+            memcpy(&out[out_pos], match, length);
+        } else {
+            for (size_t i = 0; i < length; ++i) {
+                out[out_pos + i] = match[i];
+            }
+        }
+        out_pos += length;
+    }
+
+    return out_pos;
+}
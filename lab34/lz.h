@@ -0,0 +1,16 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <unistd.h>
+
+/* Offsets are 16 bit, so a block never references more than 64 KiB back. */
+#define LZ_MAX_BLOCK (1 << 16)
+#define LZ_MIN_MATCH 4
+
+size_t lz_bound(size_t src_len);
+
+size_t lz_compress(const char* src, size_t src_len, char* dst, size_t dst_len);
+ssize_t lz_decompress(const char* src, size_t src_len, char* dst, size_t dst_len);
+
+#endif // !LZ_H
@@ -1,12 +1,13 @@
 #include "message_receiver.h"
 
-#include <string.h>
+#include "lz.h"
+#include "utils.h"
 
-#define MESSAGE_EDGE 0x7E
-#define MESSAGE_ESCAPE 0b01111101
+#include <string.h>
 
 void free_messagerecv(MessageReceiver* this) {
     free_iobuf(&this->message);
+    free_iobuf(&this->inflated);
 }
 
 void init_mr(MessageReceiver* this, size_t size) {
@@ -14,115 +15,277 @@ void init_mr(MessageReceiver* this, size_t size) {
     init_iobuf(&this->message, size);
 }
 
+void mr_set_format(MessageReceiver* this, PRFormat format) {
+    this->format = format;
+}
+
+/* Compressed batches are only understood in the length format and have to
+ * fit into the receive buffer as a whole. */
+void mr_enable_compression(MessageReceiver* this) {
+    if (this->inflated.buf == NULL) {
+        init_iobuf(&this->inflated, PR_COMPRESS_LIMIT);
+    }
+}
+
+size_t mr_count(const MessageReceiver* this) {
+    return this->message.count;
+}
+
 bool mr_full(const MessageReceiver* this) {
-    return iob_full(&this->message);
+    return mr_count(this) == this->message.size;
+}
+
+static bool mr_inflating(const MessageReceiver* this) {
+    return !iob_empty(&this->inflated);
 }
 
 bool mr_empty(const MessageReceiver* this) {
-    return iob_empty(&this->message);
+    return mr_count(this) == 0 && !mr_inflating(this);
 }
 
-#include <stdio.h>
+/* The decoder reads from an inflated batch while there is one and from the
+ * received bytes otherwise. */
+static const char* input_data(const MessageReceiver* this) {
+    if (mr_inflating(this)) return iob_data(&this->inflated);
+    return iob_data(&this->message);
+}
 
-bool try_skip_start(MessageReceiver* this) {
-    if (this->started) return true;
-    if (mr_empty(this)) return false;
+static size_t input_count(const MessageReceiver* this) {
+    if (mr_inflating(this)) return this->inflated.count;
+    return mr_count(this);
+}
 
-    iob_shift(&this->message, 1);
-    this->started = true;
-    return true;
+static void input_consume(MessageReceiver* this, size_t count) {
+    iob_shift(mr_inflating(this) ? &this->inflated : &this->message, count);
 }
 
-#define MESSAGE_BOUNDARY (-2)
+ssize_t mr_recv(MessageReceiver* this, int fd) {
+    return iob_recv(&this->message, fd);
+}
 
-int try_read_char(MessageReceiver* this) {
-    if (mr_empty(this)) return END_OF_BUFFER;
+ssize_t mr_recv_link(MessageReceiver* this, ShmLink* link) {
+    const char* data;
+    const ssize_t available = sl_peek(link, &data);
+    if (available <= 0) return available;
 
-    IOBuffer* msg = &this->message;
+    const size_t count = mr_puts(this, data, available);
+    sl_consume(link, count);
+    return count;
+}
 
-    const char c = iob_getc(msg);
-    if (this->escape) {
-        this->escape = false;
-        return c;
-    }
+size_t mr_puts(MessageReceiver* this, const char* data, size_t count) {
+    return iob_puts(&this->message, data, count);
+}
 
-    if (c == MESSAGE_ESCAPE) {
-        this->escape = true;
-        if (mr_empty(this)) return END_OF_BUFFER;
+static bool try_skip_start(MessageReceiver* this) {
+    if (this->started) return true;
 
-        this->escape = false;
-        return iob_getc(msg);
+    const size_t edge = pr_find_special(input_data(this), input_count(this));
+    for (size_t i = edge; i < input_count(this); ++i) {
+        if (input_data(this)[i] == MESSAGE_EDGE) {
+            input_consume(this, i + 1);
+            this->started = true;
+            this->escape = false;
+            return true;
+        }
     }
 
-    if (c == MESSAGE_EDGE) {
-        if (this->started) {
-            this->started = false;
-            this->order_got = false;
+    input_consume(this, input_count(this));
+    return false;
+}
+
+static void end_message(MessageReceiver* this) {
+    this->started = false;
+    this->order_got = false;
+    this->escape = false;
+    this->order_wire = 0;
+    this->order_shift = 0;
+}
+
+static void inflate_batch(MessageReceiver* this, const char* payload, size_t length) {
+    uint64_t batch_length;
+    const size_t varint_length = pr_get_varint(payload, length, &batch_length);
+    if (varint_length == 0 || batch_length > this->inflated.size) return;
+
+    const ssize_t inflated = lz_decompress(&payload[varint_length], length - varint_length,
+        this->inflated.buf, this->inflated.size);
+    if (inflated != (ssize_t) batch_length) return;
+
+    this->inflated.start = 0;
+    this->inflated.count = inflated;
+}
+
+static int try_parse_header(MessageReceiver* this) {
+    for (;;) {
+        const char* input = input_data(this);
+        if (input_count(this) < 2) return MR_NO_ORDER;
+
+        uint64_t wire;
+        const size_t order_length = pr_get_varint(input, input_count(this), &wire);
+        if (order_length == 0 || order_length + 1 >= input_count(this)) return MR_NO_ORDER;
+
+        const int flags = (unsigned char) input[order_length];
+        size_t header_length = order_length + 1;
+
+        uint64_t seq = 0;
+        if (flags & PR_FLAG_SEQUENCED) {
+            const size_t seq_length = pr_get_varint(&input[header_length], input_count(this) - header_length, &seq);
+            if (seq_length == 0) return MR_NO_ORDER;
+            header_length += seq_length;
         }
 
-        return MESSAGE_BOUNDARY;
-    }
+        uint64_t length;
+        const size_t varint_length = pr_get_varint(&input[header_length], input_count(this) - header_length, &length);
+        if (varint_length == 0) return MR_NO_ORDER;
+        header_length += varint_length;
+
+        if ((flags & PR_FLAG_COMPRESSED) == 0 || this->inflated.buf == NULL || mr_inflating(this)) {
+            this->order = pr_order_from_wire(wire);
+            this->flags = flags;
+            this->seq = seq;
+            this->frame_left = length;
+            this->order_got = true;
 
-    return c;
+            input_consume(this, header_length);
+            return this->order;
+        }
+
+        if (input_count(this) - header_length < length) return MR_NO_ORDER;
+
+        inflate_batch(this, &input[header_length], length);
+        iob_shift(&this->message, header_length + length);
+    }
 }
 
-int try_parse_order(MessageReceiver* this) {
+static int try_parse_order(MessageReceiver* this) {
     if (this->order_got) return this->order;
+    if (this->format == PR_FORMAT_LENGTH) return try_parse_header(this);
+
+    while (try_skip_start(this) && input_count(this) != 0) {
+        const char c = input_data(this)[0];
+        input_consume(this, 1);
 
-    if (!try_skip_start(this)) return MR_NO_ORDER;
+        if (!this->escape && c == MESSAGE_ESCAPE) {
+            this->escape = true;
+            continue;
+        }
+
+        if (!this->escape && c == MESSAGE_EDGE) {
+            this->order_wire = 0;
+            this->order_shift = 0;
+            continue;
+        }
 
-    const int order = try_read_char(this);
-    if (order == MESSAGE_BOUNDARY || order == END_OF_BUFFER) {
-        return MR_NO_ORDER;
+        this->escape = false;
+        if (this->order_shift < 64) {
+            this->order_wire |= (uint64_t) (c & 0x7F) << this->order_shift;
+        }
+        this->order_shift += 7;
+        if (c & 0x80) continue;
+
+        this->order = pr_order_from_wire(this->order_wire);
+        this->order_got = true;
+        this->order_wire = 0;
+        this->order_shift = 0;
+        return this->order;
     }
 
-    this->order = order;
-    this->order_got = true;
-    return order;
+    return MR_NO_ORDER;
 }
 
 int get_current_order(MessageReceiver* this) {
    return try_parse_order(this);
 }
 
-size_t get_contiguous_count(MessageReceiver* this) {
+int get_current_flags(MessageReceiver* this) {
     if (try_parse_order(this) == MR_NO_ORDER) return 0;
-    char* buffer = this->message.buf;
-    const size_t buf_len = this->message.count;
-
-    bool escaped = this->escape;
-    size_t count = 0;
-    for (size_t i = 0; i < buf_len; ++i) {
-        if (!escaped && buffer[i] == MESSAGE_ESCAPE) {
-            escaped = true;
-            continue;
-        }
+    return this->flags;
+}
+
+/* The stream offset of the next payload byte of a sequenced frame. */
+uint64_t get_current_seq(MessageReceiver* this) {
+    return this->seq;
+}
 
-        escaped = false;
-        count++;
+static size_t copy_run(MessageReceiver* this, char* data, size_t count, bool* complete) {
+    const size_t run = min_size_t(min_size_t(this->frame_left, count), input_count(this));
+    if (data != NULL) {
+        memcpy(data, input_data(this), run);
     }
+    input_consume(this, run);
+    this->frame_left -= run;
+    this->seq += run;
 
+    *complete = this->frame_left == 0;
+    if (*complete) {
+        end_message(this);
+    }
+    return run;
+}
+
+/* Decodes the current frame into data (or drops it if data is NULL) until count
+ * bytes are produced, the input runs out or the closing edge is consumed. */
+static size_t decode_run(MessageReceiver* this, char* data, size_t count, bool* complete) {
+    if (this->format == PR_FORMAT_LENGTH) return copy_run(this, data, count, complete);
+
+    size_t decoded;
+    const size_t consumed = pr_decapsulate(input_data(this), input_count(this), data, count,
+        &decoded, &this->escape, complete);
+    input_consume(this, consumed);
+
+    if (*complete) {
+        end_message(this);
+    }
+    return decoded;
+}
+
+size_t get_contiguous_count(MessageReceiver* this) {
+    if (try_parse_order(this) == MR_NO_ORDER) return 0;
+    if (this->format == PR_FORMAT_LENGTH) return min_size_t(this->frame_left, input_count(this));
+
+    /* A dry run of the decoder on a copy of the escape state. */
+    bool escape = this->escape;
+    bool edge;
+    size_t count;
+    pr_decapsulate(input_data(this), input_count(this), NULL, SIZE_MAX, &count, &escape, &edge);
     return count;
 }
 
 ssize_t decapsulate(MessageReceiver* this, char* data, size_t count) {
     if (try_parse_order(this) == MR_NO_ORDER) return -1;
 
-    size_t read_count = 0;
-    int c;
-    while (read_count < count && (c = try_read_char(this)) >= 0) {
-        data[read_count++] = c;
-    }
-
-    return read_count;
+    bool complete;
+    return decode_run(this, data, count, &complete);
 }
 
 ssize_t skip(MessageReceiver* this, size_t count) {
     if (try_parse_order(this) == MR_NO_ORDER) return -1;
 
-    size_t skipped = 0;
-    while (skipped < count && try_read_char(this) >= 0)
-        ;
+    bool complete;
+    return decode_run(this, NULL, count, &complete);
+}
+
+size_t mr_decode_ranges(MessageReceiver* this, char* data, size_t count, MRRange* ranges, size_t max_ranges) {
+    size_t range_count = 0;
+    size_t decoded = 0;
+
+    while (range_count < max_ranges && decoded < count) {
+        const int order = try_parse_order(this);
+        if (order == MR_NO_ORDER) break;
+
+        MRRange* range = &ranges[range_count++];
+        range->order = order;
+        range->offset = decoded;
+        range->length = decode_run(this, &data[decoded], count - decoded, &range->complete);
+        decoded += range->length;
+
+        if (!range->complete) {
+            if (range->length == 0) {
+                range_count--;
+            }
+            break;
+        }
+    }
 
-    return skipped;
+    return range_count;
 }
@@ -2,26 +2,55 @@
 #define MESSAGE_RECEIVER_H
 
 #include "iobuffer.h"
+#include "protocol.h"
+#include "shm_link.h"
 
 #define MR_NO_ORDER (-1)
 
 typedef struct {
     IOBuffer message;
-    char order;
+    PRFormat format;
+
+    IOBuffer inflated;
+
+    int order;
+    int flags;
+    uint64_t seq;
+    size_t frame_left;
     bool started;
     bool escape;
     bool order_got;
+
+    uint64_t order_wire;
+    unsigned order_shift;
 } MessageReceiver;
 
+typedef struct {
+    int order;
+    size_t offset;
+    size_t length;
+    bool complete;
+} MRRange;
+
 void free_messagerecv(MessageReceiver* this);
 void init_mr(MessageReceiver* this, size_t size);
+void mr_set_format(MessageReceiver* this, PRFormat format);
+void mr_enable_compression(MessageReceiver* this);
 
 bool mr_full(const MessageReceiver* this);
 bool mr_empty(const MessageReceiver* this);
+size_t mr_count(const MessageReceiver* this);
+ssize_t mr_recv(MessageReceiver* this, int fd);
+ssize_t mr_recv_link(MessageReceiver* this, ShmLink* link);
+size_t mr_puts(MessageReceiver* this, const char* data, size_t count);
 
 int get_current_order(MessageReceiver* this);
+int get_current_flags(MessageReceiver* this);
+uint64_t get_current_seq(MessageReceiver* this);
 size_t get_contiguous_count(MessageReceiver* this);
 ssize_t decapsulate(MessageReceiver* this, char* data, size_t count);
 ssize_t skip(MessageReceiver* this, size_t count);
 
+size_t mr_decode_ranges(MessageReceiver* this, char* data, size_t count, MRRange* ranges, size_t max_ranges);
+
 #endif // !MESSAGE_RECEIVER_H
@@ -1,6 +1,18 @@
 #include "protocol.h"
 
-size_t message_length(char* data, size_t data_len) {
+#include <string.h>
+#include <limits.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PR_X86
+#include <immintrin.h>
+#endif // __x86_64__ || __i386__
+
+bool pr_need_escape(char c) {
+    return c == MESSAGE_EDGE || c == MESSAGE_ESCAPE;
+}
+
+size_t message_length_scalar(const char* data, size_t data_len) {
     size_t length = 0;
     for (size_t i = 0; i < data_len; ++i) {
         length++;
@@ -8,9 +20,10 @@ size_t message_length(char* data, size_t data_len) {
             length++;
         }
     }
+    return length;
 }
 
-size_t pr_encapsulate(char* data, size_t data_len, char* message, size_t message_len) {
+size_t pr_encapsulate_scalar(const char* data, size_t data_len, char* message, size_t message_len, size_t* written) {
     size_t data_index = 0;
     size_t message_index = 0;
     for (; data_index < data_len && message_index < message_len; data_index++) {
@@ -24,5 +37,391 @@ size_t pr_encapsulate(char* data, size_t data_len, char* message, size_t message
         message[message_index++] = c;
     }
 
+    *written = message_index;
     return data_index;
 }
+
+static size_t find_special_scalar(const char* data, size_t data_len) {
+    for (size_t i = 0; i < data_len; ++i) {
+        if (pr_need_escape(data[i])) return i;
+    }
+    return data_len;
+}
+
+static size_t count_special_scalar(const char* data, size_t data_len) {
+    return message_length_scalar(data, data_len) - data_len;
+}
+
+size_t pr_decapsulate_scalar(const char* message, size_t message_len, char* data, size_t data_len,
+    size_t* decoded, bool* escape, bool* edge) {
+    size_t message_index = 0;
+    size_t data_index = 0;
+    *edge = false;
+    while (message_index < message_len && data_index < data_len) {
+        if (*escape) {
+            if (data != NULL) {
+                data[data_index] = message[message_index];
+            }
+            data_index++;
+            message_index++;
+            *escape = false;
+            continue;
+        }
+
+        const size_t left = message_len - message_index;
+        const size_t space = data_len - data_index;
+        const size_t available = left < space ? left : space;
+        const size_t run = find_special_scalar(&message[message_index], available);
+        if (data != NULL) {
+            memcpy(&data[data_index], &message[message_index], run);
+        }
+        data_index += run;
+        message_index += run;
+
+        if (run == available) continue;
+
+        if (message[message_index++] == MESSAGE_EDGE) {
+            *edge = true;
+            break;
+        }
+        *escape = true;
+    }
+
+    *decoded = data_index;
+    return message_index;
+}
+
+#ifdef PR_X86
+
+/* A block with more than width / DENSE_BLOCK_FRACTION specials is expanded
+ * byte by byte. */
+#define DENSE_BLOCK_FRACTION 8
+
+/* Runs between specials are short in dense input, a call to memcpy would
+ * cost more than the bytes it moves. */
+static inline __attribute__((always_inline)) void copy_bytes(char* to, const char* from, size_t count) {
+    if (count >= 16) {
+        memcpy(to, from, count);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        to[i] = from[i];
+    }
+}
+
+/* Escapes width bytes at a time: the mask of a block is taken once, then a
+ * sparse block copies the runs between its specials and a dense one expands
+ * every byte without branching, since there the ctz loop costs more than the
+ * byte loop. Blocks are only taken while the message has room for the worst
+ * case, the scalar loop finishes the rest. */
+static inline __attribute__((always_inline)) size_t encapsulate_blocks(unsigned (*special_mask)(const char*),
+    size_t width, const char* data, size_t data_len, char* message, size_t message_len, size_t* written) {
+    size_t data_index = 0;
+    size_t message_index = 0;
+    for (; data_index + width <= data_len && message_index + 2 * width <= message_len; data_index += width) {
+        const char* block = &data[data_index];
+        unsigned mask = special_mask(block);
+
+        if (mask == 0) {
+            memcpy(&message[message_index], block, width);
+            message_index += width;
+            continue;
+        }
+
+        if ((size_t) __builtin_popcount(mask) > width / DENSE_BLOCK_FRACTION) {
+            for (size_t i = 0; i < width; ++i) {
+                const size_t escape = (mask >> i) & 1;
+                message[message_index] = MESSAGE_ESCAPE;
+                message[message_index + escape] = block[i];
+                message_index += 1 + escape;
+            }
+            continue;
+        }
+
+        size_t copied = 0;
+        for (; mask != 0; mask &= mask - 1) {
+            const size_t special = __builtin_ctz(mask);
+            copy_bytes(&message[message_index], &block[copied], special - copied);
+            message_index += special - copied;
+            message[message_index++] = MESSAGE_ESCAPE;
+            message[message_index++] = block[special];
+            copied = special + 1;
+        }
+
+        if (copied < width) {
+            copy_bytes(&message[message_index], &block[copied], width - copied);
+            message_index += width - copied;
+        }
+    }
+
+    size_t tail_written;
+    data_index += pr_encapsulate_scalar(&data[data_index], data_len - data_index,
+        &message[message_index], message_len - message_index, &tail_written);
+    *written = message_index + tail_written;
+    return data_index;
+}
+
+/* The counterpart of encapsulate_blocks: the runs between the specials of a
+ * block are copied straight from its mask, an escape takes the byte after it
+ * with it. A block is only taken while it fits the output as a whole and no
+ * escape is pending from the previous one. */
+static inline __attribute__((always_inline)) size_t decapsulate_blocks(unsigned (*special_mask)(const char*),
+    size_t width, const char* message, size_t message_len, char* data, size_t data_len,
+    size_t* decoded, bool* escape, bool* edge) {
+    size_t message_index = 0;
+    size_t data_index = 0;
+    for (; !*escape && message_index + width <= message_len && data_index + width <= data_len;
+        message_index += width) {
+        const char* block = &message[message_index];
+        unsigned mask = special_mask(block);
+
+        if (mask == 0) {
+            if (data != NULL) {
+                memcpy(&data[data_index], block, width);
+            }
+            data_index += width;
+            continue;
+        }
+
+        size_t copied = 0;
+        for (; mask != 0; mask &= mask - 1) {
+            const size_t special = __builtin_ctz(mask);
+            if (data != NULL) {
+                copy_bytes(&data[data_index], &block[copied], special - copied);
+            }
+            data_index += special - copied;
+
+            if (block[special] == MESSAGE_EDGE) {
+                *decoded = data_index;
+                *edge = true;
+                return message_index + special + 1;
+            }
+
+            if (special + 1 == width) {
+                *escape = true;
+                copied = width;
+                break;
+            }
+
+            if (data != NULL) {
+                data[data_index] = block[special + 1];
+            }
+            data_index++;
+            copied = special + 2;
+            mask &= ~(1u << (special + 1));
+        }
+
+        if (data != NULL) {
+            copy_bytes(&data[data_index], &block[copied], width - copied);
+        }
+        data_index += width - copied;
+    }
+
+    size_t tail_decoded;
+    message_index += pr_decapsulate_scalar(&message[message_index], message_len - message_index,
+        data == NULL ? NULL : &data[data_index], data_len - data_index, &tail_decoded, escape, edge);
+    *decoded = data_index + tail_decoded;
+    return message_index;
+}
+
+__attribute__((target("sse2")))
+static unsigned special_mask_sse2(const char* data) {
+    const __m128i block = _mm_loadu_si128((const __m128i*) data);
+    const __m128i edges = _mm_cmpeq_epi8(block, _mm_set1_epi8(MESSAGE_EDGE));
+    const __m128i escapes = _mm_cmpeq_epi8(block, _mm_set1_epi8(MESSAGE_ESCAPE));
+    return _mm_movemask_epi8(_mm_or_si128(edges, escapes));
+}
+
+__attribute__((target("sse2")))
+static size_t find_special_sse2(const char* data, size_t data_len) {
+    size_t i = 0;
+    for (; i + 16 <= data_len; i += 16) {
+        const unsigned mask = special_mask_sse2(&data[i]);
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return i + find_special_scalar(&data[i], data_len - i);
+}
+
+__attribute__((target("sse2,popcnt")))
+static size_t count_special_sse2(const char* data, size_t data_len) {
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= data_len; i += 16) {
+        count += __builtin_popcount(special_mask_sse2(&data[i]));
+    }
+    return count + count_special_scalar(&data[i], data_len - i);
+}
+
+__attribute__((target("sse2,popcnt")))
+static size_t encapsulate_sse2(const char* data, size_t data_len, char* message, size_t message_len, size_t* written) {
+    return encapsulate_blocks(special_mask_sse2, 16, data, data_len, message, message_len, written);
+}
+
+__attribute__((target("sse2")))
+static size_t decapsulate_sse2(const char* message, size_t message_len, char* data, size_t data_len,
+    size_t* decoded, bool* escape, bool* edge) {
+    return decapsulate_blocks(special_mask_sse2, 16, message, message_len, data, data_len, decoded, escape, edge);
+}
+
+__attribute__((target("avx2")))
+static unsigned special_mask_avx2(const char* data) {
+    const __m256i block = _mm256_loadu_si256((const __m256i*) data);
+    const __m256i edges = _mm256_cmpeq_epi8(block, _mm256_set1_epi8(MESSAGE_EDGE));
+    const __m256i escapes = _mm256_cmpeq_epi8(block, _mm256_set1_epi8(MESSAGE_ESCAPE));
+    return _mm256_movemask_epi8(_mm256_or_si256(edges, escapes));
+}
+
+__attribute__((target("avx2")))
+static size_t find_special_avx2(const char* data, size_t data_len) {
+    size_t i = 0;
+    for (; i + 32 <= data_len; i += 32) {
+        const unsigned mask = special_mask_avx2(&data[i]);
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return i + find_special_sse2(&data[i], data_len - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t count_special_avx2(const char* data, size_t data_len) {
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 32 <= data_len; i += 32) {
+        count += __builtin_popcount(special_mask_avx2(&data[i]));
+    }
+    return count + count_special_sse2(&data[i], data_len - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t encapsulate_avx2(const char* data, size_t data_len, char* message, size_t message_len, size_t* written) {
+    return encapsulate_blocks(special_mask_avx2, 32, data, data_len, message, message_len, written);
+}
+
+__attribute__((target("avx2")))
+static size_t decapsulate_avx2(const char* message, size_t message_len, char* data, size_t data_len,
+    size_t* decoded, bool* escape, bool* edge) {
+    return decapsulate_blocks(special_mask_avx2, 32, message, message_len, data, data_len, decoded, escape, edge);
+}
+
+#endif // PR_X86
+
+typedef struct {
+    const char* name;
+    size_t (*find_special)(const char* data, size_t data_len);
+    size_t (*count_special)(const char* data, size_t data_len);
+    size_t (*encapsulate)(const char* data, size_t data_len, char* message, size_t message_len, size_t* written);
+    size_t (*decapsulate)(const char* message, size_t message_len, char* data, size_t data_len,
+        size_t* decoded, bool* escape, bool* edge);
+} ScanImpl;
+
+static const ScanImpl scan_impls[PR_IMPL_COUNT] = {
+    [PR_IMPL_SCALAR] = {"scalar", find_special_scalar, count_special_scalar, pr_encapsulate_scalar, pr_decapsulate_scalar},
+#ifdef PR_X86
+    [PR_IMPL_SSE2] = {"sse2", find_special_sse2, count_special_sse2, encapsulate_sse2, decapsulate_sse2},
+    [PR_IMPL_AVX2] = {"avx2", find_special_avx2, count_special_avx2, encapsulate_avx2, decapsulate_avx2},
+#else
+    [PR_IMPL_SSE2] = {"sse2", NULL, NULL, NULL, NULL},
+    [PR_IMPL_AVX2] = {"avx2", NULL, NULL, NULL, NULL},
+#endif // PR_X86
+};
+
+static const ScanImpl* scan_impl = NULL;
+
+static bool impl_supported(ProtocolImpl impl) {
+#ifdef PR_X86
+    __builtin_cpu_init();
+    switch (impl) {
+        case PR_IMPL_SCALAR: return true;
+        case PR_IMPL_SSE2: return __builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt");
+        case PR_IMPL_AVX2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+        default: return false;
+    }
+#else
+    return impl == PR_IMPL_SCALAR;
+#endif // PR_X86
+}
+
+static const ScanImpl* get_scan_impl(void) {
+    if (scan_impl != NULL) return scan_impl;
+
+    for (int impl = PR_IMPL_COUNT - 1; impl >= PR_IMPL_SCALAR; --impl) {
+        if (pr_select_impl(impl)) break;
+    }
+    return scan_impl;
+}
+
+bool pr_select_impl(ProtocolImpl impl) {
+    if (impl < PR_IMPL_SCALAR || impl >= PR_IMPL_COUNT || !impl_supported(impl)) return false;
+
+    scan_impl = &scan_impls[impl];
+    return true;
+}
+
+ProtocolImpl pr_current_impl(void) {
+    return get_scan_impl() - scan_impls;
+}
+
+const char* pr_impl_name(ProtocolImpl impl) {
+    if (impl < PR_IMPL_SCALAR || impl >= PR_IMPL_COUNT) return "unknown";
+    return scan_impls[impl].name;
+}
+
+size_t pr_find_special(const char* data, size_t data_len) {
+    return get_scan_impl()->find_special(data, data_len);
+}
+
+size_t message_length(const char* data, size_t data_len) {
+    return data_len + get_scan_impl()->count_special(data, data_len);
+}
+
+size_t pr_encapsulate(const char* data, size_t data_len, char* message, size_t message_len, size_t* written) {
+    return get_scan_impl()->encapsulate(data, data_len, message, message_len, written);
+}
+
+size_t pr_decapsulate(const char* message, size_t message_len, char* data, size_t data_len,
+    size_t* decoded, bool* escape, bool* edge) {
+    return get_scan_impl()->decapsulate(message, message_len, data, data_len, decoded, escape, edge);
+}
+
+size_t pr_put_varint(char* data, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        data[length++] = (char) (value | 0x80);
+        value >>= 7;
+    }
+    data[length++] = (char) value;
+    return length;
+}
+
+/* Pads the varint to width bytes with continuation bits, for headers that
+ * are written before the value is known. The value has to fit. */
+size_t pr_put_varint_fixed(char* data, uint64_t value, size_t width) {
+    for (size_t i = 0; i + 1 < width; ++i) {
+        data[i] = (char) ((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    data[width - 1] = (char) value;
+    return width;
+}
+
+size_t pr_get_varint(const char* data, size_t data_len, uint64_t* value) {
+    uint64_t result = 0;
+    for (size_t i = 0; i < data_len && i < PR_MAX_VARINT_LENGTH; ++i) {
+        const unsigned char byte = data[i];
+        result |= (uint64_t) (byte & 0x7F) << (7 * i);
+
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+uint64_t pr_wire_order(int order) {
+    return order == PR_CONTROL_ORDER ? 0 : (uint64_t) order + 1;
+}
+
+int pr_order_from_wire(uint64_t wire) {
+    if (wire == 0) return PR_CONTROL_ORDER;
+    return wire - 1 > INT_MAX ? PR_UNKNOWN_ORDER : (int) (wire - 1);
+}
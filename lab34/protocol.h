@@ -2,11 +2,68 @@
 #define PROTOCOL_H
 
 #include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 #define MESSAGE_EDGE 0x7E
 #define MESSAGE_ESCAPE 0b01111101
 
-size_t message_length(char* data, size_t data_len);
-size_t pr_encapsulate(char* data, size_t data_len, char* message, size_t message_len);
+#define PR_MAX_VARINT_LENGTH 10
 
-#endif //! PROTOCOL_H
\ No newline at end of file
+/* Orders travel as varints shifted by one, zero is the control stream. */
+#define PR_CONTROL_ORDER (-2)
+#define PR_UNKNOWN_ORDER (-3)
+
+typedef enum {
+    PR_FORMAT_HDLC,
+    PR_FORMAT_LENGTH
+} PRFormat;
+
+#define PR_FORMAT_MASK(F) (1 << (F))
+
+/* A compressed frame carries a batch of complete frames, its payload is the
+ * varint length of the batch followed by the lz block. */
+#define PR_FLAG_COMPRESSED 0x01
+/* A sequenced data frame carries the stream offset of its first payload byte
+ * as a varint between the flags and the length. */
+#define PR_FLAG_SEQUENCED 0x02
+#define PR_COMPRESS_LIMIT (16 * 1024)
+
+typedef enum {
+    PR_IMPL_SCALAR,
+    PR_IMPL_SSE2,
+    PR_IMPL_AVX2,
+    PR_IMPL_COUNT
+} ProtocolImpl;
+
+bool pr_need_escape(char c);
+
+bool pr_select_impl(ProtocolImpl impl);
+ProtocolImpl pr_current_impl(void);
+const char* pr_impl_name(ProtocolImpl impl);
+
+size_t pr_find_special(const char* data, size_t data_len);
+
+size_t message_length(const char* data, size_t data_len);
+size_t pr_encapsulate(const char* data, size_t data_len, char* message, size_t message_len, size_t* written);
+
+/* Unescapes message into data (or drops the bytes if data is NULL) until
+ * data_len bytes are decoded, the message runs out or an edge is reached.
+ * Returns the message bytes consumed, an edge is consumed as well and flagged.
+ * An escape that ends the message is carried over to the next call. */
+size_t pr_decapsulate(const char* message, size_t message_len, char* data, size_t data_len,
+    size_t* decoded, bool* escape, bool* edge);
+
+size_t pr_put_varint(char* data, uint64_t value);
+size_t pr_put_varint_fixed(char* data, uint64_t value, size_t width);
+size_t pr_get_varint(const char* data, size_t data_len, uint64_t* value);
+
+uint64_t pr_wire_order(int order);
+int pr_order_from_wire(uint64_t wire);
+
+size_t message_length_scalar(const char* data, size_t data_len);
+size_t pr_encapsulate_scalar(const char* data, size_t data_len, char* message, size_t message_len, size_t* written);
+size_t pr_decapsulate_scalar(const char* message, size_t message_len, char* data, size_t data_len,
+    size_t* decoded, bool* escape, bool* edge);
+
+#endif //! PROTOCOL_H
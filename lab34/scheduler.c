@@ -0,0 +1,169 @@
+#include "scheduler.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+void sched_init(Scheduler* this, SchedulerPolicy policy, size_t quantum) {
+    memset(this, 0, sizeof(*this));
+    this->policy = policy;
+    this->quantum = quantum;
+
+    for (size_t i = 0; i < SCHED_PRIORITY_CLASSES; ++i) {
+        this->heads[i] = SCHED_NO_STREAM;
+    }
+}
+
+void sched_free(Scheduler* this) {
+    free(this->streams);
+    this->streams = NULL;
+    this->capacity = 0;
+}
+
+/* Streams are linked by index, so the table can move when it grows. */
+bool sched_reserve(Scheduler* this, size_t capacity) {
+    if (capacity <= this->capacity) return true;
+
+    SchedStream* streams = realloc(this->streams, capacity * sizeof(*streams));
+    if (streams == NULL) {
+        perror("realloc");
+        return false;
+    }
+
+    memset(&streams[this->capacity], 0, (capacity - this->capacity) * sizeof(*streams));
+    this->streams = streams;
+    for (size_t id = this->capacity; id < capacity; ++id) {
+        sched_reset_stream(this, id);
+    }
+    this->capacity = capacity;
+    return true;
+}
+
+static int stream_class(const Scheduler* this, int id) {
+    return this->policy == SCHED_PRIORITY ? this->streams[id].priority : 0;
+}
+
+static void unlink_stream(Scheduler* this, int id) {
+    SchedStream* stream = &this->streams[id];
+    int* head = &this->heads[stream_class(this, id)];
+
+    if (stream->next == id) {
+        *head = SCHED_NO_STREAM;
+    } else {
+        this->streams[stream->prev].next = stream->next;
+        this->streams[stream->next].prev = stream->prev;
+        if (*head == id) {
+            *head = stream->next;
+        }
+    }
+
+    stream->prev = stream->next = SCHED_NO_STREAM;
+}
+
+static void link_stream(Scheduler* this, int id) {
+    SchedStream* stream = &this->streams[id];
+    int* head = &this->heads[stream_class(this, id)];
+
+    if (*head == SCHED_NO_STREAM) {
+        stream->prev = stream->next = id;
+        *head = id;
+        return;
+    }
+
+    const int tail = this->streams[*head].prev;
+    stream->prev = tail;
+    stream->next = *head;
+    this->streams[tail].next = id;
+    this->streams[*head].prev = id;
+}
+
+void sched_reset_stream(Scheduler* this, int id) {
+    sched_deactivate(this, id);
+
+    SchedStream* stream = &this->streams[id];
+    stream->prev = stream->next = SCHED_NO_STREAM;
+    stream->priority = 0;
+    stream->deficit = 0;
+}
+
+void sched_set_priority(Scheduler* this, int id, int priority) {
+    if (priority < 0) priority = 0;
+    if (priority >= SCHED_PRIORITY_CLASSES) priority = SCHED_PRIORITY_CLASSES - 1;
+
+    SchedStream* stream = &this->streams[id];
+    if (stream->priority == priority) return;
+
+    if (stream->active) {
+        unlink_stream(this, id);
+        stream->priority = priority;
+        link_stream(this, id);
+    } else {
+        stream->priority = priority;
+    }
+}
+
+void sched_activate(Scheduler* this, int id) {
+    SchedStream* stream = &this->streams[id];
+    if (stream->active) return;
+
+    link_stream(this, id);
+    stream->active = true;
+    stream->deficit = 0;
+    this->active_count++;
+}
+
+void sched_deactivate(Scheduler* this, int id) {
+    SchedStream* stream = &this->streams[id];
+    if (!stream->active) return;
+
+    unlink_stream(this, id);
+    stream->active = false;
+    stream->deficit = 0;
+    this->active_count--;
+}
+
+bool sched_active(const Scheduler* this, int id) {
+    return this->streams[id].active;
+}
+
+bool sched_empty(const Scheduler* this) {
+    return this->active_count == 0;
+}
+
+size_t sched_active_count(const Scheduler* this) {
+    return this->active_count;
+}
+
+int sched_next(Scheduler* this, size_t* budget) {
+    for (size_t i = 0; i < SCHED_PRIORITY_CLASSES; ++i) {
+        const int id = this->heads[i];
+        if (id == SCHED_NO_STREAM) continue;
+
+        /* The deficit is refilled only once it is used up instead of growing
+         * by a quantum every round. That is only safe because every send is
+         * capped at the budget, so no stream ever overdraws. */
+        SchedStream* stream = &this->streams[id];
+        if (stream->deficit == 0) {
+            stream->deficit = this->quantum;
+        }
+
+        *budget = stream->deficit;
+        return id;
+    }
+
+    return SCHED_NO_STREAM;
+}
+
+void sched_consume(Scheduler* this, int id, size_t sent, bool backlogged) {
+    SchedStream* stream = &this->streams[id];
+    stream->deficit -= sent < stream->deficit ? sent : stream->deficit;
+
+    if (!backlogged) {
+        sched_deactivate(this, id);
+        return;
+    }
+
+    if (stream->deficit == 0) {
+        this->heads[stream_class(this, id)] = stream->next;
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SCHED_NO_STREAM (-1)
+#define SCHED_PRIORITY_CLASSES 4
+
+typedef enum {
+    SCHED_DRR,
+    SCHED_PRIORITY
+} SchedulerPolicy;
+
+typedef struct {
+    int prev;
+    int next;
+    bool active;
+
+    int priority;
+    size_t deficit;
+} SchedStream;
+
+typedef struct {
+    SchedulerPolicy policy;
+    size_t quantum;
+
+    SchedStream* streams;
+    size_t capacity;
+    int heads[SCHED_PRIORITY_CLASSES];
+    size_t active_count;
+} Scheduler;
+
+void sched_init(Scheduler* this, SchedulerPolicy policy, size_t quantum);
+void sched_free(Scheduler* this);
+bool sched_reserve(Scheduler* this, size_t capacity);
+void sched_reset_stream(Scheduler* this, int id);
+
+void sched_set_priority(Scheduler* this, int id, int priority);
+
+void sched_activate(Scheduler* this, int id);
+void sched_deactivate(Scheduler* this, int id);
+bool sched_active(const Scheduler* this, int id);
+bool sched_empty(const Scheduler* this);
+size_t sched_active_count(const Scheduler* this);
+
+int sched_next(Scheduler* this, size_t* budget);
+void sched_consume(Scheduler* this, int id, size_t sent, bool backlogged);
+
+#endif // !SCHEDULER_H
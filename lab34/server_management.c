@@ -1,13 +1,20 @@
 #include "server_management.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/eventfd.h>
 
 #include "utils.h"
 
 #define POLL_LISTENER_INDEX 0
-#define POLL_TUNNEL_INDEX 1
-#define POLL_CLIENT_OFFSET 2
+#define POLL_CLIENT_OFFSET 1
+
+#define EVENT_LISTENER 0
+#define EVENT_WAKEUP 1
+#define EVENT_TUNNEL_OFFSET 2
+#define EVENT_CLIENT_OFFSET (EVENT_TUNNEL_OFFSET + SERVER_MAX_TUNNELS)
 
 bool is_pollable(const struct pollfd* pollfd, int mask) {
     return pollfd->revents & mask;
@@ -22,21 +29,22 @@ bool can_write(const struct pollfd* pollfd) {
 }
 
 bool has_errors(const struct pollfd* pollfd) {
-    return is_pollable(pollfd, POLLERR);
+    return is_pollable(pollfd, POLLERR | POLLHUP);
 }
 
 bool is_ioable(const struct pollfd* pollfd) {
-    return is_pollable(pollfd, POLLIN | POLLOUT | POLLERR);
+    return is_pollable(pollfd, POLLIN | POLLOUT | POLLERR | POLLHUP);
 }
 
 struct pollfd* get_client(Server* this, size_t id) {
-    if (id >= MAX_CLIENTS || this->id_table[id] == REMOVED_CLIENT) return NULL;
+    if (id >= this->capacity || this->id_table[id] == REMOVED_CLIENT) return NULL;
 
     return &this->clients[this->id_table[id] + POLL_CLIENT_OFFSET];
 }
 
-struct pollfd* get_tunnel(Server* this) {
-    return &this->clients[POLL_TUNNEL_INDEX];
+struct pollfd* get_tunnel(Server* this, size_t tunnel) {
+    if (tunnel >= this->tunnel_count) return NULL;
+    return &this->tunnels[tunnel];
 }
 
 struct pollfd* get_listener(Server* this) {
@@ -56,7 +64,7 @@ bool client_pollable(Server* this, size_t id, int mask) {
 }
 
 bool client_ioable(Server* this, size_t id) {
-    return client_pollable(this, id, POLLIN | POLLOUT | POLLERR);
+    return client_pollable(this, id, POLLIN | POLLOUT | POLLERR | POLLHUP);
 }
 
 bool client_readable(Server* this, size_t id) {
@@ -68,72 +76,256 @@ bool client_writeable(Server* this, size_t id) {
 }
 
 bool client_has_errors(Server* this, size_t id) {
-    return client_pollable(this, id, POLLERR);
+    return client_pollable(this, id, POLLERR | POLLHUP);
+}
+
+size_t server_tunnel_count(Server* this) {
+    return this->tunnel_count;
+}
+
+int tunnel_fd(Server* this, size_t tunnel) {
+    const struct pollfd* pollfd = get_tunnel(this, tunnel);
+    if (pollfd == NULL) return -1;
+    return pollfd->fd;
+}
+
+bool tunnel_pollable(Server* this, size_t tunnel, int mask) {
+    const struct pollfd* pollfd = get_tunnel(this, tunnel);
+    if (pollfd == NULL) return false;
+    return is_pollable(pollfd, mask);
 }
 
-int tunnel_fd(Server* this) {
-    const struct pollfd* tunnel = get_tunnel(this);
-    if (tunnel == NULL) return -1;
-    return tunnel->fd;
+bool tunnel_ioable(Server* this, size_t tunnel) {
+    return tunnel_pollable(this, tunnel, POLLIN | POLLOUT | POLLERR | POLLHUP);
 }
 
-bool tunnel_pollable(Server* this, int mask) {
-    const struct pollfd* tunnel = get_tunnel(this);
-    if (tunnel == NULL) return false;
-    return is_pollable(tunnel, mask);
+bool tunnel_readable(Server* this, size_t tunnel) {
+    return tunnel_pollable(this, tunnel, POLLIN);
 }
 
-bool tunnel_ioable(Server* this) {
-    return tunnel_pollable(this, POLLIN | POLLOUT | POLLERR);
+bool tunnel_writeable(Server* this, size_t tunnel) {
+    return tunnel_pollable(this, tunnel, POLLOUT);
 }
 
-bool tunnel_readable(Server* this) {
-    return tunnel_pollable(this, POLLIN);
+bool tunnel_has_errors(Server* this, size_t tunnel) {
+    return tunnel_pollable(this, tunnel, POLLERR | POLLHUP);
 }
 
-bool tunnel_writeable(Server* this) {
-    return tunnel_pollable(this, POLLOUT);
+bool any_tunnel_has_errors(Server* this) {
+    for (size_t i = 0; i < this->tunnel_count; ++i) {
+        if (tunnel_has_errors(this, i)) return true;
+    }
+    return false;
 }
 
-bool tunnel_has_errors(Server* this) {
-    return tunnel_pollable(this, POLLERR);
+/* The ready tunnels among the fds wait_server counted. */
+size_t tunnels_ioable(Server* this) {
+    size_t count = 0;
+    for (size_t i = 0; i < this->tunnel_count; ++i) {
+        count += tunnel_ioable(this, i);
+    }
+    return count;
 }
 
 bool is_full(Server* this) {
     return this->client_count == MAX_CLIENTS;
 }
 
-int init_server(Server* this, const TunnelParams* params) {
-    memset(this, 0, sizeof(*this));
+size_t server_capacity(Server* this) {
+    return this->capacity;
+}
 
-    const int listen_fd = server_setup(&params->listener_addr, MAX_CLIENTS);
-    if (listen_fd == ERR_SOCKET) {
-        return EXIT_FAILURE;
-    }
+int reserve_clients(Server* this, size_t capacity) {
+    if (capacity <= this->capacity) return EXIT_SUCCESS;
 
-    const int tunnel_fd = client_setup(&params->tunnel_addr);
-    if (tunnel_fd == ERR_SOCKET) {
-        close(listen_fd);
+    struct pollfd* clients = realloc(this->clients, (capacity + POLL_CLIENT_OFFSET) * sizeof(*clients));
+    if (clients != NULL) this->clients = clients;
+    int* id_table = realloc(this->id_table, capacity * sizeof(*id_table));
+    if (id_table != NULL) this->id_table = id_table;
+    int* index_to_id = realloc(this->index_to_id, capacity * sizeof(*index_to_id));
+    if (index_to_id != NULL) this->index_to_id = index_to_id;
+    int* free_ids = realloc(this->free_ids, capacity * sizeof(*free_ids));
+    if (free_ids != NULL) this->free_ids = free_ids;
+
+    if (clients == NULL || id_table == NULL || index_to_id == NULL || free_ids == NULL) {
+        perror("realloc");
         return EXIT_FAILURE;
     }
 
-    for (size_t i = 0; i < MAX_CLIENTS; ++i) {
+    for (size_t i = this->capacity; i < capacity; ++i) {
         this->clients[POLL_CLIENT_OFFSET + i].fd = REMOVED_CLIENT;
-        this->clients[POLL_CLIENT_OFFSET + i].events = POLLIN | POLLOUT;
+        this->clients[POLL_CLIENT_OFFSET + i].events = POLLIN;
+        this->clients[POLL_CLIENT_OFFSET + i].revents = 0;
 
         this->id_table[i] = REMOVED_CLIENT;
         this->index_to_id[i] = NO_ID;
     }
+    this->capacity = capacity;
+
+    return EXIT_SUCCESS;
+}
+
+void free_tables(Server* this) {
+    free(this->clients);
+    free(this->id_table);
+    free(this->index_to_id);
+    free(this->free_ids);
+    this->clients = NULL;
+    this->id_table = this->index_to_id = this->free_ids = NULL;
+    this->capacity = 0;
+}
+
+int watch_fd(Server* this, int op, int fd, int events, uint32_t tag) {
+    struct epoll_event event = {.events = events, .data.u32 = tag};
+    if (epoll_ctl(this->epoll_fd, op, fd, &event)) {
+        perror("epoll_ctl");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int init_events(Server* this) {
+    this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->epoll_fd == -1) {
+        perror("epoll_create1");
+        return EXIT_FAILURE;
+    }
+
+    this->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->event_fd == -1) {
+        perror("eventfd");
+        close(this->epoll_fd);
+        return EXIT_FAILURE;
+    }
+
+    const bool listening = get_listener(this)->fd != REMOVED_CLIENT;
+    bool failed = (listening && watch_fd(this, EPOLL_CTL_ADD, get_listener(this)->fd, get_listener(this)->events, EVENT_LISTENER))
+        || watch_fd(this, EPOLL_CTL_ADD, this->event_fd, EPOLLIN, EVENT_WAKEUP);
+    for (size_t i = 0; !failed && i < this->tunnel_count; ++i) {
+        failed = watch_fd(this, EPOLL_CTL_ADD, this->tunnels[i].fd, this->tunnels[i].events, EVENT_TUNNEL_OFFSET + i);
+    }
+
+    if (failed) {
+        close(this->event_fd);
+        close(this->epoll_fd);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* Builds the server around already set up sockets, listen_fd may be
+ * REMOVED_CLIENT for a server that does not accept clients itself. */
+int init_server_fds(Server* this, int listen_fd, const int* tunnel_fds, size_t tunnel_count) {
+    memset(this, 0, sizeof(*this));
+    if (tunnel_count > SERVER_MAX_TUNNELS) return EXIT_FAILURE;
+
+    if (reserve_clients(this, SERVER_INITIAL_CAPACITY) == EXIT_FAILURE) {
+        free_tables(this);
+        return EXIT_FAILURE;
+    }
 
     get_listener(this)->fd = listen_fd;
     get_listener(this)->events = POLLIN;
 
-    get_tunnel(this)->fd = tunnel_fd;
-    get_tunnel(this)->events = POLLIN | POLLOUT;
+    for (size_t i = 0; i < tunnel_count; ++i) {
+        this->tunnels[i].fd = tunnel_fds[i];
+        this->tunnels[i].events = POLLIN;
+    }
+    this->tunnel_count = tunnel_count;
+
+    if (init_events(this) == EXIT_FAILURE) {
+        free_tables(this);
+        return EXIT_FAILURE;
+    }
 
     return EXIT_SUCCESS;
 }
 
+/* Opens params->connections tunnel connections to the same peer. */
+int init_server(Server* this, const TunnelParams* params) {
+    if (params->connections > SERVER_MAX_TUNNELS) return EXIT_FAILURE;
+
+    const int listen_fd = server_setup(&params->listener_addr, MAX_CLIENTS);
+    if (listen_fd == ERR_SOCKET) {
+        return EXIT_FAILURE;
+    }
+
+    int tunnel_fds[SERVER_MAX_TUNNELS];
+    size_t connected = 0;
+    for (; connected < params->connections; ++connected) {
+        tunnel_fds[connected] = client_setup(&params->tunnel_addr);
+        if (tunnel_fds[connected] == ERR_SOCKET) break;
+    }
+
+    if (connected < params->connections
+        || init_server_fds(this, listen_fd, tunnel_fds, params->connections) == EXIT_FAILURE) {
+        for (size_t i = 0; i < connected; ++i) {
+            close(tunnel_fds[i]);
+        }
+        close(listen_fd);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+struct pollfd* get_tagged(Server* this, uint32_t tag) {
+    switch (tag) {
+        case EVENT_LISTENER: return get_listener(this);
+        case EVENT_WAKEUP: return NULL;
+        default:
+            if (tag < EVENT_CLIENT_OFFSET) return get_tunnel(this, tag - EVENT_TUNNEL_OFFSET);
+            return get_client(this, tag - EVENT_CLIENT_OFFSET);
+    }
+}
+
+void clear_wakeup(Server* this) {
+    uint64_t value;
+    read(this->event_fd, &value, sizeof(value));
+}
+
+int wait_server(Server* this, int timeout) {
+    for (int i = 0; i < this->ready_count; ++i) {
+        struct pollfd* pollfd = get_tagged(this, this->events[i].data.u32);
+        if (pollfd != NULL) {
+            pollfd->revents = 0;
+        }
+    }
+    this->ready_count = 0;
+
+    int count;
+    do {
+        count = epoll_wait(this->epoll_fd, this->events, sizeof(this->events) / sizeof(*this->events), timeout);
+    } while (count == -1 && errno == EINTR);
+
+    if (count == -1) return -1;
+    this->ready_count = count;
+
+    int fd_count = 0;
+    for (int i = 0; i < count; ++i) {
+        struct pollfd* pollfd = get_tagged(this, this->events[i].data.u32);
+        if (pollfd == NULL) {
+            clear_wakeup(this);
+            continue;
+        }
+
+        pollfd->revents = this->events[i].events;
+        fd_count++;
+    }
+
+    return fd_count;
+}
+
+void notify_server(Server* this) {
+    const uint64_t value = 1;
+    write(this->event_fd, &value, sizeof(value));
+}
+
+int server_wakeup_fd(Server* this) {
+    return this->event_fd;
+}
+
 size_t get_client_count(Server* this) {
     return this->client_count;
 }
@@ -143,9 +335,13 @@ size_t get_poll_count(Server* this) {
 }
 
 void safe_cleanup(Server* this) {
+    close(this->epoll_fd);
+    close(this->event_fd);
     close(get_listener(this)->fd);
-    close(get_tunnel(this)->fd);
-    
+    for (size_t i = 0; i < this->tunnel_count; ++i) {
+        close(this->tunnels[i].fd);
+    }
+
     for (size_t i = 0; i < get_client_count(this); ++i) {
         close(get_client(this, this->index_to_id[i])->fd);
     }
@@ -153,6 +349,7 @@ void safe_cleanup(Server* this) {
 
 void cleanup_server(Server* this) {
     safe_cleanup(this);
+    free_tables(this);
 }
 
 void swap_poll(struct pollfd* lhs, struct pollfd* rhs) {
@@ -165,6 +362,7 @@ void disconnect_client(Server* this, size_t id) {
     if (get_client(this, id) == NULL) return;
     if (get_client(this, id)->fd == REMOVED_CLIENT) return;
 
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, get_client(this, id)->fd, NULL);
     close(get_client(this, id)->fd);
     get_client(this, id)->fd = REMOVED_CLIENT;
 }
@@ -185,13 +383,18 @@ void remove_client(Server* this, size_t id) {
 
     this->index_to_id[this->client_count] = NO_ID;
     this->id_table[id] = REMOVED_CLIENT;
+    this->free_ids[this->free_count++] = id;
 }
 
 int next_id(Server* this) {
-    for (size_t i = 0; i < MAX_CLIENTS; ++i) {
-        if (this->id_table[i] == REMOVED_CLIENT) return i;
+    if (this->free_count != 0) return this->free_ids[--this->free_count];
+    if (this->next_fresh_id == MAX_CLIENTS) return NO_ID;
+
+    if (this->next_fresh_id == this->capacity
+        && reserve_clients(this, min_size_t(2 * this->capacity, MAX_CLIENTS)) == EXIT_FAILURE) {
+        return NO_ID;
     }
-    return NO_ID;
+    return this->next_fresh_id++;
 }
 
 int add_client(Server* this, int client_fd) {
@@ -201,28 +404,45 @@ int add_client(Server* this, int client_fd) {
     this->id_table[id] = this->client_count;
     this->index_to_id[this->client_count] = id;
 
-    get_client(this, id)->fd = client_fd;
+    struct pollfd* client = get_client(this, id);
+    client->fd = client_fd;
+    client->events = POLLIN;
+    client->revents = 0;
+
+    if (watch_fd(this, EPOLL_CTL_ADD, client_fd, client->events, EVENT_CLIENT_OFFSET + id)) {
+        client->fd = REMOVED_CLIENT;
+        this->id_table[id] = REMOVED_CLIENT;
+        this->index_to_id[this->client_count] = NO_ID;
+        this->free_ids[this->free_count++] = id;
+        return NO_ID;
+    }
 
     this->client_count++;
     return id;
 }
 
-void set_pollable_on(struct pollfd* pollfd, int flags, bool pollable) {
-    if (pollable) {
-        pollfd->events |= flags;
-    } else {
-        pollfd->events &= ~flags;
-    }
+void set_pollable_on(Server* this, struct pollfd* pollfd, uint32_t tag, int flags, bool pollable) {
+    if (pollfd == NULL || pollfd->fd == REMOVED_CLIENT) return;
+
+    const short events = pollable ? (pollfd->events | flags) : (pollfd->events & ~flags);
+    if (events == pollfd->events) return;
+
+    pollfd->events = events;
+    watch_fd(this, EPOLL_CTL_MOD, pollfd->fd, pollfd->events, tag);
+}
+
+void set_tunnel_readable(Server* this, size_t tunnel, bool readable) {
+    set_pollable_on(this, get_tunnel(this, tunnel), EVENT_TUNNEL_OFFSET + tunnel, POLLIN, readable);
 }
 
-void set_readable(struct pollfd* pollfd, bool readable) {
-    set_pollable_on(pollfd, POLLIN, readable);
+void set_tunnel_writeable(Server* this, size_t tunnel, bool writeable) {
+    set_pollable_on(this, get_tunnel(this, tunnel), EVENT_TUNNEL_OFFSET + tunnel, POLLOUT, writeable);
 }
 
-void set_writeable(struct pollfd* pollfd, bool writeable) {
-    set_pollable_on(pollfd, POLLOUT, writeable);
+void set_client_readable(Server* this, size_t id, bool readable) {
+    set_pollable_on(this, get_client(this, id), EVENT_CLIENT_OFFSET + id, POLLIN, readable);
 }
 
-void set_tunnel_writeable(Server* this, bool writeable) {
-    set_writeable(get_tunnel(this), writeable);
+void set_client_writeable(Server* this, size_t id, bool writeable) {
+    set_pollable_on(this, get_client(this, id), EVENT_CLIENT_OFFSET + id, POLLOUT, writeable);
 }
@@ -5,24 +5,46 @@
 #include "socket_utils.h"
 
 #include <poll.h>
+#include <sys/epoll.h>
 #include <stddef.h>
 
 #define NO_ORDER (-1)
 #define REMOVED_CLIENT (-1)
 #define NO_ID (-1)
-#define MAX_CLIENTS 255
+#define MAX_CLIENTS 65536
+#define SERVER_INITIAL_CAPACITY 64
+#define SERVER_MAX_EVENTS 1024
+#define SERVER_MAX_TUNNELS 16
 
+/* Client tables start small and double on demand, released ids are kept on a
+ * stack and handed out again before the tables grow. */
 typedef struct {
-    struct pollfd clients[MAX_CLIENTS + 2];
+    struct pollfd* clients;
     size_t client_count;
 
-    int id_table[MAX_CLIENTS];
-    int index_to_id[MAX_CLIENTS];
+    struct pollfd tunnels[SERVER_MAX_TUNNELS];
+    size_t tunnel_count;
+    size_t capacity;
+
+    int* id_table;
+    int* index_to_id;
+    int* free_ids;
+    size_t free_count;
+    size_t next_fresh_id;
+
+    int epoll_fd;
+    int event_fd;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    int ready_count;
 } Server;
 
 typedef struct {
     SocketAddress listener_addr;
     SocketAddress tunnel_addr;
+    int policy;
+    size_t connections;
+    const char* stats_path;
+    bool io_uring;
 } TunnelParams;
 
 struct pollfd* get_listener(Server* this);
@@ -34,18 +56,27 @@ bool client_readable(Server* this, size_t id);
 bool client_writeable(Server* this, size_t id);
 bool client_has_errors(Server* this, size_t id);
 
-int tunnel_fd(Server* this);
-bool tunnel_pollable(Server* this, int mask);
-bool tunnel_ioable(Server* this);
-bool tunnel_readable(Server* this);
-bool tunnel_writeable(Server* this);
-bool tunnel_has_errors(Server* this);
+size_t server_tunnel_count(Server* this);
+int tunnel_fd(Server* this, size_t tunnel);
+bool tunnel_pollable(Server* this, size_t tunnel, int mask);
+bool tunnel_ioable(Server* this, size_t tunnel);
+bool tunnel_readable(Server* this, size_t tunnel);
+bool tunnel_writeable(Server* this, size_t tunnel);
+bool tunnel_has_errors(Server* this, size_t tunnel);
+bool any_tunnel_has_errors(Server* this);
+size_t tunnels_ioable(Server* this);
 
+int init_server_fds(Server* this, int listen_fd, const int* tunnel_fds, size_t tunnel_count);
 int init_server(Server* this, const TunnelParams* params);
 void safe_cleanup(Server* this);
 void cleanup_server(Server* this);
 
+int wait_server(Server* this, int timeout);
+void notify_server(Server* this);
+int server_wakeup_fd(Server* this);
+
 bool is_full(Server* this);
+size_t server_capacity(Server* this);
 size_t get_client_count(Server* this);
 size_t get_poll_count(Server* this);
 
@@ -53,9 +84,9 @@ int add_client(Server* this, int client_fd);
 void remove_client(Server* this, size_t id);
 void disconnect_client(Server* this, size_t id);
 
-void set_tunnel_writeable(Server* this, bool readable);
-
-/*void set_readable(Server* this, size_t id, bool readable);
-void set_writeable(Server* this, size_t id, bool readable);*/
+void set_tunnel_readable(Server* this, size_t tunnel, bool readable);
+void set_tunnel_writeable(Server* this, size_t tunnel, bool writeable);
+void set_client_readable(Server* this, size_t id, bool readable);
+void set_client_writeable(Server* this, size_t id, bool writeable);
 
 #endif // !SERVER_MANAGEMENT_H
\ No newline at end of file
@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+
+#include "shm_link.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define SL_OFFER 'M'
+#define SL_ACCEPT 'Y'
+#define SL_REFUSE 'N'
+
+#define SL_DOORBELL_DRAIN 64
+
+static size_t states_size(void) {
+    return sysconf(_SC_PAGESIZE);
+}
+
+static size_t link_size(void) {
+    return states_size() + 2 * SL_RING_SIZE;
+}
+
+static char* map_ring(int memfd, off_t offset) {
+    char* data = mmap(NULL, 2 * SL_RING_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    for (size_t i = 0; i < 2; ++i) {
+        if (mmap(&data[i * SL_RING_SIZE], SL_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd, offset) == MAP_FAILED) {
+            perror("mmap");
+            munmap(data, 2 * SL_RING_SIZE);
+            return NULL;
+        }
+    }
+
+    return data;
+}
+
+/* A side raises its flag and then looks at the position once more, the other
+ * side moves the position and then looks at the flag. The fences make sure
+ * at least one of them sees the other. */
+static void arm_waiting(uint32_t* waiting) {
+    __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Ring 0 carries the data of the creating side, ring 1 the answers. */
+static bool sl_map(ShmLink* this, int memfd, bool creator) {
+    this->states = mmap(NULL, states_size(), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (this->states == MAP_FAILED) {
+        perror("mmap");
+        this->states = NULL;
+        return false;
+    }
+
+    char* data[2];
+    for (size_t i = 0; i < 2; ++i) {
+        data[i] = map_ring(memfd, states_size() + i * SL_RING_SIZE);
+    }
+
+    this->tx = (SLRing) {&this->states[creator ? 0 : 1], data[creator ? 0 : 1]};
+    this->rx = (SLRing) {&this->states[creator ? 1 : 0], data[creator ? 1 : 0]};
+    if (this->tx.data == NULL || this->rx.data == NULL) return false;
+
+    /* Both sides start out asleep on an empty ring. */
+    arm_waiting(&this->rx.state->data_waiting);
+    return true;
+}
+
+static int create_memfd(void) {
+    const int memfd = memfd_create("shm_link", MFD_CLOEXEC);
+    if (memfd == -1) {
+        perror("memfd_create");
+        return -1;
+    }
+
+    if (ftruncate(memfd, link_size())) {
+        perror("ftruncate");
+        close(memfd);
+        return -1;
+    }
+
+    return memfd;
+}
+
+/* The offer is a single byte, carrying the memfd unless the creator failed
+ * to set the link up, so the peer always knows whether to answer. */
+static bool send_offer(int fd, int memfd) {
+    char offer = SL_OFFER;
+    struct iovec iov = {.iov_base = &offer, .iov_len = 1};
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1};
+
+    if (memfd != -1) {
+        memset(&control, 0, sizeof(control));
+        message.msg_control = control.space;
+        message.msg_controllen = sizeof(control.space);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    }
+
+    if (sendmsg(fd, &message, MSG_NOSIGNAL) != 1) {
+        perror("sendmsg");
+        return false;
+    }
+    return true;
+}
+
+static int receive_offer(int fd, int timeout) {
+    struct pollfd pollfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pollfd, 1, timeout) <= 0) return -1;
+
+    char offer = 0;
+    struct iovec iov = {.iov_base = &offer, .iov_len = 1};
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.space, .msg_controllen = sizeof(control.space)};
+
+    if (recvmsg(fd, &message, MSG_CMSG_CLOEXEC) != 1) return -1;
+
+    int memfd = -1;
+    const struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+        && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (offer != SL_OFFER && memfd != -1) {
+        close(memfd);
+        return -1;
+    }
+    return memfd;
+}
+
+static bool wait_answer(int fd, int timeout) {
+    struct pollfd pollfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pollfd, 1, timeout) <= 0) return false;
+
+    char answer;
+    return recv(fd, &answer, 1, 0) == 1 && answer == SL_ACCEPT;
+}
+
+/* Creates the mapping and hands it to the peer over the connected UNIX
+ * socket fd. Returns false if the tunnel has to stay on the socket. */
+bool sl_create(ShmLink* this, int fd, int timeout) {
+    memset(this, 0, sizeof(*this));
+    this->fd = fd;
+
+    const int memfd = create_memfd();
+    const bool mapped = memfd != -1 && sl_map(this, memfd, true);
+    const bool sent = send_offer(fd, mapped ? memfd : -1);
+    if (memfd != -1) {
+        close(memfd);
+    }
+
+    if (!mapped || !sent || !wait_answer(fd, timeout)) {
+        sl_free(this);
+        return false;
+    }
+    return true;
+}
+
+bool sl_attach(ShmLink* this, int fd, int timeout) {
+    memset(this, 0, sizeof(*this));
+    this->fd = fd;
+
+    const int memfd = receive_offer(fd, timeout);
+    if (memfd == -1) return false;
+
+    struct stat info;
+    bool mapped = false;
+    if (fstat(memfd, &info)) {
+        perror("fstat");
+    } else if ((size_t) info.st_size != link_size()) {
+        fprintf(stderr, "Shared memory link has a different size\n");
+    } else {
+        mapped = sl_map(this, memfd, false);
+    }
+    close(memfd);
+
+    const char answer = mapped ? SL_ACCEPT : SL_REFUSE;
+    if (send(fd, &answer, 1, MSG_NOSIGNAL) != 1) {
+        perror("send");
+        mapped = false;
+    }
+
+    if (!mapped) {
+        sl_free(this);
+    }
+    return mapped;
+}
+
+/* The socket belongs to the caller. */
+void sl_free(ShmLink* this) {
+    if (this->tx.data != NULL) {
+        munmap(this->tx.data, 2 * SL_RING_SIZE);
+    }
+    if (this->rx.data != NULL) {
+        munmap(this->rx.data, 2 * SL_RING_SIZE);
+    }
+    if (this->states != NULL) {
+        munmap(this->states, states_size());
+    }
+    memset(this, 0, sizeof(*this));
+}
+
+static int ring_doorbell(ShmLink* this) {
+    const char bell = 0;
+    if (send(this->fd, &bell, 1, MSG_DONTWAIT | MSG_NOSIGNAL) == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("send");
+        return -1;
+    }
+    return 0;
+}
+
+static int wake_waiting(ShmLink* this, uint32_t* waiting) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(waiting, __ATOMIC_RELAXED) || !__atomic_exchange_n(waiting, 0, __ATOMIC_RELAXED)) return 0;
+    return ring_doorbell(this);
+}
+
+static bool ring_broken(uint64_t used) {
+    if (used <= SL_RING_SIZE) return false;
+    fprintf(stderr, "Shared memory ring is corrupted\n");
+    return true;
+}
+
+/* Copies as much of the iovecs as fits and publishes it with one store.
+ * A writer that could not place everything asks the reader to ring it. */
+ssize_t sl_writev(ShmLink* this, const struct iovec* iov, size_t iov_count) {
+    SLRingState* state = this->tx.state;
+    const uint64_t tail = state->tail;
+
+    size_t written = 0;
+    size_t i = 0;
+    size_t offset = 0;
+    bool armed = false;
+
+    for (;;) {
+        const uint64_t used = tail + written - __atomic_load_n(&state->head, __ATOMIC_ACQUIRE);
+        if (ring_broken(used)) return -1;
+
+        for (size_t space = SL_RING_SIZE - used; space > 0 && i < iov_count;) {
+            const size_t count = iov[i].iov_len - offset < space ? iov[i].iov_len - offset : space;
+            memcpy(&this->tx.data[(tail + written) % SL_RING_SIZE], (const char*) iov[i].iov_base + offset, count);
+            written += count;
+            offset += count;
+            space -= count;
+            if (offset == iov[i].iov_len) {
+                ++i;
+                offset = 0;
+            }
+        }
+
+        if (i == iov_count || armed) break;
+        arm_waiting(&state->space_waiting);
+        armed = true;
+    }
+
+    if (written == 0) return 0;
+
+    __atomic_store_n(&state->tail, tail + written, __ATOMIC_RELEASE);
+    if (wake_waiting(this, &state->data_waiting) == -1) return -1;
+    return written;
+}
+
+/* Points data at everything readable, the mirrored mapping keeps it in one
+ * piece. A reader that found the ring empty asks the writer to ring it. */
+ssize_t sl_peek(ShmLink* this, const char** data) {
+    SLRingState* state = this->rx.state;
+    const uint64_t head = state->head;
+
+    uint64_t tail = __atomic_load_n(&state->tail, __ATOMIC_ACQUIRE);
+    if (tail == head) {
+        arm_waiting(&state->data_waiting);
+        tail = __atomic_load_n(&state->tail, __ATOMIC_ACQUIRE);
+    }
+    if (ring_broken(tail - head)) return -1;
+
+    *data = &this->rx.data[head % SL_RING_SIZE];
+    return tail - head;
+}
+
+void sl_consume(ShmLink* this, size_t count) {
+    if (count == 0) return;
+
+    SLRingState* state = this->rx.state;
+    __atomic_store_n(&state->head, state->head + count, __ATOMIC_RELEASE);
+    wake_waiting(this, &state->space_waiting);
+}
+
+bool sl_pending(const ShmLink* this) {
+    return __atomic_load_n(&this->rx.state->tail, __ATOMIC_ACQUIRE) != this->rx.state->head;
+}
+
+/* Takes the pending rings off the socket. Returns -1 once the peer is gone. */
+int sl_clear_doorbell(ShmLink* this) {
+    char bells[SL_DOORBELL_DRAIN];
+
+    for (;;) {
+        const ssize_t count = recv(this->fd, bells, sizeof(bells), MSG_DONTWAIT);
+        if (count == 0) return -1;
+        if (count > 0) {
+            if ((size_t) count < sizeof(bells)) return 0;
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        if (errno != EINTR) {
+            perror("recv");
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef SHM_LINK_H
+#define SHM_LINK_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SL_RING_SIZE (1 << 20)
+#define SL_CACHE_LINE 64
+
+/* Positions run freely and are taken modulo the ring size. Each side writes
+ * its own position and raises the flag asking the other to ring it once the
+ * position it waits for moves. */
+typedef struct {
+    uint64_t tail __attribute__((aligned(SL_CACHE_LINE)));
+    uint32_t space_waiting;
+
+    uint64_t head __attribute__((aligned(SL_CACHE_LINE)));
+    uint32_t data_waiting;
+} SLRingState;
+
+typedef struct {
+    SLRingState* state;
+    char* data;
+} SLRing;
+
+/* A tunnel between two processes on the same host: one single producer,
+ * single consumer ring per direction in a shared memfd mapping. The UNIX
+ * socket the mapping was passed over stays open as the doorbell, a side that
+ * found its ring empty or full sleeps on it, and its hangup is the end of the
+ * tunnel. */
+typedef struct {
+    int fd;
+    SLRingState* states;
+    SLRing tx;
+    SLRing rx;
+} ShmLink;
+
+bool sl_create(ShmLink* this, int fd, int timeout);
+bool sl_attach(ShmLink* this, int fd, int timeout);
+void sl_free(ShmLink* this);
+
+ssize_t sl_writev(ShmLink* this, const struct iovec* iov, size_t iov_count);
+ssize_t sl_peek(ShmLink* this, const char** data);
+void sl_consume(ShmLink* this, size_t count);
+
+bool sl_pending(const ShmLink* this);
+int sl_clear_doorbell(ShmLink* this);
+
+#endif // !SHM_LINK_H
@@ -1,11 +1,14 @@
 #include "socket_utils.h"
 
 #include <sys/types.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <errno.h>
 
 int server_setup(const SocketAddress* address, int backlog) {
     const int sockfd = socket(address->address.sa_family, SOCK_STREAM, 0);
@@ -45,6 +48,54 @@ int client_setup(const SocketAddress* address) {
     return sockfd;
 }
 
+/* Starts a nonblocking connect. The socket is writable once it finished
+ * and finish_connect tells how. */
+int start_connect(const SocketAddress* address, bool* connected) {
+    const int sockfd = socket(address->address.sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sockfd == -1) {
+        perror("socket");
+        return ERR_SOCKET;
+    }
+
+    *connected = connect(sockfd, &address->address, address->length) == 0;
+    if (!*connected && errno != EINPROGRESS) {
+        perror("connect");
+        close(sockfd);
+        return ERR_SOCKET;
+    }
+
+    return sockfd;
+}
+
+int finish_connect(int fd) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length)) {
+        perror("getsockopt");
+        return EXIT_FAILURE;
+    }
+
+    if (error != 0) {
+        fprintf(stderr, "connect: %s\n", strerror(error));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int set_nonblocking(int fd) {
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+bool is_local_socket(int fd) {
+    SocketAddress address = {.length = sizeof(address.storage)};
+    return getsockname(fd, &address.address, &address.length) == 0 && address.address.sa_family == AF_UNIX;
+}
+
 void init_addr_in(struct sockaddr_in* addr_in, in_addr_t addr, in_port_t port, size_t family) {
     memset(addr_in, 0, sizeof(*addr_in));
     addr_in->sin_addr.s_addr = addr;
@@ -52,7 +103,12 @@ void init_addr_in(struct sockaddr_in* addr_in, in_addr_t addr, in_port_t port, s
     addr_in->sin_family = family;
 }
 
+/* The address "unix" names a UNIX socket with the path given as the port. */
 int parse_address(SocketAddress* address, const char* addr_str, const char* port_str) {
+    if (strcmp(addr_str, "unix") == 0) {
+        return parse_unix_address(address, port_str);
+    }
+
     struct addrinfo* addrinfo;
 
     const int err_code = getaddrinfo(addr_str, port_str, NULL, &addrinfo);
@@ -67,3 +123,17 @@ int parse_address(SocketAddress* address, const char* addr_str, const char* port
 
     return EXIT_SUCCESS;
 }
+
+int parse_unix_address(SocketAddress* address, const char* path) {
+    struct sockaddr_un addr_un = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr_un.sun_path)) {
+        fprintf(stderr, "UNIX socket path is too long\n");
+        return EXIT_FAILURE;
+    }
+    strcpy(addr_un.sun_path, path);
+
+    memset(address, 0, sizeof(*address));
+    memcpy(&address->storage, &addr_un, sizeof(addr_un));
+    address->length = sizeof(addr_un);
+    return EXIT_SUCCESS;
+}
@@ -5,18 +5,28 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <stdbool.h>
 
 #define ERR_SOCKET (-1)
 
+/* The storage leaves room for UNIX socket paths. */
 typedef struct {
-    struct sockaddr address;
+    union {
+        struct sockaddr address;
+        struct sockaddr_storage storage;
+    };
     socklen_t length;
 } SocketAddress;
 
 int server_setup(const SocketAddress* address, int backlog);
 int client_setup(const SocketAddress* address);
+int start_connect(const SocketAddress* address, bool* connected);
+int finish_connect(int fd);
+int set_nonblocking(int fd);
+bool is_local_socket(int fd);
 
 void init_addr_in(struct sockaddr_in* addr_in, in_addr_t addr, in_port_t port, size_t family);
 int parse_address(SocketAddress* address, const char* addr_str, const char* port_str);
+int parse_unix_address(SocketAddress* address, const char* path);
 
 #endif // !SOCKET_UTILS_H
\ No newline at end of file
@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+
+#include "stats.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t stats_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+bool stats_table_init(StatsTable* this, size_t max_streams) {
+    this->block_count = (max_streams + STATS_BLOCK_SIZE - 1) / STATS_BLOCK_SIZE;
+    this->capacity = 0;
+    this->blocks = calloc(this->block_count, sizeof(*this->blocks));
+    if (this->blocks == NULL) {
+        perror("calloc");
+        return false;
+    }
+    return true;
+}
+
+void stats_table_free(StatsTable* this) {
+    for (size_t i = 0; this->blocks != NULL && i < this->block_count; ++i) {
+        free(this->blocks[i]);
+    }
+    free(this->blocks);
+    this->blocks = NULL;
+    this->capacity = 0;
+}
+
+/* Blocks are published before the capacity that covers them. */
+bool stats_table_reserve(StatsTable* this, size_t capacity) {
+    if (capacity <= this->capacity) return true;
+
+    const size_t blocks = (capacity + STATS_BLOCK_SIZE - 1) / STATS_BLOCK_SIZE;
+    if (blocks > this->block_count) return false;
+
+    for (size_t i = this->capacity / STATS_BLOCK_SIZE; i < blocks; ++i) {
+        if (this->blocks[i] != NULL) continue;
+
+        StreamStats* block = aligned_alloc(STATS_CACHE_LINE, STATS_BLOCK_SIZE * sizeof(*block));
+        if (block == NULL) {
+            perror("aligned_alloc");
+            return false;
+        }
+        memset(block, 0, STATS_BLOCK_SIZE * sizeof(*block));
+        __atomic_store_n(&this->blocks[i], block, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&this->capacity, blocks * STATS_BLOCK_SIZE, __ATOMIC_RELEASE);
+    return true;
+}
+
+size_t stats_table_capacity(const StatsTable* this) {
+    return __atomic_load_n(&this->capacity, __ATOMIC_ACQUIRE);
+}
+
+StreamStats* stats_stream(const StatsTable* this, int id) {
+    StreamStats* block = __atomic_load_n(&this->blocks[id / STATS_BLOCK_SIZE], __ATOMIC_ACQUIRE);
+    return &block[id % STATS_BLOCK_SIZE];
+}
+
+void stats_open_stream(StreamStats* this, int stream) {
+    stats_set(&this->bytes_in, 0);
+    stats_set(&this->bytes_out, 0);
+    stats_set(&this->frames, 0);
+    stats_set(&this->wire_bytes, 0);
+    stats_set(&this->picks, 0);
+    stats_set(&this->client_buffered, 0);
+    stats_set(&this->tunnel_buffered, 0);
+    stats_set(&this->read_full_ns, 0);
+    stats_set(&this->write_full_ns, 0);
+    this->read_full_since = 0;
+    this->write_full_since = 0;
+
+    __atomic_store_n(&this->stream, stream, __ATOMIC_RELAXED);
+    __atomic_store_n(&this->open, true, __ATOMIC_RELEASE);
+}
+
+void stats_close_stream(StreamStats* this) {
+    __atomic_store_n(&this->open, false, __ATOMIC_RELEASE);
+}
+
+/* Adds up the time spent full between the transitions the caller sees. */
+void stats_note_full(uint64_t* total_ns, uint64_t* since, bool full) {
+    if (full == (*since != 0)) return;
+
+    const uint64_t now = stats_now_ns();
+    if (full) {
+        *since = now;
+        return;
+    }
+
+    stats_add(total_ns, now - *since);
+    *since = 0;
+}
+
+static void write_counter(FILE* out, const char* name, uint64_t value) {
+    fprintf(out, " %s=%" PRIu64, name, value);
+}
+
+static uint64_t counter_diff(uint64_t minuend, uint64_t subtrahend) {
+    return minuend > subtrahend ? minuend - subtrahend : 0;
+}
+
+void stats_write_tunnel(FILE* out, size_t tunnel, const TunnelStats* this) {
+    const uint64_t payload = stats_get(&this->payload_bytes);
+    const uint64_t wire = stats_get(&this->wire_bytes);
+    const uint64_t closed = stats_get(&this->closed);
+
+    fprintf(out, "tunnel id=%zu", tunnel);
+    write_counter(out, "streams", counter_diff(stats_get(&this->opened), closed));
+    write_counter(out, "out", stats_get(&this->tunnel_out));
+    write_counter(out, "in", stats_get(&this->tunnel_in));
+    write_counter(out, "frames", stats_get(&this->frames));
+    write_counter(out, "payload", payload);
+    write_counter(out, "wire", wire);
+    write_counter(out, "overhead", counter_diff(wire, payload));
+    write_counter(out, "control_frames", stats_get(&this->control_frames));
+    write_counter(out, "control_events", stats_get(&this->control_events));
+    write_counter(out, "picks", stats_get(&this->picks));
+    write_counter(out, "opened", stats_get(&this->opened));
+    write_counter(out, "closed", closed);
+    write_counter(out, "buffer_bytes", stats_get(&this->buffer_bytes));
+    write_counter(out, "pooled_bytes", stats_get(&this->pooled_bytes));
+    fputc('\n', out);
+}
+
+/* One line per open stream. A stream reopened while it is being written may
+ * show counters of both of its users, which is fine for monitoring. */
+void stats_write_table(FILE* out, size_t tunnel, const StatsTable* this) {
+    const size_t capacity = stats_table_capacity(this);
+
+    for (size_t id = 0; id < capacity; ++id) {
+        const StreamStats* stream = stats_stream(this, id);
+        if (!__atomic_load_n(&stream->open, __ATOMIC_ACQUIRE)) continue;
+
+        const uint64_t payload = stats_get(&stream->bytes_in);
+        const uint64_t wire = stats_get(&stream->wire_bytes);
+
+        fprintf(out, "stream tunnel=%zu id=%zu stream=%d", tunnel, id, __atomic_load_n(&stream->stream, __ATOMIC_RELAXED));
+        write_counter(out, "in", payload);
+        write_counter(out, "out", stats_get(&stream->bytes_out));
+        write_counter(out, "frames", stats_get(&stream->frames));
+        write_counter(out, "wire", wire);
+        write_counter(out, "overhead", counter_diff(wire, payload));
+        write_counter(out, "picks", stats_get(&stream->picks));
+        write_counter(out, "client_buffered", stats_get(&stream->client_buffered));
+        write_counter(out, "tunnel_buffered", stats_get(&stream->tunnel_buffered));
+        write_counter(out, "read_full_ms", stats_get(&stream->read_full_ns) / 1000000);
+        write_counter(out, "write_full_ms", stats_get(&stream->write_full_ns) / 1000000);
+        fputc('\n', out);
+    }
+}
+
+int stats_listen(const char* path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "STATS_SOCKET path is too long\n");
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    const int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(sockfd, (struct sockaddr*) &address, sizeof(address))) {
+        perror("bind");
+        close(sockfd);
+        return -1;
+    }
+
+    if (listen(sockfd, STATS_BACKLOG)) {
+        perror("listen");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
@@ -0,0 +1,89 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define STATS_CACHE_LINE 64
+#define STATS_BLOCK_SIZE 64
+#define STATS_BACKLOG 4
+
+/* Counters have a single writer, the worker owning them, and are read by the
+ * stats thread. Relaxed atomic loads and stores keep both sides lock-free,
+ * and the padding keeps a reader from sharing a cache line with another
+ * worker's hot state. */
+typedef struct {
+    int stream;
+    bool open;
+
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t frames;
+    uint64_t wire_bytes;
+    uint64_t picks;
+
+    uint64_t client_buffered;
+    uint64_t tunnel_buffered;
+
+    uint64_t read_full_ns;
+    uint64_t write_full_ns;
+    uint64_t read_full_since;
+    uint64_t write_full_since;
+} __attribute__((aligned(STATS_CACHE_LINE))) StreamStats;
+
+typedef struct {
+    uint64_t tunnel_out;
+    uint64_t tunnel_in;
+    uint64_t frames;
+    uint64_t payload_bytes;
+    uint64_t wire_bytes;
+    uint64_t control_frames;
+    uint64_t control_events;
+    uint64_t picks;
+    uint64_t opened;
+    uint64_t closed;
+    uint64_t buffer_bytes;
+    uint64_t pooled_bytes;
+} __attribute__((aligned(STATS_CACHE_LINE))) TunnelStats;
+
+/* Stream stats live in blocks that never move once allocated, so the reader
+ * may walk them while the worker grows the table. */
+typedef struct {
+    StreamStats** blocks;
+    size_t block_count;
+    size_t capacity;
+} StatsTable;
+
+static inline void stats_add(uint64_t* counter, uint64_t value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static inline void stats_set(uint64_t* counter, uint64_t value) {
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stats_get(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_now_ns(void);
+
+bool stats_table_init(StatsTable* this, size_t max_streams);
+void stats_table_free(StatsTable* this);
+bool stats_table_reserve(StatsTable* this, size_t capacity);
+size_t stats_table_capacity(const StatsTable* this);
+
+StreamStats* stats_stream(const StatsTable* this, int id);
+
+void stats_open_stream(StreamStats* this, int stream);
+void stats_close_stream(StreamStats* this);
+void stats_note_full(uint64_t* total_ns, uint64_t* since, bool full);
+
+void stats_write_tunnel(FILE* out, size_t tunnel, const TunnelStats* this);
+void stats_write_table(FILE* out, size_t tunnel, const StatsTable* this);
+
+int stats_listen(const char* path);
+
+#endif // !STATS_H
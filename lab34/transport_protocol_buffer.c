@@ -1,15 +1,95 @@
 #include "transport_protocol_buffer.h"
 
+#include "lz.h"
 #include "utils.h"
-#include "protocol.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+/* Compression is kept up while it saves at least an eighth of the bytes. */
+#define TPB_RATIO_NUM 7
+#define TPB_RATIO_DEN 8
 
 void tpb_free(TPBuffer* this) {
     cb_free(&this->buffer);
+    free(this->scratch);
+    this->scratch = NULL;
 }
 
 void tpb_init(TPBuffer* this, size_t size) {
-    cb_init(&this->buffer, size);
+    memset(this, 0, sizeof(*this));
+    cb_init_mirrored(&this->buffer, size);
     this->order = TPB_NO_ORDER;
+    this->format = PR_FORMAT_HDLC;
+}
+
+/* Batches are compressed into the scratch area, the second half of which
+ * linearizes a batch that wraps around a non-mirrored buffer. */
+void tpb_enable_compression(TPBuffer* this) {
+    if (this->scratch == NULL) {
+        this->scratch = malloc(lz_bound(PR_COMPRESS_LIMIT) + PR_MAX_VARINT_LENGTH + PR_COMPRESS_LIMIT);
+    }
+    this->compress = this->scratch != NULL;
+}
+
+bool tpb_compressing(const TPBuffer* this) {
+    return this->compress && this->format == PR_FORMAT_LENGTH && this->passthrough_left == 0;
+}
+
+void tpb_note_passthrough(TPBuffer* this, size_t count) {
+    this->passthrough_left -= min_size_t(this->passthrough_left, count);
+}
+
+/* Data frames then carry the stream offset of their payload, so a stream may
+ * continue on another tunnel connection. Only the length format has room
+ * for it. */
+void tpb_enable_sequencing(TPBuffer* this) {
+    this->sequenced = true;
+}
+
+int tpb_data_flags(const TPBuffer* this) {
+    return this->sequenced ? PR_FLAG_SEQUENCED : TPB_FLAG_NONE;
+}
+
+void tpb_set_format(TPBuffer* this, PRFormat format) {
+    if (this->format == format) return;
+
+    if (this->order != TPB_NO_ORDER) {
+        cb_putc(&this->buffer, MESSAGE_EDGE);
+        this->order = TPB_NO_ORDER;
+    }
+    this->format = format;
+}
+
+size_t tpb_frame_header(char* header, int order, int flags, uint64_t seq, size_t length) {
+    size_t header_length = pr_put_varint(header, pr_wire_order(order));
+    header[header_length++] = (char) flags;
+    if (flags & PR_FLAG_SEQUENCED) {
+        header_length += pr_put_varint(&header[header_length], seq);
+    }
+    return header_length + pr_put_varint(&header[header_length], length);
+}
+
+size_t tpb_put_frame(TPBuffer* this, const char* data, size_t data_length, int order, int flags, uint64_t seq) {
+    if (data_length == 0) return 0;
+
+    char header[TPB_HEADER_LENGTH];
+    const size_t free_space = cb_free_space(&this->buffer);
+
+    size_t header_length = tpb_frame_header(header, order, flags, seq, data_length);
+    if (header_length + data_length > free_space) {
+        if (free_space <= TPB_HEADER_LENGTH) return 0;
+
+        data_length = free_space - TPB_HEADER_LENGTH;
+        header_length = tpb_frame_header(header, order, flags, seq, data_length);
+    }
+
+    cb_write(&this->buffer, header, header_length);
+    this->unsealed += header_length + data_length;
+    return cb_write(&this->buffer, data, data_length);
 }
 
 bool tpb_full(const TPBuffer* this) {
@@ -20,38 +100,194 @@ bool tpb_empty(const TPBuffer* this) {
     return cb_empty(&this->buffer);
 }
 
+void tpb_putc_escaped(TPBuffer* this, char c) {
+    if (pr_need_escape(c)) {
+        cb_putc(&this->buffer, MESSAGE_ESCAPE);
+    }
+    cb_putc(&this->buffer, c);
+}
+
+size_t tpb_order_length(const TPBuffer* this, int order) {
+    char wire[PR_MAX_VARINT_LENGTH];
+    const size_t wire_length = pr_put_varint(wire, pr_wire_order(order));
+
+    const size_t edges = this->order == TPB_NO_ORDER ? 1 : 2;
+    return edges + message_length(wire, wire_length);
+}
+
 void tpb_put_order(TPBuffer* this, int order) {
     if (this->order != TPB_NO_ORDER) {
         cb_putc(&this->buffer, MESSAGE_EDGE);
     }
 
+    char wire[PR_MAX_VARINT_LENGTH];
+    const size_t wire_length = pr_put_varint(wire, pr_wire_order(order));
+
     cb_putc(&this->buffer, MESSAGE_EDGE);
-    cb_putc(&this->buffer, CLIENT_CODE_SHIFT + (char) order);
+    for (size_t i = 0; i < wire_length; ++i) {
+        tpb_putc_escaped(this, wire[i]);
+    }
     this->order = order;
 }
 
-bool tpb_contol_message(TPBuffer* this, char op, int order) {
-    if (this->order != CONTROL_ORDER) {
-        const size_t control_length = this->order == TPB_NO_ORDER ? 2 : 3;
-        if (EVENT_MESSAGE_LENGTH + control_length > cb_free_space(&this->buffer)) {
+static bool tpb_control_event(TPBuffer* this, const char* event, size_t event_length) {
+    if (this->format == PR_FORMAT_LENGTH) {
+        char header[TPB_HEADER_LENGTH];
+        const size_t header_length = tpb_frame_header(header, CONTROL_ORDER, TPB_FLAG_NONE, 0, event_length);
+        if (header_length + event_length > cb_free_space(&this->buffer)) {
             return false;
         }
 
+        tpb_put_frame(this, event, event_length, CONTROL_ORDER, TPB_FLAG_NONE, 0);
+        return true;
+    }
+
+    size_t length = message_length(event, event_length);
+
+    if (this->order != CONTROL_ORDER) {
+        length += tpb_order_length(this, CONTROL_ORDER);
+    }
+
+    if (length > cb_free_space(&this->buffer)) {
+        return false;
+    }
+
+    if (this->order != CONTROL_ORDER) {
         tpb_put_order(this, CONTROL_ORDER);
     }
 
-    cb_putc(&this->buffer, op);
-    cb_putc(&this->buffer, CLIENT_CODE_SHIFT + order);
+    for (size_t i = 0; i < event_length; ++i) {
+        tpb_putc_escaped(this, event[i]);
+    }
 
     return true;
 }
 
-size_t tpb_encapsulate(TPBuffer* this, char* data, size_t data_length, int order) {
-    if (order > TPB_MAX_ORDER || order < 0) return 0;
+static bool tpb_has_operand(char op) {
+    return op == CLIENT_WINDOW || op == CLIENT_REMOVE || op == CLIENT_JOIN;
+}
+
+static size_t tpb_put_event(char* data, const TPBEvent* event) {
+    data[0] = event->op;
+    size_t length = 1 + pr_put_varint(&data[1], event->stream);
+    if (tpb_has_operand(event->op)) {
+        length += pr_put_varint(&data[length], event->operand);
+    }
+    return length;
+}
+
+void tpb_batch_init(const TPBuffer* this, TPBControlBatch* batch) {
+    batch->format = this->format;
+    batch->length = 0;
+
+    if (this->format == PR_FORMAT_LENGTH) {
+        batch->wire_length = TPB_HEADER_LENGTH;
+    } else {
+        batch->wire_length = this->order == CONTROL_ORDER ? 0 : tpb_order_length(this, CONTROL_ORDER);
+    }
+}
+
+/* Adds the event unless the batch would then take more than limit bytes of
+ * the buffer or outgrow TPB_CONTROL_BATCH_SIZE. */
+bool tpb_batch_add(TPBControlBatch* batch, const TPBEvent* event, size_t limit) {
+    char data[EVENT_MAX_LENGTH];
+    const size_t length = tpb_put_event(data, event);
+    const size_t wire_length = batch->format == PR_FORMAT_LENGTH ? length : message_length(data, length);
+
+    if (batch->length + length > TPB_CONTROL_BATCH_SIZE || batch->wire_length + wire_length > limit) {
+        return false;
+    }
+
+    memcpy(&batch->events[batch->length], data, length);
+    batch->length += length;
+    batch->wire_length += wire_length;
+    return true;
+}
+
+/* Writes the batch as a single control frame. The batch has to have been
+ * built against the buffer's free space. Returns its wire_length. */
+size_t tpb_batch_flush(TPBuffer* this, TPBControlBatch* batch) {
+    if (batch->length == 0) return 0;
+
+    const size_t wire_length = batch->wire_length;
+    tpb_control_event(this, batch->events, batch->length);
+    tpb_batch_init(this, batch);
+    return wire_length;
+}
+
+/* Returns the length of the control event at the start of event once all of
+ * it is available, 0 while more bytes are needed. */
+size_t tpb_parse_event(const char* event, size_t count, TPBEvent* parsed) {
+    if (count < 2) return 0;
+
+    uint64_t stream;
+    const size_t stream_length = pr_get_varint(&event[1], count - 1, &stream);
+    if (stream_length == 0) return 0;
+
+    size_t length = 1 + stream_length;
+    parsed->op = event[0];
+    parsed->stream = stream > INT_MAX ? PR_UNKNOWN_ORDER : (int) stream;
+    parsed->operand = 0;
+
+    if (tpb_has_operand(event[0])) {
+        const size_t operand_length = pr_get_varint(&event[length], count - length, &parsed->operand);
+        if (operand_length == 0) return 0;
+        length += operand_length;
+    }
+
+    return length;
+}
+
+void tpb_reader_init(TPBEventReader* this) {
+    this->length = 0;
+}
+
+char* tpb_reader_end(TPBEventReader* this) {
+    return &this->data[this->length];
+}
+
+size_t tpb_reader_space(const TPBEventReader* this) {
+    return sizeof(this->data) - this->length;
+}
+
+void tpb_reader_put(TPBEventReader* this, size_t count) {
+    this->length += count;
+}
+
+/* Parses up to max_events whole events and keeps the rest for later. A batch
+ * never splits an event, so an unparsed remainder as long as the longest
+ * event is garbage and gets dropped. */
+size_t tpb_reader_parse(TPBEventReader* this, TPBEvent* events, size_t max_events) {
+    size_t offset = 0;
+    size_t event_count = 0;
+    while (event_count < max_events) {
+        const size_t length = tpb_parse_event(&this->data[offset], this->length - offset, &events[event_count]);
+        if (length == 0) break;
+
+        offset += length;
+        event_count++;
+    }
+
+    if (event_count < max_events && this->length - offset >= EVENT_MAX_LENGTH) {
+        offset = this->length;
+    }
+
+    memmove(this->data, &this->data[offset], this->length - offset);
+    this->length -= offset;
+    return event_count;
+}
+
+/* seq is the stream offset of data, it only goes on the wire when the
+ * buffer is sequenced. */
+size_t tpb_encapsulate(TPBuffer* this, char* data, size_t data_length, int order, uint64_t seq) {
+    if (order < 0) return 0;
+
+    if (this->format == PR_FORMAT_LENGTH) {
+        return tpb_put_frame(this, data, data_length, order, tpb_data_flags(this), seq);
+    }
 
     if (order != this->order) {
-        const size_t control_length = this->order == TPB_NO_ORDER ? 2 : 3;
-        if (message_length(data, 1) + control_length > cb_free_space(&this->buffer)) {
+        if (message_length(data, 1) + tpb_order_length(this, order) > cb_free_space(&this->buffer)) {
             return 0;
         }
 
@@ -59,22 +295,156 @@ size_t tpb_encapsulate(TPBuffer* this, char* data, size_t data_length, int order
     }
 
     size_t encapsed = 0;
-    for (size_t i = 0; i < 2; ++i) {
-        const size_t msg_length = message_length(&data[encapsed], data_length);
-        const size_t contiguous_space = cb_free_contiguous_space(&this->buffer);
+    for (size_t i = 0; i < 2 && encapsed < data_length; ++i) {
+        size_t written;
+        encapsed += pr_encapsulate(&data[encapsed], data_length - encapsed,
+            cb_data_end(&this->buffer), cb_free_contiguous_space(&this->buffer), &written);
 
-        size_t count = pr_encapsulate(data, data_length, 
-            cb_data_end(&this->buffer), min_size_t(msg_length, contiguous_space));
+        cb_skip_right(&this->buffer, written);
+    }
 
-        cb_skip_right(&this->buffer, count);
-        encapsed += count;
+    return encapsed;
+}
 
-        if (count < contiguous_space) return encapsed;
+static size_t tpb_direct_header(const TPBuffer* this, int order) {
+    if (this->format == PR_FORMAT_HDLC) {
+        return order == this->order ? 0 : tpb_order_length(this, order);
     }
 
-    return encapsed;
+    char wire[PR_MAX_VARINT_LENGTH];
+    const size_t seq_length = this->sequenced ? PR_MAX_VARINT_LENGTH : 0;
+    return pr_put_varint(wire, pr_wire_order(order)) + 1 + seq_length + TPB_DIRECT_LENGTH_WIDTH;
+}
+
+/* Payload bytes that a frame read straight from a socket may carry now. The
+ * HDLC frame is stuffed in place, so every byte needs room to double. */
+size_t tpb_direct_space(const TPBuffer* this, int order) {
+    const size_t space = cb_free_contiguous_space(&this->buffer);
+    const size_t header = tpb_direct_header(this, order);
+    if (space <= header) return 0;
+
+    if (this->format == PR_FORMAT_HDLC) return (space - header) / 2;
+    return min_size_t(space - header, TPB_DIRECT_MAX);
+}
+
+static ssize_t tpb_read(int fd, char* data, size_t count) {
+    const ssize_t received = read(fd, data, count);
+    if (received == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        perror("read");
+        return -1;
+    }
+    return received == 0 ? -1 : received;
+}
+
+/* Reads up to max_count bytes of the stream from fd right into the buffer
+ * and frames them there, which spares the copy through a staging buffer.
+ * The length format reserves a header with a padded length. HDLC reads to
+ * the far end of the free space and stuffs towards the front, which never
+ * overtakes the unread bytes. Returns what cb_recv would. */
+ssize_t tpb_recv_frame(TPBuffer* this, int fd, int order, uint64_t seq, size_t max_count) {
+    const size_t count = min_size_t(max_count, tpb_direct_space(this, order));
+    if (order < 0 || count == 0) return 0;
+
+    char* end = cb_data_end(&this->buffer);
+
+    if (this->format == PR_FORMAT_LENGTH) {
+        size_t header_length = pr_put_varint(end, pr_wire_order(order));
+        end[header_length++] = (char) tpb_data_flags(this);
+        if (this->sequenced) {
+            header_length += pr_put_varint(&end[header_length], seq);
+        }
+
+        const ssize_t received = tpb_read(fd, &end[header_length + TPB_DIRECT_LENGTH_WIDTH], count);
+        if (received <= 0) return received;
+
+        header_length += pr_put_varint_fixed(&end[header_length], received, TPB_DIRECT_LENGTH_WIDTH);
+        cb_skip_right(&this->buffer, header_length + received);
+        this->unsealed += header_length + received;
+        return received;
+    }
+
+    char* data = &end[cb_free_contiguous_space(&this->buffer) - count];
+    const ssize_t received = tpb_read(fd, data, count);
+    if (received <= 0) return received;
+
+    if (order != this->order) {
+        tpb_put_order(this, order);
+    }
+
+    size_t written;
+    pr_encapsulate(data, received, cb_data_end(&this->buffer), cb_free_contiguous_space(&this->buffer), &written);
+    cb_skip_right(&this->buffer, written);
+    return received;
+}
+
+static void tpb_sample(TPBuffer* this, size_t raw, size_t packed) {
+    this->sample_raw += raw;
+    this->sample_packed += packed;
+    if (this->sample_raw < TPB_SAMPLE_SIZE) return;
+
+    if (this->sample_packed * TPB_RATIO_DEN > this->sample_raw * TPB_RATIO_NUM) {
+        this->passthrough_left = TPB_PASSTHROUGH_SIZE;
+    }
+    this->sample_raw = 0;
+    this->sample_packed = 0;
+}
+
+static const char* tpb_unsealed_data(TPBuffer* this, size_t count, char* copy) {
+    CyclicBuffer* buffer = &this->buffer;
+    const size_t first = (buffer->start + buffer->count - count) % buffer->size;
+    if (buffer->mirrored || first + count <= buffer->size) return &buffer->buf[first];
+
+    const size_t head = buffer->size - first;
+    memcpy(copy, &buffer->buf[first], head);
+    memcpy(&copy[head], buffer->buf, count - head);
+    return copy;
+}
+
+/* Makes the frames written since the last call final. While compression pays
+ * off they are replaced with a single compressed batch frame. */
+void tpb_seal(TPBuffer* this) {
+    const size_t pending = min_size_t(this->unsealed, cb_count(&this->buffer));
+    this->unsealed = 0;
+
+    if (this->compress && !tpb_compressing(this)) {
+        tpb_note_passthrough(this, pending);
+        return;
+    }
+    if (!tpb_compressing(this) || pending < TPB_COMPRESS_MIN || pending > PR_COMPRESS_LIMIT) return;
+
+    char* packed = this->scratch;
+    char* copy = &this->scratch[lz_bound(PR_COMPRESS_LIMIT) + PR_MAX_VARINT_LENGTH];
+    const char* batch = tpb_unsealed_data(this, pending, copy);
+
+    const size_t prefix = pr_put_varint(packed, pending);
+    const size_t compressed = lz_compress(batch, pending, &packed[prefix], pending - prefix - TPB_HEADER_LENGTH);
+
+    char header[TPB_HEADER_LENGTH];
+    const size_t header_length = tpb_frame_header(header, CONTROL_ORDER, PR_FLAG_COMPRESSED, 0, prefix + compressed);
+    tpb_sample(this, pending, compressed == 0 ? pending : header_length + prefix + compressed);
+    if (compressed == 0) return;
+
+    cb_drop_right(&this->buffer, pending);
+    cb_write(&this->buffer, header, header_length);
+    cb_write(&this->buffer, packed, prefix + compressed);
 }
 
 ssize_t tpb_send(TPBuffer* this, int fd) {
+    tpb_seal(this);
     return cb_send(&this->buffer, fd);
 }
+
+ssize_t tpb_send_link(TPBuffer* this, ShmLink* link) {
+    tpb_seal(this);
+
+    struct iovec iov[CB_MAX_SEGMENTS];
+    const size_t iov_count = cb_used_iov(&this->buffer, iov, cb_count(&this->buffer));
+    if (iov_count == 0) return 0;
+
+    const ssize_t sent = sl_writev(link, iov, iov_count);
+    if (sent > 0) {
+        cb_skip(&this->buffer, sent);
+    }
+    return sent;
+}
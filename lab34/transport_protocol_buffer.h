@@ -2,45 +2,138 @@
 #define TRANSPORT_PROTOCOL_BUFFER_H
 
 #include "cyclic_buffer.h"
+#include "protocol.h"
+#include "shm_link.h"
 
 #define TPB_NO_ORDER (-1)
-#define TPB_MAX_ORDER 255
 
 #ifdef DEBUG
 
 #define CLIENT_ADD 'A'
 #define CLIENT_REMOVE 'R'
+#define CLIENT_HELLO 'H'
+#define CLIENT_HELLO_ACK 'K'
+#define CLIENT_WINDOW 'W'
+#define CLIENT_JOIN 'J'
 
 #else 
 
 #define CLIENT_ADD 1
 #define CLIENT_REMOVE 2
+#define CLIENT_HELLO 3
+#define CLIENT_HELLO_ACK 4
+#define CLIENT_WINDOW 5
+#define CLIENT_JOIN 6
 
 #endif // DEBUG
 
-#ifdef DEBUG
-#define CLIENT_CODE_SHIFT 'a'
-#else 
-#define CLIENT_CODE_SHIFT 0
-#endif // DEBUG
+/* A control event is the op followed by the varint stream and, for
+ * CLIENT_WINDOW, CLIENT_REMOVE and CLIENT_JOIN, a varint operand: the credit,
+ * the bytes sent on the stream and the session. */
+#define EVENT_MAX_LENGTH (1 + 2 * PR_MAX_VARINT_LENGTH)
+
+#define CONTROL_ORDER PR_CONTROL_ORDER
+
+/* Stream ids name a slot and the generation it is in, so frames that are
+ * late for a closed stream do not reach the next user of the slot. The
+ * generation wraps after 256 reuses of a slot, a frame would have to lag that
+ * many closes behind to be mistaken. With MAX_CLIENTS slots the id still
+ * fits in 24 bits. */
+#define TPB_GENERATION_BITS 8
+#define TPB_GENERATION_MASK ((1 << TPB_GENERATION_BITS) - 1)
+#define TPB_STREAM_ID(slot, generation) (((slot) << TPB_GENERATION_BITS) | ((generation) & TPB_GENERATION_MASK))
+#define TPB_STREAM_SLOT(stream) ((stream) >> TPB_GENERATION_BITS)
+#define TPB_STREAM_GENERATION(stream) ((stream) & TPB_GENERATION_MASK)
 
-#define EVENT_MESSAGE_LENGTH 2
+/* A tunnel striped over several connections starts every stream on the
+ * connection its id hashes to. */
+static inline size_t tpb_stream_tunnel(int stream, size_t tunnel_count) {
+    return ((uint32_t) stream * 2654435761u >> 16) % tunnel_count;
+}
 
-#define CONTROL_ORDER 255
+#define TPB_FLAG_NONE 0
+
+#define TPB_HEADER_LENGTH (1 + 3 * PR_MAX_VARINT_LENGTH)
+
+/* Frames read straight from a socket carry their length in a padded varint
+ * of this width, which bounds them to 2 MiB. */
+#define TPB_DIRECT_LENGTH_WIDTH 3
+#define TPB_DIRECT_MAX ((1 << (7 * TPB_DIRECT_LENGTH_WIDTH)) - 1)
+
+/* Control events written together share one frame, up to this many bytes. */
+#define TPB_CONTROL_BATCH_SIZE 1024
+
+#define TPB_COMPRESS_MIN 128
+#define TPB_SAMPLE_SIZE (64 * 1024)
+#define TPB_PASSTHROUGH_SIZE (4 * 1024 * 1024)
 
 typedef struct {
     CyclicBuffer buffer;
     int order;
+    PRFormat format;
+
+    /* Frames written since the last send, the only ones that may still be compressed. */
+    size_t unsealed;
+    bool compress;
+    bool sequenced;
+    char* scratch;
+
+    size_t sample_raw;
+    size_t sample_packed;
+    size_t passthrough_left;
 } TPBuffer;
 
+typedef struct {
+    char op;
+    int stream;
+    uint64_t operand;
+} TPBEvent;
+
+typedef struct {
+    PRFormat format;
+    char events[TPB_CONTROL_BATCH_SIZE];
+    size_t length;
+    /* Upper bound of what the batch takes in the buffer, frame opening included. */
+    size_t wire_length;
+} TPBControlBatch;
+
+/* Control bytes as they are decoded, whole events are parsed off the front
+ * and a partial one waits for the rest. */
+typedef struct {
+    char data[TPB_CONTROL_BATCH_SIZE];
+    size_t length;
+} TPBEventReader;
+
 void tpb_free(TPBuffer* this);
 void tpb_init(TPBuffer* this, size_t size);
+void tpb_set_format(TPBuffer* this, PRFormat format);
+void tpb_enable_compression(TPBuffer* this);
+bool tpb_compressing(const TPBuffer* this);
+void tpb_note_passthrough(TPBuffer* this, size_t count);
+void tpb_enable_sequencing(TPBuffer* this);
+int tpb_data_flags(const TPBuffer* this);
+
+size_t tpb_frame_header(char* header, int order, int flags, uint64_t seq, size_t length);
 
 bool tpb_full(const TPBuffer* this);
 bool tpb_empty(const TPBuffer* this);
 
-size_t tpb_encapsulate(TPBuffer* this, char* data, size_t data_length, int order);
-bool tpb_contol_message(TPBuffer* this, char op, int order);
+size_t tpb_encapsulate(TPBuffer* this, char* data, size_t data_length, int order, uint64_t seq);
+size_t tpb_direct_space(const TPBuffer* this, int order);
+ssize_t tpb_recv_frame(TPBuffer* this, int fd, int order, uint64_t seq, size_t max_count);
+size_t tpb_parse_event(const char* event, size_t count, TPBEvent* parsed);
+
+void tpb_batch_init(const TPBuffer* this, TPBControlBatch* batch);
+bool tpb_batch_add(TPBControlBatch* batch, const TPBEvent* event, size_t limit);
+size_t tpb_batch_flush(TPBuffer* this, TPBControlBatch* batch);
+
+void tpb_reader_init(TPBEventReader* this);
+char* tpb_reader_end(TPBEventReader* this);
+size_t tpb_reader_space(const TPBEventReader* this);
+void tpb_reader_put(TPBEventReader* this, size_t count);
+size_t tpb_reader_parse(TPBEventReader* this, TPBEvent* events, size_t max_events);
+void tpb_seal(TPBuffer* this);
 ssize_t tpb_send(TPBuffer* this, int fd);
+ssize_t tpb_send_link(TPBuffer* this, ShmLink* link);
 
 #endif // !TRANSPORT_PROTOCOL_BUFFER_H
\ No newline at end of file